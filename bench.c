@@ -0,0 +1,1875 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "load_balancer.h"
+#include "command_log.h"
+#include "key_hash.h"
+#include "request_executor.h"
+#include "request_reader.h"
+#include "result_writer.h"
+#include "server.h"
+#include "slab.h"
+#include "utils.h"
+
+/**
+ * Micro-benchmarks for the Load Balancer. Every benchmark is selected by
+ * name from the command line, and prints a small table on stdout. An optional
+ * second argument limits the size of the benchmark (servers, keys, ...).
+ */
+
+extern unsigned int hash_function_key(void *a);
+
+/* results are written here, so the compiler can't drop the measured loops */
+static volatile unsigned int bench_sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* xorshift32, so the runs are reproducible */
+static unsigned int bench_rand(unsigned int *state)
+{
+	unsigned int x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+
+	return x;
+}
+
+static int compare_rings(const void *a, const void *b)
+{
+	unsigned int hash_a = ((const ring_t *)a)->hash;
+	unsigned int hash_b = ((const ring_t *)b)->hash;
+
+	return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+/**
+ * The linear scan that get_server used before the binary search, kept here
+ * as the reference for the routing benchmark.
+ */
+static unsigned int get_server_linear(load_balancer_t *main,
+									  unsigned int key_hash)
+{
+	unsigned int curr_hash, next_hash;
+	curr_hash = main->hashring[0].hash;
+
+	if (key_hash < curr_hash)
+		return main->hashring[0].server_id;
+
+	for (unsigned int i = 0; i < main->hashring_size - 1; i++) {
+		curr_hash = main->hashring[i].hash;
+		next_hash = main->hashring[i + 1].hash;
+
+		if (curr_hash < key_hash && key_hash <= next_hash)
+			return main->hashring[i + 1].server_id;
+	}
+
+	return main->hashring[0].server_id;
+}
+
+/**
+ * Builds a load balancer that only has the hashring filled, with the default
+ * rings for every server. Adding the servers one by one would measure the
+ * topology changes, not the lookups.
+ */
+static load_balancer_t *build_ring(unsigned int num_servers)
+{
+	load_balancer_t *main = init_load_balancer();
+
+	for (unsigned int id = 0; id < num_servers; id++) {
+		for (unsigned int k = 0; k < main->replicas; k++) {
+			ring_t ring = {get_replica_hash(id, k), id};
+			insert_ring(main, ring);
+		}
+	}
+
+	qsort(main->hashring, main->hashring_size, sizeof(ring_t), compare_rings);
+	build_ring_layout(main);
+
+	return main;
+}
+
+static void bench_routing(unsigned long limit)
+{
+	static const unsigned int sizes[] = {10, 100, 1000, 10000, 100000};
+	const unsigned int num_hashes = 1 << 16;
+	unsigned int *hashes = malloc(num_hashes * sizeof(unsigned int));
+	DIE(!hashes, "Failed while allocating the benchmark keys.\n");
+
+	unsigned int state = 0x9e3779b9;
+	for (unsigned int i = 0; i < num_hashes; i++)
+		hashes[i] = bench_rand(&state);
+
+	printf("%10s %10s %14s %14s %10s\n", "servers", "rings",
+		   "linear ns/op", "binary ns/op", "speedup");
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		if (sizes[s] > limit)
+			break;
+
+		load_balancer_t *main = build_ring(sizes[s]);
+
+		/**
+		 * The linear scan gets fewer lookups on big rings, otherwise the
+		 * benchmark would take minutes.
+		 */
+		unsigned int linear_ops = 20000000 / main->hashring_size;
+		if (linear_ops < 1000)
+			linear_ops = 1000;
+		unsigned int binary_ops = 4000000;
+		unsigned int sink = 0;
+
+		double start = now_ns();
+		for (unsigned int i = 0; i < linear_ops; i++)
+			sink += get_server_linear(main, hashes[i & (num_hashes - 1)]);
+		double linear = (now_ns() - start) / linear_ops;
+
+		start = now_ns();
+		for (unsigned int i = 0; i < binary_ops; i++)
+			sink -= get_server(main, hashes[i & (num_hashes - 1)]);
+		double binary = (now_ns() - start) / binary_ops;
+
+		/**
+		 * Both searches have to agree on every key.
+		 */
+		for (unsigned int i = 0; i < num_hashes; i += 64)
+			DIE(get_server(main, hashes[i]) !=
+				get_server_linear(main, hashes[i]), "Routing mismatch.\n");
+
+		bench_sink = sink;
+		printf("%10u %10u %14.1f %14.1f %9.1fx\n", sizes[s],
+			   main->hashring_size, linear, binary, linear / binary);
+
+		free_load_balancer(main);
+	}
+
+	free(hashes);
+}
+
+/**
+ * Fills the id map with ids taken with a stride, the way servers numbered
+ * 0, 1024, 2048, ... would be, and reports how far every id landed from its
+ * home slot. With a load factor under 1/2 the probe chains stay short for
+ * any stride, so a long one fails the benchmark.
+ */
+static void bench_idmap(unsigned long limit)
+{
+	static const unsigned int strides[] = {1, 64, 1024, 32768};
+	static const unsigned int sizes[] = {1000, 100000};
+	const unsigned int max_probe_allowed = 64;
+
+	printf("%10s %10s %10s %10s %10s %10s\n", "stride", "ids", "capacity",
+		   "avg probe", "max probe", "ns/get");
+
+	for (unsigned int s = 0; s < sizeof(strides) / sizeof(strides[0]); s++) {
+		for (unsigned int n = 0; n < sizeof(sizes) / sizeof(sizes[0]); n++) {
+			if (sizes[n] > limit)
+				break;
+
+			unsigned int num_ids = sizes[n];
+			id_map_t *map = id_map_create(1);
+
+			for (unsigned int i = 0; i < num_ids; i++)
+				id_map_set(map, i * strides[s], i);
+
+			/**
+			 * The distance of every id from its home slot, computed the
+			 * same way as id_map_slot.
+			 */
+			unsigned int mask = map->capacity - 1;
+			unsigned long long total = 0;
+			unsigned int max_probe = 0;
+			for (unsigned int i = 0; i <= mask; i++) {
+				if (map->slots[i].index == -1)
+					continue;
+
+				unsigned int home = (map->slots[i].id * 2654435769u) >>
+									map->shift;
+				unsigned int probe = (i - home) & mask;
+
+				total += probe;
+				if (probe > max_probe)
+					max_probe = probe;
+			}
+
+			unsigned int ops = 4000000;
+			unsigned int sink = 0;
+			double start = now_ns();
+			for (unsigned int i = 0; i < ops; i++)
+				sink += id_map_get(map, (i % num_ids) * strides[s]);
+			double get_ns = (now_ns() - start) / ops;
+
+			for (unsigned int i = 0; i < num_ids; i++)
+				DIE(id_map_get(map, i * strides[s]) != (int)i,
+					"Lost ids in the id map benchmark.\n");
+
+			bench_sink = sink;
+			printf("%10u %10u %10u %10.2f %10u %10.1f\n", strides[s], num_ids,
+				   map->capacity, (double)total / num_ids, max_probe, get_ns);
+
+			if (max_probe > max_probe_allowed) {
+				errno = ERANGE;
+				DIE(1, "The id map probe chains are too long.\n");
+			}
+
+			id_map_free(map);
+		}
+	}
+}
+
+/* the search of get_server before the layouts, on the ring_t array */
+static unsigned int get_server_rings(load_balancer_t *main,
+									 unsigned int key_hash)
+{
+	unsigned int pos = ring_lower_bound(main, key_hash);
+
+	return main->hashring[pos == main->hashring_size ? 0 : pos].server_id;
+}
+
+/**
+ * Searches hashrings of 1k to 1M rings, made of random hashes, through the
+ * ring_t array and through both layouts of the hashes. Every search gets a
+ * new random hash, so the big rings don't stay in the cache.
+ */
+static void bench_layout(unsigned long limit)
+{
+	const unsigned int num_hashes = 1 << 22;
+	const unsigned int ops = 4000000;
+	unsigned int *hashes = malloc(num_hashes * sizeof(unsigned int));
+	DIE(!hashes, "Failed while allocating the benchmark keys.\n");
+
+	unsigned int state = 0x68e31da4;
+	for (unsigned int i = 0; i < num_hashes; i++)
+		hashes[i] = bench_rand(&state);
+
+	printf("%10s %14s %14s %14s %10s\n", "rings", "ring_t ns/op",
+		   "sorted ns/op", "eytzinger ns/op", "speedup");
+
+	for (unsigned long rings = 1000; rings <= 1000000 && rings <= limit;
+		 rings *= 10) {
+		load_balancer_t *main = init_load_balancer();
+		double elapsed[3];
+		unsigned int sink = 0;
+
+		for (unsigned int i = 0; i < rings; i++) {
+			ring_t ring = {bench_rand(&state), i % 1000};
+			insert_ring(main, ring);
+		}
+		qsort(main->hashring, main->hashring_size, sizeof(ring_t),
+			  compare_rings);
+
+		double start = now_ns();
+		for (unsigned int i = 0; i < ops; i++)
+			sink += get_server_rings(main, hashes[i & (num_hashes - 1)]);
+		elapsed[0] = (now_ns() - start) / ops;
+
+		for (int layout = 0; layout < 2; layout++) {
+			main->ring_layout = layout;
+			build_ring_layout(main);
+
+			start = now_ns();
+			for (unsigned int i = 0; i < ops; i++)
+				sink -= get_server(main, hashes[i & (num_hashes - 1)]);
+			elapsed[1 + layout] = (now_ns() - start) / ops;
+
+			for (unsigned int i = 0; i < num_hashes; i += 64)
+				DIE(get_server(main, hashes[i]) !=
+					get_server_rings(main, hashes[i]), "Routing mismatch.\n");
+		}
+
+		bench_sink = sink;
+		printf("%10lu %14.1f %14.1f %14.1f %9.1fx\n", rings, elapsed[0],
+			   elapsed[1], elapsed[2], elapsed[0] / elapsed[2]);
+
+		free_load_balancer(main);
+	}
+
+	free(hashes);
+}
+
+static void make_key(char *key, unsigned int n)
+{
+	snprintf(key, 32, "key_%u", n);
+}
+
+static unsigned int server_capacity(server_memory_t *server)
+{
+	if (server->engine == SERVER_ENGINE_FLAT)
+		return server->flat->capacity;
+
+	return server->storage->hmax;
+}
+
+/**
+ * Grows a single server from 1k to 10M keys, and at every step measures the
+ * latency of retrieving random existing keys and the worst single store since
+ * the previous step.
+ */
+static void bench_storage_engine(server_engine_t engine, unsigned long limit)
+{
+	const unsigned int lookups = 1000000;
+	server_memory_t *server = init_server_memory_engine(engine);
+	char key[32];
+	unsigned int stored = 0;
+	unsigned int state = 0x2545f491;
+
+	printf("%s engine\n", engine == SERVER_ENGINE_FLAT ? "flat" : "chained");
+	printf("%10s %10s %16s %16s\n", "keys", "capacity", "retrieve ns/op",
+		   "worst store us");
+
+	for (unsigned long step = 1000; step <= 10000000 && step <= limit;
+		 step *= 10) {
+		double worst = 0;
+
+		for (; stored < step; stored++) {
+			make_key(key, stored);
+
+			double start = now_ns();
+			server_store(server, key, "value");
+			double elapsed = now_ns() - start;
+
+			if (elapsed > worst)
+				worst = elapsed;
+		}
+
+		unsigned int found = 0;
+		double start = now_ns();
+		for (unsigned int i = 0; i < lookups; i++) {
+			make_key(key, bench_rand(&state) % stored);
+			found += server_retrieve(server, key) != NULL;
+		}
+		double retrieve = (now_ns() - start) / lookups;
+
+		DIE(found != lookups, "Lost keys in the storage benchmark.\n");
+		bench_sink = found;
+
+		printf("%10u %10u %16.1f %16.1f\n", stored,
+			   server_capacity(server), retrieve, worst / 1000);
+	}
+
+	free_server_memory(server);
+}
+
+static void bench_storage(unsigned long limit)
+{
+	bench_storage_engine(SERVER_ENGINE_CHAINED, limit);
+	bench_storage_engine(SERVER_ENGINE_FLAT, limit);
+}
+
+/**
+ * Churns a hashtable (removes a random key, stores another one) with its
+ * entries allocated by malloc or by a slab, then measures how long it takes
+ * to free the whole table.
+ */
+static void bench_alloc_run(int use_slab, unsigned int keys)
+{
+	const unsigned int churn = 4 * keys;
+	hashtable_t *ht = ht_create(HMAX, hash_function_key,
+								key_val_free_function,
+								compare_function_strings);
+	slab_t *slab = use_slab ? slab_create() : NULL;
+	char key[32], value[64];
+	unsigned int state = 0x1234567;
+
+	ht_set_slab(ht, slab);
+
+	double start = now_ns();
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(key, i);
+		snprintf(value, sizeof(value), "value_%u", bench_rand(&state));
+		ht_put(ht, key, strlen(key) + 1, value, strlen(value) + 1);
+	}
+	double fill = (now_ns() - start) / keys;
+
+	start = now_ns();
+	for (unsigned int i = 0; i < churn; i++) {
+		make_key(key, bench_rand(&state) % (2 * keys));
+		ht_remove_entry(ht, key);
+
+		make_key(key, bench_rand(&state) % (2 * keys));
+		snprintf(value, sizeof(value), "value_%u%s", i, i & 1 ? "_long" : "");
+		ht_put(ht, key, strlen(key) + 1, value, strlen(value) + 1);
+	}
+	double churned = (now_ns() - start) / churn;
+
+	start = now_ns();
+	ht_free(ht);
+	if (slab)
+		slab_destroy(slab);
+	double release = (now_ns() - start) / 1e6;
+
+	printf("%10s %10u %14.1f %14.1f %14.1f\n", use_slab ? "slab" : "malloc",
+		   keys, fill, churned, release);
+}
+
+static void bench_alloc(unsigned long limit)
+{
+	printf("%10s %10s %14s %14s %14s\n", "allocator", "keys", "put ns/op",
+		   "churn ns/op", "free ms");
+
+	for (unsigned long keys = 10000; keys <= 1000000 && keys <= limit;
+		 keys *= 10) {
+		bench_alloc_run(0, keys);
+		bench_alloc_run(1, keys);
+	}
+}
+
+/**
+ * Routes the key hashes in a load balancer made of servers with the given
+ * weights, and fills the number of keys that landed on every server. Only
+ * the routing is needed, so the keys are not actually stored.
+ */
+static void count_keys(unsigned int replicas, const unsigned int *weights,
+					   unsigned int num_servers, const unsigned int *hashes,
+					   unsigned int num_keys, unsigned int *counts)
+{
+	lb_config_t config;
+	lb_config_defaults(&config);
+	config.replicas = replicas;
+
+	load_balancer_t *main = init_load_balancer_with(&config);
+	unsigned int state = 0x6c078965;
+
+	/**
+	 * The ids are spread over both labeling schemes, the small ids and the
+	 * ones above RING_LABEL_BASE.
+	 */
+	unsigned int *ids = malloc(num_servers * sizeof(unsigned int));
+	DIE(!ids, "Failed while allocating the benchmark servers.\n");
+
+	for (unsigned int i = 0; i < num_servers; i++) {
+		do {
+			ids[i] = bench_rand(&state) % (10 * RING_LABEL_BASE);
+		} while (get_index(main, ids[i]) != -1);
+
+		loader_add_server_weighted(main, ids[i], weights ? weights[i] : 1);
+	}
+
+	memset(counts, 0, num_servers * sizeof(unsigned int));
+	for (unsigned int i = 0; i < num_keys; i++) {
+		unsigned int id = get_server(main, hashes[i]);
+
+		for (unsigned int s = 0; s < num_servers; s++) {
+			if (ids[s] == id) {
+				counts[s]++;
+				break;
+			}
+		}
+	}
+
+	free(ids);
+	free_load_balancer(main);
+}
+
+/**
+ * The quality of the key distribution, as a function of the number of rings
+ * of every server: the most and least loaded servers and the standard
+ * deviation, relative to the mean. Then, servers with the weights 1 to 4 are
+ * checked to get a share of the keys that is proportional to their weight.
+ */
+static void bench_distribution(unsigned long limit)
+{
+	static const unsigned int replicas[] = {1, 3, 10, 40, 100, 200, 500};
+	const unsigned int num_keys = 1000000;
+	unsigned int num_servers = limit < 100 ? limit : 100;
+	unsigned int state = 0x2545f491;
+
+	if (num_servers == 0)
+		return;
+
+	unsigned int *hashes = malloc(num_keys * sizeof(unsigned int));
+	unsigned int *counts = malloc(num_servers * sizeof(unsigned int));
+	unsigned int *weights = malloc(num_servers * sizeof(unsigned int));
+	DIE(!hashes || !counts || !weights,
+		"Failed while allocating the benchmark keys.\n");
+
+	/**
+	 * The key hashes are uniform, so only the placement of the rings is
+	 * measured; djb2 on similar keys covers a small part of the hashring.
+	 */
+	for (unsigned int i = 0; i < num_keys; i++)
+		hashes[i] = bench_rand(&state);
+
+	printf("%u servers, %u keys\n", num_servers, num_keys);
+	printf("%10s %10s %10s %10s %12s\n", "replicas", "rings", "max/mean",
+		   "min/mean", "stddev/mean");
+
+	double mean = (double)num_keys / num_servers;
+	for (unsigned int r = 0; r < sizeof(replicas) / sizeof(replicas[0]); r++) {
+		count_keys(replicas[r], NULL, num_servers, hashes, num_keys, counts);
+
+		unsigned int max = 0, min = -1U;
+		double var = 0;
+		for (unsigned int s = 0; s < num_servers; s++) {
+			max = MAX(max, counts[s]);
+			min = MIN(min, counts[s]);
+			var += (counts[s] - mean) * (counts[s] - mean);
+		}
+
+		printf("%10u %10u %10.2f %10.2f %12.3f\n", replicas[r],
+			   replicas[r] * num_servers, max / mean, min / mean,
+			   sqrt(var / num_servers) / mean);
+	}
+
+	/**
+	 * Every weight gets the keys of its servers, divided by the keys it
+	 * should have got.
+	 */
+	const unsigned int weighted_replicas = 100;
+	unsigned int total_weight = 0;
+	double share[4] = {0};
+
+	for (unsigned int s = 0; s < num_servers; s++) {
+		weights[s] = 1 + s % 4;
+		total_weight += weights[s];
+	}
+
+	count_keys(weighted_replicas, weights, num_servers, hashes, num_keys,
+			   counts);
+	for (unsigned int s = 0; s < num_servers; s++)
+		share[weights[s] - 1] += counts[s];
+
+	printf("weights 1..4, %u replicas per unit of weight\n",
+		   weighted_replicas);
+	printf("%10s %10s %16s\n", "weight", "keys", "actual/expected");
+	for (unsigned int w = 1; w <= 4; w++) {
+		unsigned int servers = 0;
+		for (unsigned int s = 0; s < num_servers; s++)
+			servers += weights[s] == w;
+
+		double expected = (double)num_keys * w * servers / total_weight;
+		if (servers)
+			printf("%10u %10.0f %16.3f\n", w, share[w - 1],
+				   share[w - 1] / expected);
+	}
+
+	free(weights);
+	free(counts);
+	free(hashes);
+}
+
+/**
+ * Adds the servers to a load balancer that already has 10 servers with the
+ * given number of keys, one by one or in a single batch, and returns the time
+ * it took, in ms.
+ */
+static double add_servers(const int *ids, unsigned int num_servers,
+						  unsigned int keys, int batched)
+{
+	load_balancer_t *main = init_load_balancer();
+	char key[32];
+	int server_id;
+
+	for (int id = 0; id < 10; id++)
+		loader_add_server(main, RING_LABEL_BASE - 1 - id);
+
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(key, i);
+		loader_store(main, key, "value", &server_id);
+	}
+
+	double start = now_ns();
+	if (batched) {
+		loader_change_servers(main, ids, NULL, num_servers, NULL, 0);
+	} else {
+		for (unsigned int i = 0; i < num_servers; i++)
+			loader_add_server(main, ids[i]);
+	}
+	double elapsed = (now_ns() - start) / 1e6;
+
+	unsigned int stored = 0;
+	for (unsigned int i = 0; i < main->num_servers; i++)
+		stored += server_get_size(main->servers[i].memory);
+	DIE(stored != keys, "Lost keys in the topology benchmark.\n");
+
+	free_load_balancer(main);
+
+	return elapsed;
+}
+
+/**
+ * Brings up many servers at once, with loader_add_server for every one of
+ * them, and with a single loader_change_servers.
+ */
+static void bench_topology(unsigned long limit)
+{
+	static const unsigned int sizes[] = {100, 500, 2000};
+	static const unsigned int keys[] = {0, 100000, 1000000};
+	unsigned int state = 0x1b873593;
+
+	printf("%10s %10s %14s %14s %10s\n", "servers", "keys", "one by one ms",
+		   "batch ms", "speedup");
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		if (sizes[s] > limit)
+			break;
+
+		int *ids = malloc(sizes[s] * sizeof(int));
+		DIE(!ids, "Failed while allocating the benchmark servers.\n");
+		for (unsigned int i = 0; i < sizes[s]; i++)
+			ids[i] = bench_rand(&state) % (RING_LABEL_BASE - 10);
+
+		for (unsigned int k = 0; k < sizeof(keys) / sizeof(keys[0]); k++) {
+			double one = add_servers(ids, sizes[s], keys[k], 0);
+			double batch = add_servers(ids, sizes[s], keys[k], 1);
+
+			printf("%10u %10u %14.1f %14.1f %9.1fx\n", sizes[s], keys[k],
+				   one, batch, one / batch);
+		}
+
+		free(ids);
+	}
+}
+
+/**
+ * Adds one server to a cluster of 10 servers that hold all the keys, with
+ * and without key indices, and measures the store throughput while the
+ * cluster is filled, and how long the new server takes to join.
+ */
+static void bench_join_run(int key_index, unsigned int replicas,
+						   unsigned int keys)
+{
+	lb_config_t config;
+	lb_config_defaults(&config);
+	config.key_index = key_index;
+	config.replicas = replicas;
+
+	load_balancer_t *main = init_load_balancer_with(&config);
+	char key[32];
+	int server_id;
+
+	for (int id = 0; id < 10; id++)
+		loader_add_server(main, id);
+
+	/**
+	 * The numbers in the keys are scrambled, djb2 puts the keys that differ
+	 * only in the last digits close to each other on the hashring.
+	 */
+	double start = now_ns();
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(key, i * 2654435761u);
+		loader_store(main, key, "value", &server_id);
+	}
+	double store = (now_ns() - start) / keys;
+
+	start = now_ns();
+	loader_add_server(main, 10);
+	double join = (now_ns() - start) / 1e6;
+
+	unsigned int moved = server_get_size(main->servers[get_index(main, 10)].memory);
+
+	printf("%10s %10u %10u %14.1f %10u %12.1f %12.1f\n",
+		   key_index ? "on" : "off", replicas, keys, store, moved, join,
+		   join * 1e6 / (moved ? moved : 1));
+
+	free_load_balancer(main);
+}
+
+static void bench_join(unsigned long limit)
+{
+	static const unsigned int replicas[] = {LB_DEFAULT_REPLICAS, 100};
+
+	printf("%10s %10s %10s %14s %10s %12s %12s\n", "index", "replicas",
+		   "keys", "store ns/op", "moved", "join ms", "ns/moved");
+
+	for (unsigned long keys = 100000; keys <= 10000000 && keys <= limit;
+		 keys *= 10) {
+		for (unsigned int r = 0; r < 2; r++) {
+			bench_join_run(0, replicas[r], keys);
+			bench_join_run(1, replicas[r], keys);
+		}
+	}
+}
+
+static server_memory_t *route_by_hash(char *key, unsigned int key_hash,
+									 void *arg)
+{
+	server_memory_t **dests = arg;
+
+	(void)key;
+
+	return dests[key_hash % 4];
+}
+
+static long peak_rss_kb(void)
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/**
+ * Empties a server full of 100 byte values into 4 others, by copying every
+ * object (what a removed server used to do) or by relinking them. The peak
+ * RSS only grows, so every run is done in its own process, and the growth of
+ * the peak during the drain is the extra memory it needed.
+ */
+static void bench_drain_run(server_engine_t engine, int relink,
+							unsigned int keys)
+{
+	fflush(stdout);
+	if (fork() != 0) {
+		wait(NULL);
+		return;
+	}
+
+	server_memory_t *source = init_server_memory_engine(engine);
+	server_memory_t *dests[4];
+	char key[32], value[101];
+
+	for (unsigned int i = 0; i < 4; i++)
+		dests[i] = init_server_memory_engine(engine);
+
+	memset(value, 'v', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(key, i);
+		server_store(source, key, value);
+	}
+
+	long peak = peak_rss_kb();
+	double start = now_ns();
+	if (relink)
+		server_drain(source, route_by_hash, dests);
+	else
+		server_migrate(source, route_by_hash, dests);
+	free_server_memory(source);
+	double drain = (now_ns() - start) / 1e6;
+
+	printf("%10s %10s %10u %12.1f %12.1f %14.1f\n",
+		   engine == SERVER_ENGINE_FLAT ? "flat" : "chained",
+		   relink ? "relink" : "copy", keys, drain, drain * 1e6 / keys,
+		   (peak_rss_kb() - peak) / 1024.0);
+
+	for (unsigned int i = 0; i < 4; i++)
+		free_server_memory(dests[i]);
+	exit(0);
+}
+
+static void bench_drain(unsigned long limit)
+{
+	printf("%10s %10s %10s %12s %12s %14s\n", "engine", "drain", "keys",
+		   "drain ms", "ns/key", "extra peak MB");
+
+	for (unsigned long keys = 100000; keys <= 10000000 && keys <= limit;
+		 keys *= 10) {
+		for (int engine = 0; engine < 2; engine++) {
+			/**
+			 * The copy walks the flat table in slot order, so the keys
+			 * come sorted by hash (see ft_drain), which takes minutes for
+			 * the biggest server.
+			 */
+			if (engine == SERVER_ENGINE_CHAINED || keys < 10000000)
+				bench_drain_run(engine, 0, keys);
+			bench_drain_run(engine, 1, keys);
+		}
+	}
+}
+
+/* the number of objects of every server, mixed with its id */
+static unsigned long long cluster_signature(load_balancer_t *main)
+{
+	unsigned long long signature = 0;
+
+	for (unsigned int i = 0; i < main->num_servers; i++)
+		signature += (unsigned long long)server_get_size(
+						 main->servers[i].memory) *
+					 (2654435761u * (main->servers[i].server_id + 1));
+
+	return signature;
+}
+
+/**
+ * Removes a server of a cluster with the drain split between 1 to 8 threads,
+ * and adds it back every time, so every thread count drains the same
+ * objects. The servers have 100 rings each, so the removed one has objects
+ * for all the others, and its objects must end up in the same places. The
+ * short keys are hashed with the fast hash, djb2 would put them all on a few
+ * arcs of the hashring.
+ *
+ * The joins are timed on a Maglev cluster, where the added server takes
+ * objects from every other one. They always run on the calling thread, so
+ * drain_threads shouldn't change them.
+ */
+static void bench_rebalance(unsigned long limit)
+{
+	static const unsigned int threads[] = {1, 2, 4, 8};
+	char key[32];
+	int server_id;
+
+	printf("%8s %10s %10s %10s %10s %12s %10s %8s\n", "change", "engine",
+		   "keys", "threads", "moved", "ms", "speedup", "same");
+
+	for (unsigned long keys = 100000; keys <= 10000000 && keys <= limit;
+		 keys *= 10) {
+		for (int join = 0; join < 2; join++) {
+			for (int engine = 0; engine < 2; engine++) {
+				lb_config_t config;
+				lb_config_defaults(&config);
+				config.engine = engine;
+				config.router = join ? LB_ROUTER_MAGLEV : LB_ROUTER_RING;
+				config.replicas = 100;
+				config.key_hash = KEY_HASH_FAST;
+
+				load_balancer_t *main = init_load_balancer_with(&config);
+				for (int i = 0; i < 8; i++)
+					loader_add_server(main, i);
+				for (unsigned int i = 0; i < keys; i++) {
+					make_key(key, i);
+					loader_store(main, key, "value", &server_id);
+				}
+
+				/**
+				 * The first drain leaves the server as the others will find
+				 * it.
+				 */
+				loader_remove_server(main, 0);
+				loader_add_server(main, 0);
+
+				double base = 0;
+				unsigned long long expected = 0;
+
+				for (unsigned int t = 0;
+					 t < sizeof(threads) / sizeof(threads[0]); t++) {
+					main->drain_threads = threads[t];
+
+					if (join)
+						loader_remove_server(main, 0);
+
+					double start = now_ns();
+					if (join)
+						loader_add_server(main, 0);
+					else
+						loader_remove_server(main, 0);
+					double elapsed = (now_ns() - start) / 1e6;
+					unsigned long long signature = cluster_signature(main);
+
+					if (t == 0) {
+						base = elapsed;
+						expected = signature;
+					}
+
+					printf("%8s %10s %10lu %10u %10u %12.1f %9.2fx %8s\n",
+						   join ? "join" : "drain",
+						   engine == SERVER_ENGINE_FLAT ? "flat" : "chained",
+						   keys, threads[t], loader_get_moved(main), elapsed,
+						   base / elapsed, signature == expected ? "yes" : "NO");
+
+					if (!join)
+						loader_add_server(main, 0);
+				}
+
+				free_load_balancer(main);
+			}
+		}
+	}
+}
+
+static load_balancer_t *build_cluster(lb_router_t router,
+									 unsigned int num_servers)
+{
+	lb_config_t config;
+	lb_config_defaults(&config);
+	config.router = router;
+
+	load_balancer_t *main = init_load_balancer_with(&config);
+	int *ids = malloc(num_servers * sizeof(int));
+	DIE(!ids, "Failed while allocating the benchmark servers.\n");
+
+	for (unsigned int i = 0; i < num_servers; i++)
+		ids[i] = i;
+	loader_change_servers(main, ids, NULL, num_servers, NULL, 0);
+
+	free(ids);
+
+	return main;
+}
+
+static const char *const router_names[] = {"ring", "maglev", "jump",
+											"rendezvous"};
+
+#define NUM_ROUTERS (sizeof(router_names) / sizeof(router_names[0]))
+
+/* the memory used by the routing structures of a load balancer, in bytes */
+static unsigned long router_memory(load_balancer_t *main)
+{
+	if (main->router == LB_ROUTER_MAGLEV)
+		return main->lookup_size * sizeof(unsigned int);
+	if (main->router == LB_ROUTER_RENDEZVOUS)
+		return (main->hrw_size + HRW_BLOCK - 1) / HRW_BLOCK * HRW_BLOCK *
+			   2 * sizeof(unsigned int);
+	if (main->router == LB_ROUTER_JUMP)
+		return 0;
+
+	return main->hashring_capacity * sizeof(ring_t);
+}
+
+/**
+ * Measures a topology change of a cluster that holds the keys: the objects
+ * it moved, against the ideal (only the share of the servers that came or
+ * left), and how long it took.
+ */
+static void router_change(load_balancer_t *main, const char *name,
+						  const int *add_ids, unsigned int num_add,
+						  const int *remove_ids, unsigned int num_remove,
+						  unsigned int keys)
+{
+	unsigned int before = main->num_servers;
+
+	double start = now_ns();
+	loader_change_servers(main, add_ids, NULL, num_add, remove_ids,
+						  num_remove);
+	double elapsed = (now_ns() - start) / 1e6;
+
+	unsigned int after = main->num_servers;
+	double ideal = 100.0 * (num_add ? (double)num_add / after :
+						   (double)num_remove / before);
+
+	printf("%10s %12s %10u %10.2f %10.2f %12.1f\n", router_names[main->router],
+		   name, loader_get_moved(main), 100.0 * loader_get_moved(main) / keys,
+		   ideal, elapsed);
+}
+
+/**
+ * Routes the hashes in a cluster, and prints the memory of the router and
+ * how even the load is: the most loaded server against the mean, and the
+ * standard deviation, relative to the mean.
+ */
+static void router_balance(lb_router_t router, unsigned int num_servers,
+						   const unsigned int *hashes, unsigned int num_hashes)
+{
+	load_balancer_t *main = build_cluster(router, num_servers);
+	unsigned int *counts = calloc(num_servers, sizeof(unsigned int));
+	DIE(!counts, "Failed while allocating the benchmark counters.\n");
+
+	for (unsigned int i = 0; i < num_hashes; i++)
+		counts[get_index(main, get_server(main, hashes[i]))]++;
+
+	double mean = (double)num_hashes / num_servers, var = 0;
+	unsigned int max = 0;
+
+	for (unsigned int i = 0; i < num_servers; i++) {
+		var += (counts[i] - mean) * (counts[i] - mean);
+		if (counts[i] > max)
+			max = counts[i];
+	}
+
+	printf("%10s %10u %12lu %10.3f %10.2f\n", router_names[router],
+		   num_servers, router_memory(main), max / mean,
+		   100.0 * sqrt(var / num_servers) / mean);
+
+	free(counts);
+	free_load_balancer(main);
+}
+
+/**
+ * Compares the routers: the cost of a lookup for clusters of growing size,
+ * the memory and the balance of the load, and the objects moved by the
+ * topology changes of a cluster of 100 servers.
+ */
+static void bench_router(unsigned long limit)
+{
+	static const unsigned int sizes[] = {10, 100, 1000, 10000};
+	const unsigned int num_hashes = 1 << 20;
+	unsigned int *hashes = malloc(num_hashes * sizeof(unsigned int));
+	DIE(!hashes, "Failed while allocating the benchmark keys.\n");
+
+	unsigned int state = 0x2545f491;
+	for (unsigned int i = 0; i < num_hashes; i++)
+		hashes[i] = bench_rand(&state);
+
+	printf("%10s", "servers");
+	for (unsigned int r = 0; r < NUM_ROUTERS; r++)
+		printf(" %11s ns", router_names[r]);
+	printf("\n");
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		if (sizes[s] > limit)
+			break;
+
+		unsigned int sink = 0;
+
+		printf("%10u", sizes[s]);
+		for (unsigned int r = 0; r < NUM_ROUTERS; r++) {
+			load_balancer_t *main = build_cluster(r, sizes[s]);
+
+			/* rendezvous hashing scores every server, so it gets fewer */
+			unsigned int ops = 4000000;
+			if (r == LB_ROUTER_RENDEZVOUS && sizes[s] > 100)
+				ops = 400000000 / sizes[s];
+
+			double start = now_ns();
+			for (unsigned int i = 0; i < ops; i++)
+				sink += get_server(main, hashes[i & (num_hashes - 1)]);
+			printf(" %14.1f", (now_ns() - start) / ops);
+
+			free_load_balancer(main);
+		}
+		printf("\n");
+
+		bench_sink = sink;
+	}
+
+	printf("\n%10s %10s %12s %10s %10s\n", "router", "servers",
+		   "memory B", "max/mean", "stddev %");
+
+	for (unsigned int s = 1; s < 3 && sizes[s] <= limit; s++)
+		for (unsigned int r = 0; r < NUM_ROUTERS; r++)
+			router_balance(r, sizes[s], hashes, num_hashes);
+
+	unsigned int keys = limit < 1000000 ? limit : 1000000;
+	int ids[10];
+	char key[32];
+	int server_id;
+
+	printf("\n%10s %12s %10s %10s %10s %12s\n", "router", "change", "moved",
+		   "moved %", "ideal %", "change ms");
+
+	for (unsigned int r = 0; r < NUM_ROUTERS; r++) {
+		load_balancer_t *main = build_cluster(r, 100);
+
+		for (unsigned int i = 0; i < keys; i++) {
+			make_key(key, i * 2654435761u);
+			loader_store(main, key, "value", &server_id);
+		}
+
+		for (unsigned int i = 0; i < 10; i++)
+			ids[i] = 100 + i;
+
+		router_change(main, "add 1", ids, 1, NULL, 0, keys);
+		router_change(main, "remove 1", NULL, 0, ids, 1, keys);
+		router_change(main, "add 10", ids, 10, NULL, 0, keys);
+		router_change(main, "remove 10", NULL, 0, ids, 10, keys);
+
+		free_load_balancer(main);
+	}
+
+	free(hashes);
+}
+
+/**
+ * Retrieves (and then stores again) the keys of a cluster of 100 servers in
+ * a random order, one by one and in batches of different sizes, and checks
+ * that the batches find the same values.
+ */
+static void bench_batch(unsigned long limit)
+{
+	static const unsigned int sizes[] = {1, 4, 16, 64, 256, 1024};
+	const unsigned int keys = limit < 1000000 ? limit : 1000000;
+	char (*names)[32] = malloc(keys * sizeof(*names));
+	char **order = malloc(keys * sizeof(char *));
+	char **values = malloc(keys * sizeof(char *));
+	char **new_values = malloc(keys * sizeof(char *));
+	int *ids = malloc(keys * sizeof(int));
+	DIE(!names || !order || !values || !new_values || !ids,
+		"Failed while allocating the benchmark keys.\n");
+
+	load_balancer_t *main = build_cluster(LB_ROUTER_RING, 100);
+	unsigned int state = 0x2545f491;
+	int server_id;
+
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(names[i], i);
+		loader_store(main, names[i], "value", &server_id);
+		order[i] = names[i];
+		new_values[i] = "other";
+	}
+
+	/* the keys are asked for in a random order, as from many clients */
+	for (unsigned int i = keys; i > 1; i--) {
+		unsigned int j = bench_rand(&state) % i;
+		char *aux = order[i - 1];
+
+		order[i - 1] = order[j];
+		order[j] = aux;
+	}
+
+	printf("%10s %14s %14s %14s %14s\n", "batch", "retrieve ns",
+		   "many ns", "store ns", "many ns");
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		unsigned int batch = sizes[s], sink = 0;
+		double elapsed[4];
+
+		double start = now_ns();
+		for (unsigned int i = 0; i < keys; i++)
+			sink += loader_retrieve(main, order[i], &server_id) != NULL;
+		elapsed[0] = (now_ns() - start) / keys;
+
+		start = now_ns();
+		for (unsigned int i = 0; i < keys; i += batch)
+			loader_retrieve_many(main, order + i, MIN(batch, keys - i),
+								 values + i, ids + i);
+		elapsed[1] = (now_ns() - start) / keys;
+
+		for (unsigned int i = 0; i < keys; i++) {
+			char *value = loader_retrieve(main, order[i], &server_id);
+
+			DIE(value != values[i] || server_id != ids[i],
+				"The batch found another value.\n");
+		}
+
+		start = now_ns();
+		for (unsigned int i = 0; i < keys; i++)
+			loader_store(main, order[i], "value", &server_id);
+		elapsed[2] = (now_ns() - start) / keys;
+
+		start = now_ns();
+		for (unsigned int i = 0; i < keys; i += batch)
+			loader_store_many(main, order + i, new_values + i,
+							  MIN(batch, keys - i), ids + i, NULL);
+		elapsed[3] = (now_ns() - start) / keys;
+
+		printf("%10u %14.1f %14.1f %14.1f %14.1f\n", batch, elapsed[0],
+			   elapsed[1], elapsed[2], elapsed[3]);
+
+		bench_sink = sink;
+	}
+
+	free_load_balancer(main);
+	free(names);
+	free(order);
+	free(values);
+	free(new_values);
+	free(ids);
+}
+
+/**
+ * Stores keys that all get the same djb2 hash: every key is made of blocks
+ * "ab" or "bA", which add up the same under djb2 (33 * 'a' + 'b' is
+ * 33 * 'b' + 'A'), so the n blocks give 2^n keys in one bucket of one server.
+ */
+static double collision_attack(key_hash_t mode, unsigned int blocks)
+{
+	lb_config_t config;
+	lb_config_defaults(&config);
+	config.key_hash = mode;
+	config.hash_seed = 0x5eed1234;
+
+	load_balancer_t *main = init_load_balancer_with(&config);
+	char key[64];
+	int server_id;
+
+	for (int i = 0; i < 10; i++)
+		loader_add_server(main, i);
+
+	double start = now_ns();
+	for (unsigned int k = 0; k < (1u << blocks); k++) {
+		for (unsigned int b = 0; b < blocks; b++) {
+			key[2 * b] = (k >> b) & 1 ? 'b' : 'a';
+			key[2 * b + 1] = (k >> b) & 1 ? 'A' : 'b';
+		}
+		key[2 * blocks] = 0;
+		loader_store(main, key, "value", &server_id);
+	}
+	double elapsed = (now_ns() - start) / (1u << blocks);
+
+	free_load_balancer(main);
+
+	return elapsed;
+}
+
+/**
+ * Compares the hash functions of the keys on keys from 8 to 1024 bytes, then
+ * the stores of keys crafted to collide under djb2.
+ */
+static void bench_hash(unsigned long limit)
+{
+	static const unsigned int lengths[] = {8, 16, 32, 64, 128, 256, 1024};
+	const unsigned int num_keys = 1024;
+	char *keys = malloc(num_keys * 1025);
+	DIE(!keys, "Failed while allocating the benchmark keys.\n");
+
+	unsigned int state = 0x2545f491;
+	for (unsigned int i = 0; i < num_keys * 1025; i++)
+		keys[i] = 'a' + bench_rand(&state) % 26;
+
+	printf("%10s %14s %14s %10s\n", "key bytes", "djb2 ns", "fast ns",
+		   "speedup");
+
+	for (unsigned int l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+		unsigned int len = lengths[l], sink = 0;
+		unsigned int ops = 20000000 / len;
+		double elapsed[2];
+
+		for (unsigned int i = 0; i < num_keys; i++)
+			keys[i * 1025 + len] = 0;
+
+		for (int mode = 0; mode < 2; mode++) {
+			key_hash_fn hash = key_hash_get(mode);
+
+			double start = now_ns();
+			for (unsigned int i = 0; i < ops; i++)
+				sink += hash(keys + (i & (num_keys - 1)) * 1025, i);
+			elapsed[mode] = (now_ns() - start) / ops;
+		}
+
+		for (unsigned int i = 0; i < num_keys; i++)
+			keys[i * 1025 + len] = 'a';
+
+		printf("%10u %14.1f %14.1f %9.1fx\n", len, elapsed[0], elapsed[1],
+			   elapsed[0] / elapsed[1]);
+		bench_sink = sink;
+	}
+
+	free(keys);
+
+	printf("\n%10s %14s %14s\n", "colliding", "djb2 ns", "fast ns");
+	for (unsigned int blocks = 8; blocks <= 14 && (1ul << blocks) <= limit;
+		 blocks += 2)
+		printf("%10u %14.1f %14.1f\n", 1u << blocks,
+			   collision_attack(KEY_HASH_DJB2, blocks),
+			   collision_attack(KEY_HASH_FAST, blocks));
+}
+
+/* The work of one thread of the threads benchmark */
+struct bench_worker {
+	load_balancer_t *main;
+	char (*names)[32];	/* the stored keys */
+	unsigned int keys;
+	unsigned int ops;
+	unsigned int read_percent;	/* the other requests are stores */
+	unsigned int seed;
+	volatile int *running;	/* cleared by the workers, for the topology */
+};
+
+static void *bench_worker_run(void *arg)
+{
+	struct bench_worker *worker = arg;
+	unsigned int state = worker->seed, sink = 0;
+	char value[32];
+	int server_id;
+
+	for (unsigned int i = 0; i < worker->ops; i++) {
+		unsigned int r = bench_rand(&state);
+		char *key = worker->names[r % worker->keys];
+
+		if ((r >> 24) % 100 < worker->read_percent)
+			sink += loader_retrieve_copy(worker->main, key, value,
+										 sizeof(value), &server_id);
+		else
+			sink += loader_store(worker->main, key, "value", &server_id);
+	}
+
+	bench_sink = sink;
+
+	return NULL;
+}
+
+/* adds and removes a server, over and over, until the workers are done */
+static void *bench_topology_run(void *arg)
+{
+	struct bench_worker *worker = arg;
+	unsigned int changes = 0;
+
+	while (*worker->running) {
+		loader_add_server(worker->main, 1000);
+		loader_remove_server(worker->main, 1000);
+		changes++;
+	}
+
+	return (void *)(unsigned long)changes;
+}
+
+/**
+ * Runs the same number of requests on a concurrent Load Balancer, split
+ * between 1 to 8 threads, for mixes of retrieves and stores. The last mix
+ * also changes the servers from one more thread, while the others run.
+ */
+static void bench_threads(unsigned long limit)
+{
+	static const unsigned int threads[] = {1, 2, 4, 8};
+	static const unsigned int reads[] = {100, 90, 50, 90};
+	const unsigned int num_mixes = sizeof(reads) / sizeof(reads[0]);
+	const unsigned int keys = 200000, total_ops = 1000000;
+	char (*names)[32] = malloc(keys * sizeof(*names));
+	DIE(!names, "Failed while allocating the benchmark keys.\n");
+
+	lb_config_t config;
+	lb_config_defaults(&config);
+	config.concurrent = 1;
+
+	load_balancer_t *main = init_load_balancer_with(&config);
+	int server_id;
+
+	for (int i = 0; i < 100; i++)
+		loader_add_server(main, i);
+	for (unsigned int i = 0; i < keys; i++) {
+		make_key(names[i], i);
+		loader_store(main, names[i], "value", &server_id);
+	}
+
+	printf("%10s", "threads");
+	for (unsigned int m = 0; m < num_mixes; m++)
+		printf("   %3u%% reads", reads[m]);
+	printf(" changes/s  (Mops/s; the last mix changes the servers)\n");
+
+	for (unsigned int t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+		if (threads[t] > limit)
+			break;
+
+		printf("%10u", threads[t]);
+		for (unsigned int m = 0; m < num_mixes; m++) {
+			struct bench_worker workers[8];
+			pthread_t ids[8], topology;
+			volatile int running = 1;
+			int topology_changes = m == num_mixes - 1;
+
+			for (unsigned int i = 0; i < threads[t]; i++) {
+				workers[i].main = main;
+				workers[i].names = names;
+				workers[i].keys = keys;
+				workers[i].ops = total_ops / threads[t];
+				workers[i].read_percent = reads[m];
+				workers[i].seed = 0x2545f491 + i;
+				workers[i].running = &running;
+			}
+
+			double start = now_ns();
+			if (topology_changes)
+				pthread_create(&topology, NULL, bench_topology_run,
+							   &workers[0]);
+			for (unsigned int i = 0; i < threads[t]; i++)
+				pthread_create(&ids[i], NULL, bench_worker_run, &workers[i]);
+			for (unsigned int i = 0; i < threads[t]; i++)
+				pthread_join(ids[i], NULL);
+			double elapsed = now_ns() - start;
+
+			running = 0;
+			void *changes = NULL;
+			if (topology_changes)
+				pthread_join(topology, &changes);
+
+			printf(" %12.2f", total_ops / elapsed * 1e3);
+			if (topology_changes)
+				printf(" %9.0f", (unsigned long)changes / elapsed * 1e9);
+		}
+		printf("\n");
+	}
+
+	free_load_balancer(main);
+	free(names);
+}
+
+/**
+ * The parser of main.c before the request reader, kept for the comparison:
+ * lines of at most 1023 characters read by fgets, with strlen called for
+ * every character, and the key and the value copied out.
+ */
+static void legacy_key_value(char *key, char *value, char *request)
+{
+	int key_start = 0, value_start = 0;
+	int key_finish = 0, value_finish = 0;
+	int key_index = 0, value_index = 0;
+
+	for (unsigned int i = 0; i < strlen(request); ++i) {
+		if (request[i] == '"' && value_start != 1) {
+			if (key_start == 0)
+				key_start = 1;
+			else if (key_finish == 0)
+				key_finish = 1;
+			else if (value_start == 0)
+				value_start = 1;
+		} else {
+			if (key_start == 1 && key_finish == 0)
+				key[key_index++] = request[i];
+			else if (value_start == 1 && value_finish == 0)
+				value[value_index++] = request[i];
+		}
+	}
+
+	value[value_index - 1] = 0;
+}
+
+static void legacy_key(char *key, char *request)
+{
+	int key_start = 0, key_index = 0;
+
+	for (unsigned int i = 0; i < strlen(request); ++i) {
+		if (request[i] == '"')
+			key_start = 1;
+		else if (key_start == 1)
+			key[key_index++] = request[i];
+	}
+}
+
+static unsigned long parse_legacy(const char *path)
+{
+	static char request[1024], key[128], value[65536];
+	unsigned long sum = 0;
+	FILE *input = fopen(path, "rt");
+	DIE(!input, "Failed while opening the trace.\n");
+
+	while (fgets(request, sizeof(request), input)) {
+		request[strlen(request) - 1] = 0;
+
+		if (!strncmp(request, "store", sizeof("store") - 1)) {
+			legacy_key_value(key, value, request);
+			sum += key[0] + value[0];
+			memset(key, 0, sizeof(key));
+			memset(value, 0, sizeof(value));
+		} else if (!strncmp(request, "retrieve", sizeof("retrieve") - 1)) {
+			legacy_key(key, request);
+			sum += key[0];
+			memset(key, 0, sizeof(key));
+		} else {
+			sum += atoi(request + sizeof("add_server"));
+		}
+	}
+
+	fclose(input);
+
+	return sum;
+}
+
+static unsigned long parse_reader(const char *path)
+{
+	unsigned long sum = 0;
+	request_t request;
+	int fd = open(path, O_RDONLY);
+	DIE(fd < 0, "Failed while opening the trace.\n");
+
+	request_reader_t *reader = request_reader_create(fd);
+	while (request_next(reader, &request) > 0) {
+		if (request.key)
+			sum += request.key[0] + (request.value ? request.value[0] : 0);
+		else
+			sum += request.server_id;
+	}
+
+	request_reader_free(reader);
+	close(fd);
+
+	return sum;
+}
+
+/**
+ * Writes a trace of about target bytes in a temporary file, whose name is
+ * written in path: mostly stores with values of 16 to 200 characters, and
+ * retrieves, with a few changes of the servers. Returns its size.
+ */
+static unsigned long long write_trace(char *path, unsigned long long target,
+									  unsigned long long *requests)
+{
+	int fd = mkstemp(path);
+	DIE(fd < 0, "Failed while creating the trace.\n");
+
+	char *block = malloc(REQUEST_BLOCK + 512);
+	DIE(!block, "Failed while creating the trace.\n");
+	unsigned long long written = 0;
+	unsigned int state = 12345, used = 0;
+	char value[201];
+
+	*requests = 0;
+	memset(value, 'v', sizeof(value));
+	while (written + used < target) {
+		unsigned int r = bench_rand(&state) % 100;
+		unsigned int key = bench_rand(&state) % 1000000;
+
+		if (r < 60)
+			used += sprintf(block + used, "store \"key_%u\" \"%.*s\"\n", key,
+							16 + bench_rand(&state) % 185, value);
+		else if (r < 99)
+			used += sprintf(block + used, "retrieve \"key_%u\"\n", key);
+		else
+			used += sprintf(block + used, "%s %u\n", r & 1 ? "add_server" :
+							"remove_server", key % 1000);
+		(*requests)++;
+
+		if (used >= REQUEST_BLOCK) {
+			DIE(write(fd, block, used) != (ssize_t)used,
+				"Failed while writing the trace.\n");
+			written += used;
+			used = 0;
+		}
+	}
+	DIE(write(fd, block, used) != (ssize_t)used,
+		"Failed while writing the trace.\n");
+	written += used;
+	close(fd);
+	free(block);
+
+	return written;
+}
+
+/**
+ * Parses a trace of about limit MB (2 GB by default) with both parsers. The
+ * file was just written, so both of them read it from the page cache, if it
+ * fits.
+ */
+static void bench_parse(unsigned long limit)
+{
+	char path[] = "/tmp/bench_trace_XXXXXX";
+	unsigned long long requests;
+	unsigned long long written = write_trace(path, (limit == -1UL ? 2048 :
+												   limit) << 20, &requests);
+
+	printf("%10s %12s %12s %12s %12s\n", "parser", "MB", "requests",
+		   "seconds", "MB/s");
+
+	for (int reader = 0; reader < 2; reader++) {
+		double start = now_ns();
+		unsigned long sum = reader ? parse_reader(path) : parse_legacy(path);
+		double seconds = (now_ns() - start) / 1e9;
+		bench_sink += sum;
+
+		printf("%10s %12.0f %12llu %12.2f %12.1f\n",
+			   reader ? "reader" : "fgets", written / 1048576.0, requests,
+			   seconds, written / 1048576.0 / seconds);
+	}
+
+	unlink(path);
+}
+
+/**
+ * Writes the trace in a temporary command log, whose name is written in
+ * binary. Returns the open log.
+ */
+static int convert_trace(const char *text, char *binary)
+{
+	request_t request;
+	int in = open(text, O_RDONLY), out = mkstemp(binary);
+	DIE(in < 0 || out < 0, "Failed while converting the trace.\n");
+
+	request_reader_t *reader = request_reader_create(in);
+	command_log_writer_t *writer = command_log_create(out, KEY_HASH_DJB2, 0);
+	while (request_next(reader, &request) > 0)
+		command_log_append(writer, &request);
+	command_log_close(writer);
+	request_reader_free(reader);
+	close(in);
+
+	return out;
+}
+
+static unsigned long read_log(const char *path)
+{
+	unsigned long sum = 0;
+	request_t request;
+	key_hash_t mode;
+	unsigned int seed;
+	int fd = open(path, O_RDONLY);
+	DIE(fd < 0, "Failed while opening the command log.\n");
+
+	command_log_reader_t *log = command_log_open(fd, &mode, &seed);
+	while (command_log_next(log, &request) > 0) {
+		if (request.key)
+			sum += request.hash + (request.value ? request.value[0] : 0);
+		else
+			sum += request.server_id;
+	}
+
+	command_log_free(log);
+	close(fd);
+
+	return sum;
+}
+
+/**
+ * Replays the same requests, about limit MB of text (1 GB by default), from
+ * the text and from a command log: first only reading them (the text is
+ * parsed, and its keys are hashed, like tema2 does), then applying them to 100
+ * servers, without writing the results. A copy of the log in memory shows the
+ * speed of the memory, for comparison.
+ */
+static void bench_replay(unsigned long limit)
+{
+	char text[] = "/tmp/bench_trace_XXXXXX";
+	char binary[] = "/tmp/bench_log_XXXXXX";
+	unsigned long long requests;
+	unsigned long long text_size = write_trace(text, (limit == -1UL ? 1024 :
+													 limit) << 20, &requests);
+	request_reader_t *reader;
+	request_t request;
+	int out = convert_trace(text, binary);
+	off_t log_size = lseek(out, 0, SEEK_END);
+	char *copy = malloc(log_size), *source = malloc(log_size);
+	DIE(!copy || !source, "Failed while copying the command log.\n");
+	DIE(pread(out, source, log_size, 0) != log_size,
+		"Failed while reading the command log.\n");
+	close(out);
+
+	printf("%10s %10s %12s %12s %12s %12s\n", "input", "work", "MB",
+		   "requests", "seconds", "MB/s");
+
+	double start = now_ns();
+	memcpy(copy, source, log_size);
+	double seconds = (now_ns() - start) / 1e9;
+	bench_sink += copy[log_size - 1];
+	printf("%10s %10s %12.0f %12s %12.2f %12.1f\n", "memcpy", "copy",
+		   log_size / 1048576.0, "-", seconds, log_size / 1048576.0 / seconds);
+	free(copy);
+	free(source);
+
+	for (int apply = 0; apply < 2; apply++) {
+		for (int replay = 0; replay < 2; replay++) {
+			const char *path = replay ? binary : text;
+			double size = (replay ? (unsigned long long)log_size : text_size) /
+						  1048576.0;
+			load_balancer_t *main = NULL;
+			unsigned long sum = 0;
+
+			if (apply) {
+				main = init_load_balancer();
+				for (int i = 0; i < 100; i++)
+					loader_add_server(main, i);
+			}
+
+			start = now_ns();
+			if (!apply && replay) {
+				sum = read_log(path);
+			} else {
+				int fd = open(path, O_RDONLY);
+				key_hash_t mode;
+				unsigned int seed;
+				DIE(fd < 0, "Failed while opening the trace.\n");
+				command_log_reader_t *log = replay ?
+					command_log_open(fd, &mode, &seed) : NULL;
+				reader = replay ? NULL : request_reader_create(fd);
+
+				while ((replay ? command_log_next(log, &request) :
+						request_next(reader, &request)) > 0) {
+					int id;
+
+					if (request.key && !apply)
+						sum += key_hash_djb2(request.key, 0);
+					else if (request.type == REQUEST_STORE)
+						sum += replay ?
+							loader_store_hashed(main, request.key,
+												request.hash, request.value,
+												&id) :
+							loader_store(main, request.key, request.value,
+										 &id);
+					else if (request.type == REQUEST_RETRIEVE)
+						sum += (replay ?
+							loader_retrieve_hashed(main, request.key,
+												   request.hash, &id) :
+							loader_retrieve(main, request.key, &id)) != NULL;
+				}
+
+				if (log)
+					command_log_free(log);
+				else
+					request_reader_free(reader);
+				close(fd);
+			}
+			seconds = (now_ns() - start) / 1e9;
+			bench_sink += sum;
+
+			printf("%10s %10s %12.0f %12llu %12.2f %12.1f\n",
+				   replay ? "log" : "text", apply ? "apply" : "read", size,
+				   requests, seconds, size / seconds);
+
+			if (main)
+				free_load_balancer(main);
+		}
+	}
+
+	unlink(text);
+	unlink(binary);
+}
+
+/**
+ * Applies a trace of about limit MB (512 MB by default), as text and as a
+ * command log, to 100 servers, with the results written to /dev/null: on one
+ * thread, with the pipeline of three threads, and with the servers split
+ * between 2 and 4 shards. The speedup is the one over one thread, with the
+ * same input, and the MB/s are the ones of the text, for both inputs.
+ */
+static void bench_pipeline(unsigned long limit)
+{
+	char text[] = "/tmp/bench_trace_XXXXXX";
+	char binary[] = "/tmp/bench_log_XXXXXX";
+	unsigned long long requests;
+	unsigned long long text_size = write_trace(text, (limit == -1UL ? 512 :
+													 limit) << 20, &requests);
+
+	close(convert_trace(text, binary));
+	int null = open("/dev/null", O_WRONLY);
+	DIE(null < 0, "Failed while opening /dev/null.\n");
+
+	printf("%10s %10s %12s %12s %12s %10s\n", "input", "stages", "requests",
+		   "seconds", "MB/s", "speedup");
+
+	for (int replay = 0; replay < 2; replay++) {
+		double sequential = 0;
+
+		/* 0 is one thread, 1 the pipeline, and the others the shards */
+		for (unsigned int mode = 0; mode < 4; mode++) {
+			unsigned int stages = mode < 2 ? mode : 2 * (mode - 1);
+			request_source_t source = {NULL, NULL, NULL};
+			key_hash_t mode;
+			unsigned int seed;
+			int fd = open(replay ? binary : text, O_RDONLY);
+			DIE(fd < 0, "Failed while opening the trace.\n");
+
+			if (replay)
+				source.log = command_log_open(fd, &mode, &seed);
+			else
+				source.reader = request_reader_create(fd);
+
+			load_balancer_t *main = init_load_balancer();
+			for (int i = 0; i < 100; i++)
+				loader_add_server(main, i);
+			result_writer_t *results = result_writer_create(null, RESULT_TEXT,
+															1);
+
+			double start = now_ns();
+			if (stages > 1)
+				execute_sharded(main, &source, results, stages);
+			else if (stages)
+				execute_pipelined(main, &source, results);
+			else
+				execute_requests(main, &source, results);
+			result_flush(results);
+			double seconds = (now_ns() - start) / 1e9;
+
+			if (!stages)
+				sequential = seconds;
+			char name[16];
+			if (stages > 1)
+				snprintf(name, sizeof(name), "shards=%u", stages);
+			printf("%10s %10s %12llu %12.2f %12.1f %9.2fx\n",
+				   replay ? "log" : "text", stages > 1 ? name : stages ?
+				   "pipeline" : "one", requests, seconds,
+				   text_size / 1048576.0 / seconds, sequential / seconds);
+
+			result_writer_free(results);
+			free_load_balancer(main);
+			if (replay)
+				command_log_free(source.log);
+			else
+				request_reader_free(source.reader);
+			close(fd);
+		}
+	}
+
+	close(null);
+	unlink(text);
+	unlink(binary);
+}
+
+/**
+ * Writes limit results (10M by default) to /dev/null: two thirds stores and
+ * one third retrieves, with values of 100 characters, through printf and
+ * through the result writer, in its three kinds of output.
+ */
+static void bench_output(unsigned long limit)
+{
+	static const char *const names[] = {"printf", "text", "no values",
+										"binary"};
+	unsigned long results = limit == -1UL ? 10000000 : limit;
+	char value[101];
+
+	memset(value, 'v', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+
+	printf("%10s %12s %12s %12s\n", "output", "results", "ns/result",
+		   "Mresults/s");
+
+	for (int mode = 0; mode < 4; mode++) {
+		FILE *null = fopen("/dev/null", "w");
+		DIE(!null, "Failed while opening /dev/null.\n");
+		result_writer_t *writer = NULL;
+
+		if (mode)
+			writer = result_writer_create(fileno(null), mode == 3 ?
+										  RESULT_BINARY : RESULT_TEXT,
+										  mode == 1);
+
+		double start = now_ns();
+		for (unsigned long i = 0; i < results; i++) {
+			int server_id = i * 2654435761u % 100000;
+
+			if (!mode && i % 3)
+				fprintf(null, "Stored %s on server %d.\n", value, server_id);
+			else if (!mode)
+				fprintf(null, "Retrieved %s from server %d.\n", value,
+						server_id);
+			else if (i % 3)
+				result_stored(writer, value, sizeof(value) - 1, server_id);
+			else
+				result_retrieved(writer, value, sizeof(value) - 1,
+								 server_id);
+		}
+		if (writer)
+			result_writer_free(writer);
+		else
+			fflush(null);
+		double elapsed = now_ns() - start;
+
+		printf("%10s %12lu %12.1f %12.2f\n", names[mode], results,
+			   elapsed / results, results / elapsed * 1e3);
+		fclose(null);
+	}
+}
+
+struct bench_entry {
+	const char *name;
+	void (*run)(unsigned long limit);
+};
+
+static const struct bench_entry benchmarks[] = {
+	{"routing", bench_routing},
+	{"idmap", bench_idmap},
+	{"layout", bench_layout},
+	{"storage", bench_storage},
+	{"alloc", bench_alloc},
+	{"distribution", bench_distribution},
+	{"topology", bench_topology},
+	{"join", bench_join},
+	{"drain", bench_drain},
+	{"rebalance", bench_rebalance},
+	{"router", bench_router},
+	{"batch", bench_batch},
+	{"hash", bench_hash},
+	{"threads", bench_threads},
+	{"parse", bench_parse},
+	{"output", bench_output},
+	{"replay", bench_replay},
+	{"pipeline", bench_pipeline},
+};
+
+int main(int argc, char *argv[])
+{
+	const unsigned int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+	unsigned long limit = argc > 2 ? strtoul(argv[2], NULL, 10) : -1UL;
+	int ran = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (argc > 1 && strcmp(argv[1], benchmarks[i].name))
+			continue;
+
+		printf("== %s ==\n", benchmarks[i].name);
+		benchmarks[i].run(limit);
+		ran = 1;
+	}
+
+	if (!ran) {
+		printf("Usage: %s [benchmark [limit]]\nBenchmarks:", argv[0]);
+		for (unsigned int i = 0; i < count; i++)
+			printf(" %s", benchmarks[i].name);
+		printf("\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,257 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "command_log.h"
+#include "key_hash.h"
+#include "data_structs.h"
+#include "utils.h"
+
+static void log_flush(command_log_writer_t *log)
+{
+	char *bytes = log->buffer;
+	size_t count = log->size;
+
+	while (count) {
+		ssize_t done = write(log->fd, bytes, count);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		DIE(done <= 0, "Failed while writing the command log");
+
+		bytes += done;
+		count -= done;
+	}
+
+	log->size = 0;
+}
+
+static void log_put(command_log_writer_t *log, const void *bytes,
+					size_t count)
+{
+	while (count) {
+		size_t room = CMDLOG_BUFFER - log->size;
+		size_t copied = count < room ? count : room;
+
+		memcpy(log->buffer + log->size, bytes, copied);
+		log->size += copied;
+		bytes = (const char *)bytes + copied;
+		count -= copied;
+
+		if (log->size == CMDLOG_BUFFER)
+			log_flush(log);
+	}
+}
+
+static void log_put_u32(command_log_writer_t *log, uint32_t number)
+{
+	log_put(log, &number, sizeof(uint32_t));
+}
+
+command_log_writer_t *command_log_create(int fd, key_hash_t mode,
+										 unsigned int seed)
+{
+	command_log_writer_t *log = malloc(sizeof(command_log_writer_t));
+	DIE(!log, "Failed command_log_create\n");
+
+	log->buffer = malloc(CMDLOG_BUFFER);
+	DIE(!log->buffer, "Failed command_log_create\n");
+
+	log->fd = fd;
+	log->size = 0;
+	log->key_hash = key_hash_get(mode);
+	log->hash_seed = seed;
+
+	log_put(log, CMDLOG_MAGIC, CMDLOG_MAGIC_SIZE);
+	log_put_u32(log, mode);
+	log_put_u32(log, seed);
+
+	return log;
+}
+
+void command_log_append(command_log_writer_t *log, const request_t *request)
+{
+	char kind = request->type;
+
+	log_put(log, &kind, 1);
+
+	switch (request->type) {
+	case REQUEST_STORE:
+	case REQUEST_RETRIEVE:
+		log_put_u32(log, log->key_hash(request->key, log->hash_seed));
+		log_put_u32(log, request->key_len);
+		if (request->type == REQUEST_STORE)
+			log_put_u32(log, request->value_len);
+
+		log_put(log, request->key, request->key_len + 1);
+		if (request->type == REQUEST_STORE)
+			log_put(log, request->value, request->value_len + 1);
+		break;
+	case REQUEST_ADD_SERVER:
+		log_put_u32(log, request->server_id);
+		log_put_u32(log, request->weight);
+		break;
+	case REQUEST_REMOVE_SERVER:
+		log_put_u32(log, request->server_id);
+		break;
+	}
+}
+
+void command_log_close(command_log_writer_t *log)
+{
+	log_flush(log);
+	free(log->buffer);
+	free(log);
+}
+
+/* a header that breaks the format stops the program, with EINVAL */
+static void log_check(int valid, const char *message)
+{
+	if (!valid) {
+		errno = EINVAL;
+		DIE(1, message);
+	}
+}
+
+/**
+ * The whole log is mapped, and read only once, from the start to the end.
+ */
+command_log_reader_t *command_log_open(int fd, key_hash_t *mode,
+									   unsigned int *seed)
+{
+	command_log_reader_t *log = malloc(sizeof(command_log_reader_t));
+	struct stat info;
+	DIE(!log, "Failed command_log_open\n");
+
+	DIE(fstat(fd, &info) < 0, "Failed while opening the command log");
+	log_check((size_t)info.st_size >= CMDLOG_HEADER_SIZE,
+			  "The file is not a command log");
+
+	log->size = info.st_size;
+	log->bytes = mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	DIE(log->bytes == MAP_FAILED, "Failed while mapping the command log");
+	posix_madvise(log->bytes, log->size, POSIX_MADV_SEQUENTIAL);
+
+	log_check(!memcmp(log->bytes, CMDLOG_MAGIC, CMDLOG_MAGIC_SIZE),
+			  "The file is not a command log");
+
+	uint32_t header[2];
+	memcpy(header, log->bytes + CMDLOG_MAGIC_SIZE, sizeof(header));
+	/* the hashes of the log are only right with its own function */
+	log_check(header[0] == KEY_HASH_DJB2 || header[0] == KEY_HASH_FAST,
+			  "The command log is corrupted");
+	*mode = header[0];
+	*seed = header[1];
+	log->pos = CMDLOG_HEADER_SIZE;
+	log->error = NULL;
+
+	return log;
+}
+
+/**
+ * The next count bytes of the log, or NULL if the log is cut short before
+ * them. The readers below return 0 for a bad record, and leave the reason in
+ * log->error.
+ */
+static char *log_take(command_log_reader_t *log, size_t count)
+{
+	if (log->size - log->pos < count) {
+		log->error = "The command log is cut short";
+		return NULL;
+	}
+
+	char *bytes = log->bytes + log->pos;
+	log->pos += count;
+
+	return bytes;
+}
+
+static int log_take_u32(command_log_reader_t *log, uint32_t *number)
+{
+	char *bytes = log_take(log, sizeof(uint32_t));
+
+	if (bytes)
+		memcpy(number, bytes, sizeof(uint32_t));
+
+	return bytes != NULL;
+}
+
+/* a string of the log, which is ended by 0 there */
+static int log_take_string(command_log_reader_t *log, uint32_t length,
+						   char **text)
+{
+	if (length == UINT32_MAX) {
+		log->error = "The command log is corrupted";
+		return 0;
+	}
+
+	*text = log_take(log, length + 1);
+	if (*text && (*text)[length]) {
+		log->error = "The command log is corrupted";
+		return 0;
+	}
+
+	return *text != NULL;
+}
+
+int command_log_next(command_log_reader_t *log, request_t *request)
+{
+	uint32_t number = 0, key_len = 0, value_len = 0;
+	char *kind;
+
+	if (log->pos == log->size)
+		return 0;
+
+	kind = log_take(log, 1);
+	request->type = (unsigned char)*kind;
+	request->key = NULL;
+	request->value = NULL;
+	request->key_len = 0;
+	request->value_len = 0;
+	request->hashed = 0;
+
+	switch (request->type) {
+	case REQUEST_STORE:
+	case REQUEST_RETRIEVE:
+		if (!log_take_u32(log, &request->hash) ||
+			!log_take_u32(log, &key_len) ||
+			(request->type == REQUEST_STORE &&
+			 !log_take_u32(log, &value_len)) ||
+			!log_take_string(log, key_len, &request->key) ||
+			(request->type == REQUEST_STORE &&
+			 !log_take_string(log, value_len, &request->value)))
+			return -1;
+
+		request->hashed = 1;
+		request->key_len = key_len;
+		request->value_len = value_len;
+		break;
+	case REQUEST_ADD_SERVER:
+		if (!log_take_u32(log, &number) ||
+			!log_take_u32(log, &request->weight))
+			return -1;
+		request->server_id = number;
+		break;
+	case REQUEST_REMOVE_SERVER:
+		if (!log_take_u32(log, &number))
+			return -1;
+		request->server_id = number;
+		request->weight = 0;
+		break;
+	default:
+		log->error = "The command log is corrupted";
+		return -1;
+	}
+
+	return 1;
+}
+
+void command_log_free(command_log_reader_t *log)
+{
+	munmap(log->bytes, log->size);
+	free(log);
+}
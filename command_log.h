@@ -0,0 +1,73 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef COMMAND_LOG_H_
+#define COMMAND_LOG_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions for the command logs: the requests of an input file in binary,
+ * with the hashes of the keys already computed. A log starts with
+ * CMDLOG_MAGIC (8 bytes) and the hash function of the keys (its key_hash_t
+ * and its seed, as 32 bit numbers). Every request follows as a byte with its
+ * kind, and then:
+ *   - store: the hash of the key, the length of the key and the length of
+ *     the value, then the key and the value, each ended by 0;
+ *   - retrieve: the hash of the key and its length, then the key, ended by 0;
+ *   - add_server: the id and the weight of the server;
+ *   - remove_server: the id of the server.
+ * All the numbers have 32 bits, in the byte order of the machine, and are
+ * not aligned. The keys and the values are read from the log in place.
+*/
+
+/**
+ * @brief Starts writing a command log.
+ *
+ * @param fd Where the log is written.
+ * @param mode The hash function of the keys.
+ * @param seed Its seed.
+ * @return The writer.
+ */
+command_log_writer_t *command_log_create(int fd, key_hash_t mode,
+										 unsigned int seed);
+
+/**
+ * @brief Appends a request to the log; its key is hashed here.
+ */
+void command_log_append(command_log_writer_t *log, const request_t *request);
+
+/**
+ * @brief Writes what is left in the buffer, and frees the writer; the file
+ * is not closed.
+ */
+void command_log_close(command_log_writer_t *log);
+
+/**
+ * @brief Opens a command log for reading. It stops the program if the file
+ * is not a command log, or if its hash function is unknown.
+ *
+ * @param fd The file descriptor of the log, a regular file.
+ * @param mode RETURNS the hash function of the keys.
+ * @param seed RETURNS its seed.
+ * @return The reader.
+ */
+command_log_reader_t *command_log_open(int fd, key_hash_t *mode,
+									   unsigned int *seed);
+
+/**
+ * @brief Reads the next request, with the hash of its key. The key and the
+ * value point into the log, until the reader is freed.
+ *
+ * @return 1 if there was a request, 0 at the end of the log, and -1 for a
+ * record that is cut short or corrupted, whose reason is left in
+ * log->error; the caller stops there, after it wrote the results it already
+ * has.
+ */
+int command_log_next(command_log_reader_t *log, request_t *request);
+
+/**
+ * @brief Frees the reader; the file is not closed.
+ */
+void command_log_free(command_log_reader_t *log);
+
+#endif  // COMMAND_LOG_H_
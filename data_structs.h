@@ -2,6 +2,10 @@
 #ifndef DATA_STRUCTS_H_
 #define DATA_STRUCTS_H_
 
+#include <pthread.h>
+
+#include "utils.h"
+
 /* Structures used for Simple Linked List */
 typedef struct node_t node_t;
 typedef struct list_t list_t;
@@ -10,11 +14,78 @@ typedef struct list_t list_t;
 typedef struct hashtable_t hashtable_t;
 typedef struct pair_t pair_t;
 
+/* Structures used for the slab allocator */
+typedef struct slab_chunk_t slab_chunk_t;
+typedef struct slab_large_t slab_large_t;
+typedef struct slab_donor_t slab_donor_t;
+typedef struct slab_t slab_t;
+
+/**
+ * Callback used to walk the entries of a hashtable (either kind), with the
+ * stored hash of the key; it returns 0 for the entries that have to go.
+ */
+typedef int (*ht_keep_fn)(void *key, void *value, unsigned int hash,
+						  void *arg);
+
+/**
+ * Callbacks used to empty a hashtable without freeing its entries: every
+ * entry is handed over to the callback, which owns its memory from then on.
+ * The lab hashtable hands over whole nodes, the flat one its keys and values.
+ */
+typedef void (*ht_take_fn)(node_t *node, unsigned int hash, void *arg);
+typedef void (*ft_take_fn)(void *key, void *value, unsigned int hash,
+						   void *arg);
+
+/**
+ * A hash function for the keys, with a seed; the same key gets another hash
+ * under another seed.
+ */
+typedef unsigned int (*key_hash_fn)(void *key, unsigned int seed);
+
+/* The hash functions that can be chosen for the keys */
+typedef enum key_hash_t {
+	KEY_HASH_DJB2,	/* the legacy djb2, byte by byte, without a seed */
+	KEY_HASH_FAST,	/* word at a time, with a seed */
+} key_hash_t;
+
+/* Structures used for the flat (open addressing) hashtable */
+typedef struct flat_slot_t flat_slot_t;
+typedef struct flat_table_t flat_table_t;
+
+/* Structures used for the per-server key index */
+typedef struct key_index_entry_t key_index_entry_t;
+typedef struct key_index_bucket_t key_index_bucket_t;
+typedef struct key_index_t key_index_t;
+
+/* Structures used for the server id -> index map */
+typedef struct id_slot_t id_slot_t;
+typedef struct id_map_t id_map_t;
+
 /* Structures used for Load Balancer */
 typedef struct server_memory_t server_memory_t;
 typedef struct server_t server_t;
 typedef struct ring_t ring_t;
 typedef struct load_balancer_t load_balancer_t;
+typedef struct lb_config_t lb_config_t;
+typedef struct server_batch_t server_batch_t;
+typedef struct run_options_t run_options_t;
+typedef struct routed_key_t routed_key_t;
+typedef struct lb_reader_t lb_reader_t;
+typedef struct lb_snapshot_t lb_snapshot_t;
+
+/* Structures used for reading the requests */
+typedef struct request_t request_t;
+typedef struct request_reader_t request_reader_t;
+typedef struct result_writer_t result_writer_t;
+typedef struct command_log_writer_t command_log_writer_t;
+typedef struct command_log_reader_t command_log_reader_t;
+typedef struct request_source_t request_source_t;
+
+/* Structures used for the pipeline of the requests */
+typedef struct spsc_ring_t spsc_ring_t;
+typedef struct request_result_t request_result_t;
+typedef struct request_values_t request_values_t;
+typedef struct request_batch_t request_batch_t;
 
 struct node_t {
 	void *data;
@@ -27,24 +98,154 @@ struct list_t {
 	unsigned int size;
 };
 
+/* A chunk of memory, the small blocks of a slab are cut from it */
+struct slab_chunk_t {
+	slab_chunk_t *next;	/* the memory of the chunk follows the header */
+};
+
+/* The header of a block too big for the size classes of a slab */
+struct slab_large_t {
+	slab_large_t *prev;
+	slab_large_t *next;
+};
+
+/* A slab that handed some of its blocks over to another one */
+struct slab_donor_t {
+	slab_t *slab;
+	slab_donor_t *next;
+};
+
+/* Allocator that hands out the memory of a single server */
+struct slab_t {
+	void *free_lists[SLAB_CLASSES];	/* the freed blocks of every class */
+	slab_chunk_t *chunks;	/* every chunk, the current one first */
+	char *cursor;	/* the free part of the current chunk */
+	char *end;
+	unsigned int next_chunk_size;
+	slab_large_t *large;	/* every block bigger than SLAB_MAX_SIZE */
+	unsigned int refs;	/* the owner, and every slab that took blocks */
+	slab_donor_t *donors;	/* the slabs whose blocks were taken */
+};
+
 struct hashtable_t {
-	list_t **buckets;
+	list_t **buckets;	/* segments of HT_SEGMENT buckets */
 	unsigned int hmax;
 	unsigned int size;
+	unsigned int min_hmax;	/* the table never shrinks below this */
+	list_t **old_buckets;	/* the buckets being moved by a resize, or NULL */
+	unsigned int old_hmax;
+	unsigned int rehash_idx;	/* the next old bucket to be moved */
+	unsigned int paused;	/* while not zero, the buckets stay in place */
 	unsigned int (*hash_function)(void*);
+	key_hash_fn key_hash;	/* if not NULL, used instead of hash_function */
+	unsigned int hash_seed;	/* the seed given to key_hash */
 	int (*compare_function)(void*, void*);
 	void (*key_val_free_function)(void*);
+	slab_t *slab;	/* where the entries are allocated, or NULL for malloc */
 };
 
 /* The pair_t struct is the same as info_t from the lab */
 struct pair_t {
 	void *key;
 	void *value;
+	unsigned int key_size;	/* the sizes of the key and value buffers */
+	unsigned int value_size;
+	unsigned int hash;	/* the full hash of the key */
+};
+
+/**
+ * One slot of a flat table. The full hash of the key is kept in the slot, so
+ * most mismatches are rejected without touching the key.
+ */
+struct flat_slot_t {
+	unsigned int hash;
+	unsigned int dist;	/* distance from the home slot plus one, 0 if empty */
+	void *key;	/* NULL in a used slot marks a tombstone (old array only) */
+	void *value;
+};
+
+/**
+ * Hashtable with Robin Hood linear probing over a single array of slots.
+ * Like the lab hashtable it resizes incrementally: the entries of the old
+ * array are moved a few slots at a time, and the moved ones are left behind
+ * as tombstones, so the probe chains of the old array stay intact.
+ */
+struct flat_table_t {
+	flat_slot_t *slots;
+	unsigned int capacity;	/* always a power of two */
+	unsigned int shift;	/* 32 - log2(capacity) */
+	unsigned int size;	/* the entries of both arrays */
+	unsigned int min_capacity;
+	flat_slot_t *old_slots;	/* the array being moved by a resize, or NULL */
+	unsigned int old_capacity;
+	unsigned int old_shift;
+	unsigned int old_size;	/* the entries not moved yet */
+	unsigned int migrate_idx;	/* the next old slot to be moved */
+	unsigned int paused;	/* while not zero, the entries stay in place */
+	unsigned int (*hash_function)(void*);
+	key_hash_fn key_hash;	/* if not NULL, used instead of hash_function */
+	unsigned int hash_seed;	/* the seed given to key_hash */
+	slab_t *slab;	/* where the keys and values live, or NULL for malloc */
+};
+
+/* One slot of the id map; an index of -1 marks an empty slot */
+struct id_slot_t {
+	unsigned int id;
+	int index;
+};
+
+/* Open addressing map from a server id to its index in the servers array */
+struct id_map_t {
+	id_slot_t *slots;
+	unsigned int capacity;	/* always a power of two */
+	unsigned int shift;	/* 32 - log2(capacity) */
+	unsigned int size;
+};
+
+/* A key of a server, in its key index */
+struct key_index_entry_t {
+	unsigned int hash;	/* the hash of the key */
+	char *key;	/* the key, owned by the storage of the server */
+};
+
+/* The keys whose hashes start with the same bits */
+struct key_index_bucket_t {
+	key_index_entry_t *entries;	/* in no particular order */
+	unsigned int size;
+	unsigned int capacity;
+};
+
+/* The keys of a server, ordered by hash: the bucket of a key is given by the
+first bits of its hash, so the keys from an arc of the hashring are in a few
+consecutive buckets and can be found without walking all of them; the buckets
+are split in two, a few at a time, as the index grows */
+struct key_index_t {
+	key_index_bucket_t *buckets;	/* 2^bits buckets */
+	unsigned int bits;
+	key_index_bucket_t *old_buckets;	/* 2^(bits - 1) buckets, or NULL */
+	unsigned int split_idx;	/* the old buckets before it were split */
+	unsigned int size;
+	slab_t *slab;	/* the entries are allocated from here */
 };
 
-/* The server_memory_t is just a hashtable*/
+/* The engines that can store the objects of a server */
+typedef enum server_engine_t {
+	SERVER_ENGINE_CHAINED,	/* the lab hashtable, with linked lists */
+	SERVER_ENGINE_FLAT,	/* the open addressing flat table */
+} server_engine_t;
+
+/* The server_memory_t is just a hashtable, one of the two engines */
 struct server_memory_t {
-	hashtable_t *storage;
+	server_engine_t engine;
+	slab_t *slab;	/* every object of the server is allocated from here */
+	hashtable_t *storage;	/* used by SERVER_ENGINE_CHAINED */
+	flat_table_t *flat;	/* used by SERVER_ENGINE_FLAT */
+	key_index_t *index;	/* the keys ordered by hash, or NULL */
+	key_hash_fn key_hash;	/* the hash function of the keys */
+	unsigned int hash_seed;
+	pthread_rwlock_t lock;	/* shared by the readers, in a concurrent Load
+	Balancer */
+	int held;	/* 1 while a change of the servers holds the lock */
 };
 
 /* Those structs are used to make an array of servers; My idea is to store
@@ -52,6 +253,7 @@ together the server memory and it's unique id */
 struct server_t {
 	server_memory_t *memory;	/* the actual memory of the server*/
 	unsigned int server_id;		/* the unique id of the server */
+	unsigned int replicas;		/* the number of rings of the server */
 };
 
 /* The Hashring will be implemented with those "rings"; Because of the
@@ -62,6 +264,80 @@ struct ring_t {
 	unsigned int server_id;	/* the id of the server coresponding to the hash */
 };
 
+/* The ways a Load Balancer can find the server of a key */
+typedef enum lb_router_t {
+	LB_ROUTER_RING,	/* binary search on the hashring */
+	LB_ROUTER_MAGLEV,	/* one index in a lookup table, like Maglev */
+	LB_ROUTER_JUMP,	/* jump consistent hash over the array of servers */
+	LB_ROUTER_RENDEZVOUS,	/* the server with the highest score (HRW) */
+} lb_router_t;
+
+/* The orders of the hashes of the hashring, in the array that get_server
+searches */
+typedef enum ring_layout_t {
+	RING_LAYOUT_SORTED,	/* ascending, like the hashring */
+	RING_LAYOUT_EYTZINGER,	/* the order of a walk in width of a search tree */
+} ring_layout_t;
+
+/* The options of a Load Balancer, given to init_load_balancer_with */
+struct lb_config_t {
+	server_engine_t engine;	/* the storage engine of every server */
+	unsigned int replicas;	/* the rings of a server with weight 1 */
+	int key_index;	/* 1 if the servers keep their keys ordered by hash */
+	lb_router_t router;	/* how the server of a key is found */
+	unsigned int lookup_size;	/* the slots of the lookup table, a prime */
+	ring_layout_t ring_layout;	/* the search layout of the hashring */
+	key_hash_t key_hash;	/* the hash function of the keys */
+	unsigned int hash_seed;	/* its seed, ignored by KEY_HASH_DJB2 */
+	int concurrent;	/* 1 if many threads can use the Load Balancer at once */
+	unsigned int drain_threads;	/* the threads that move the objects of a
+	removed server; joins always use the calling thread */
+};
+
+/* A run of add_server (or remove_server) requests, applied together by
+loader_change_servers */
+struct server_batch_t {
+	int *ids;	/* the ids of the servers */
+	unsigned int *weights;	/* their weights, for the added servers */
+	unsigned int size;
+	unsigned int capacity;
+	int removing;	/* 1 if the servers are removed, 0 if they are added */
+};
+
+/* A key of a batched request, once it was routed */
+struct routed_key_t {
+	unsigned int hash;	/* the hash of the key */
+	unsigned int index;	/* the position of the key in the request */
+	unsigned int server_id;	/* the server of the key */
+	server_memory_t *memory;	/* the memory of that server */
+};
+
+/* The epoch seen by a thread when it started its request, or 0 if it has no
+request in progress; every thread has its own cache line */
+struct lb_reader_t {
+	unsigned long long epoch;
+	char padding[LB_CACHE_LINE - sizeof(unsigned long long)];
+};
+
+/* The formats of the results of the requests */
+typedef enum result_format_t {
+	RESULT_TEXT,	/* the lines of the homework */
+	RESULT_BINARY,	/* records with a kind, a server id and a length */
+} result_format_t;
+
+/* The options of tema2 that are not about the Load Balancer */
+struct run_options_t {
+	result_format_t format;	/* of the results */
+	int echo_values;	/* 0 if the values are left out of the results */
+	int replay;	/* 1 if the input file is a command log */
+	int pipeline;	/* 1 if the requests are read, applied and written by
+	different threads */
+	unsigned int shards;	/* if not 0, the servers are split between this
+	many threads, which apply their requests */
+	const char *convert;	/* if set, the input file is only written here, as
+	a command log */
+};
+
 /* The Load Balancer */
 struct load_balancer_t {
 	server_t *servers;  /* the array of servers */
@@ -69,6 +345,162 @@ struct load_balancer_t {
 	unsigned int num_servers;	/* the actual number of servers */
 	ring_t *hashring;	/* the array of rings aka the hashring */
 	unsigned int hashring_size;	/* the hashring size */
+	unsigned int hashring_capacity;	/* the allocated rings */
+	ring_layout_t ring_layout;	/* the order of ring_hashes */
+	unsigned int *ring_hashes;	/* only the hashes of the rings, searched by
+	get_server; with RING_LAYOUT_EYTZINGER they start from index 1 */
+	unsigned int *ring_ids;	/* the server of every hash, in the same order */
+	id_map_t *indices;	/* maps a server id to its index in servers */
+	server_engine_t engine;	/* the engine used by every server */
+	unsigned int replicas;	/* the rings of a server with weight 1 */
+	int key_index;	/* 1 if the servers keep their keys ordered by hash */
+	lb_router_t router;	/* how the server of a key is found */
+	unsigned int *lookup;	/* the id of the server of every slot (Maglev) */
+	unsigned int lookup_size;
+	unsigned int *hrw_seeds;	/* one seed for every unit of weight (HRW) */
+	unsigned int *hrw_ids;	/* the server of every seed */
+	unsigned int hrw_size;	/* the seeds, without the padding */
+	unsigned int moved;	/* the objects moved by the last topology change */
+	key_hash_fn key_hash;	/* the hash of the keys, for routing and storing */
+	unsigned int hash_seed;
+	unsigned int drain_threads;	/* the threads of server_drain_parallel */
+	int concurrent;	/* 1 if the fields below are used */
+	pthread_mutex_t topology;	/* taken by the changes of the servers */
+	lb_snapshot_t *snapshot;	/* what the requests are routed with */
+	lb_snapshot_t *retired;	/* the replaced snapshots, the newest first */
+	unsigned long long epoch;	/* incremented when a snapshot is replaced */
+	lb_reader_t *readers;	/* LB_MAX_READERS of them */
+	server_memory_t **held;	/* the servers locked by the change in progress */
+	unsigned int num_held;
+	unsigned int held_capacity;
+};
+
+/* The fields of a Load Balancer that are needed for routing, frozen after a
+change of the servers; the requests read them without locks */
+struct lb_snapshot_t {
+	load_balancer_t view;	/* only the routing fields are set */
+	unsigned long long retired;	/* the epoch when it was replaced */
+	server_memory_t **removed;	/* the servers removed by that change, freed
+	together with the snapshot */
+	unsigned int num_removed;
+	lb_snapshot_t *next;	/* the snapshot retired before it */
+};
+
+/* The kinds of requests of an input file; the values are also the kinds of
+the records of a command log */
+typedef enum request_type_t {
+	REQUEST_STORE = 'S',
+	REQUEST_RETRIEVE = 'R',
+	REQUEST_ADD_SERVER = 'A',
+	REQUEST_REMOVE_SERVER = 'D',
+} request_type_t;
+
+/* A request parsed in place: the key and the value are ended by 0 inside the
+buffer of the reader, and stay there until the next request is read */
+struct request_t {
+	request_type_t type;
+	char *key;	/* NULL for the changes of the servers */
+	unsigned int key_len;
+	char *value;	/* only for store */
+	unsigned int value_len;
+	int server_id;	/* only for the changes of the servers */
+	unsigned int weight;	/* 0 if the request has none */
+	int hashed;	/* 1 if hash is the hash of the key (from a command log) */
+	unsigned int hash;
+};
+
+/* Reads an input file in big blocks; the lines not parsed yet are between
+start and end */
+struct request_reader_t {
+	int fd;
+	char *buffer;	/* capacity bytes, and one more to end the last line */
+	size_t capacity;
+	size_t start;
+	size_t end;
+	int eof;	/* 1 once a read found nothing more */
+	const char *error;	/* why the last request_next failed */
+};
+
+/* Gathers the results of the requests, and writes them in big blocks */
+struct result_writer_t {
+	int fd;
+	char *buffer;	/* RESULT_BUFFER bytes */
+	size_t size;	/* the bytes not written yet */
+	result_format_t format;
+	int echo_values;	/* 0 if the values are left out */
+};
+
+/* Writes a command log in big blocks, hashing the keys on the way */
+struct command_log_writer_t {
+	int fd;
+	char *buffer;	/* CMDLOG_BUFFER bytes */
+	size_t size;	/* the bytes not written yet */
+	key_hash_fn key_hash;
+	unsigned int hash_seed;
+};
+
+/* Reads a command log mapped in memory */
+struct command_log_reader_t {
+	char *bytes;	/* the whole log */
+	size_t size;
+	size_t pos;	/* the next record */
+	const char *error;	/* why the last command_log_next failed */
+};
+
+/* Where the requests are read from: a text file, or a command log */
+struct request_source_t {
+	request_reader_t *reader;	/* NULL for a command log */
+	command_log_reader_t *log;	/* NULL for a text file */
+	const char *error;	/* why the last source_next failed */
+};
+
+/* A ring of pointers between two threads; the producer writes only the first
+group of positions and the consumer only the second one, on another cache
+line, so they don't take it from one another at every pointer */
+struct spsc_ring_t {
+	void **items;	/* mask + 1 pointers */
+	unsigned int mask;
+	char padding[LB_CACHE_LINE - sizeof(void **) - sizeof(unsigned int)];
+	unsigned long long tail;	/* the pointers pushed so far */
+	unsigned long long head_seen;	/* the last head read by the producer */
+	char producer_padding[LB_CACHE_LINE - 2 * sizeof(unsigned long long)];
+	unsigned long long head;	/* the pointers popped so far */
+	unsigned long long tail_seen;	/* the last tail read by the consumer */
+	char consumer_padding[LB_CACHE_LINE - 2 * sizeof(unsigned long long)];
+};
+
+/* The result of a request applied by the pipeline; a retrieved value is
+copied in the batch, because a later request can change it */
+struct request_result_t {
+	int kind;	/* RESULT_STORED, RESULT_RETRIEVED, RESULT_MISSING, or 0 */
+	int server_id;
+	unsigned int owner;	/* the thread that applied it, and its values */
+	size_t value;	/* where the retrieved value starts in those values */
+	unsigned int value_len;
+	server_memory_t *memory;	/* the server of the key, when the servers
+	are split between threads */
+	request_batch_t *batch;	/* the batch of the result, for those threads */
+};
+
+/* The retrieved values copied by a thread in a batch */
+struct request_values_t {
+	char *bytes;
+	size_t size;
+	size_t capacity;
+};
+
+/* Requests passed together from a stage of the pipeline to the next one */
+struct request_batch_t {
+	request_t requests[PIPELINE_BATCH];
+	request_result_t results[PIPELINE_BATCH];
+	unsigned int count;
+	char *strings;	/* the keys and the values of the requests, copied from
+	the buffer of a text reader */
+	size_t strings_size;
+	size_t strings_capacity;
+	request_values_t *values;	/* one for every thread that applies the
+	requests */
+	unsigned int pending;	/* the requests not applied yet by those threads */
 };
 
 #endif	// DATA_STRUCTS_H_
@@ -1,5 +1,6 @@
 /* Copyright 2023 <Tudor Cristian-Andrei> */
 #include "datastruct_funcs.h"
+#include "slab.h"
 
 /**
  * @section Single Linked Lists
@@ -28,12 +29,13 @@ node_t* get_nth_node(list_t* list, unsigned int n)
 	return node;
 }
 
-node_t* create_node(const void* new_data, unsigned int data_size)
+node_t* create_node(slab_t *slab, const void* new_data, unsigned int data_size)
 {
-	node_t* node = calloc(1, sizeof(*node));
+	node_t* node = slab_alloc(slab, sizeof(*node));
 	DIE(!node, "Failed create_node\n");
+	node->next = NULL;
 
-	node->data = malloc(data_size);
+	node->data = slab_alloc(slab, data_size);
 	DIE(!node->data, "Failed create_node -> data\n");
 
 	memcpy(node->data, new_data, data_size);
@@ -48,7 +50,7 @@ void ll_add_nth_node(list_t* list, unsigned int n, const void* new_data)
 	if (!list)
 		return;
 
-	new_node = create_node(new_data, list->data_size);
+	new_node = create_node(NULL, new_data, list->data_size);
 
 	if (!n || !list->size) {
 		new_node->next = list->head;
@@ -108,8 +110,54 @@ void ll_free(list_t** pp_list)
 }
 
 /**
- * @section Hashtable 
+ * @section Hashtable
+ *
+ * The buckets are zeroed list_t structs kept inline in segments of
+ * HT_SEGMENT buckets, and every node holds a pair_t. When the load factor
+ * goes above HT_MAX_LOAD or below 1 / HT_MIN_LOAD_DIV the table starts moving
+ * to a new bucket array, but it does so incrementally: every put and remove
+ * moves at most HT_REHASH_STEP buckets, so no single operation pays for the
+ * whole resize.
+ * While a resize is in progress a key lives in the old array if its old
+ * bucket was not moved yet, and in the new array otherwise. The segments are
+ * allocated the first time something is put in them, and the old ones are
+ * released one by one as they are emptied, so neither the start nor the end
+ * of a resize touches the whole array at once.
  */
+static list_t **ht_alloc_buckets(unsigned int hmax)
+{
+	unsigned int num_segments = (hmax + HT_SEGMENT - 1) / HT_SEGMENT;
+	list_t **segments = calloc(num_segments, sizeof(list_t *));
+	DIE(!segments, "Failed while creating buckets for hashtable\n");
+
+	return segments;
+}
+
+/* A bucket from a segment that was never allocated, so it is empty */
+static list_t empty_bucket;
+
+static inline list_t *ht_slot(list_t **segments, unsigned int idx)
+{
+	list_t *segment = segments[idx / HT_SEGMENT];
+
+	return segment ? &segment[idx % HT_SEGMENT] : &empty_bucket;
+}
+
+static list_t *ht_slot_alloc(list_t **segments, unsigned int idx,
+							 unsigned int hmax)
+{
+	list_t **segment = &segments[idx / HT_SEGMENT];
+
+	if (*segment == NULL) {
+		unsigned int first = idx / HT_SEGMENT * HT_SEGMENT;
+
+		*segment = calloc(MIN(HT_SEGMENT, hmax - first), sizeof(list_t));
+		DIE(!*segment, "Failed while creating buckets for hashtable\n");
+	}
+
+	return &(*segment)[idx % HT_SEGMENT];
+}
+
 hashtable_t *ht_create(unsigned int hmax, unsigned int (*hash_function)(void*),
 						void (*key_val_free_function)(void *),
 						int (*compare_function)(void*, void*))
@@ -118,110 +166,509 @@ hashtable_t *ht_create(unsigned int hmax, unsigned int (*hash_function)(void*),
 	DIE(!ht, "Failed ht_create\n");
 	ht->size = 0;
 	ht->hmax = hmax;
-	ht->buckets = (list_t **)malloc(hmax * sizeof(list_t *));
-	DIE(!ht->buckets, "Failed while creating buckets for hashtable\n");
-	for (unsigned int i = 0; i < hmax; i++) {
-		ht->buckets[i] = ll_create(sizeof(pair_t));
-		DIE(!ht->buckets[i], "Failed while creating a bucket\n");
-	}
+	ht->min_hmax = hmax;
+	ht->buckets = ht_alloc_buckets(hmax);
+
+	ht->old_buckets = NULL;
+	ht->old_hmax = 0;
+	ht->rehash_idx = 0;
+	ht->paused = 0;
 
 	ht->hash_function = hash_function;
+	ht->key_hash = NULL;
+	ht->hash_seed = 0;
 	ht->key_val_free_function = key_val_free_function;
 	ht->compare_function = compare_function;
+	ht->slab = NULL;
 
 	return ht;
 }
 
-int ht_has_key(hashtable_t *ht, void *key)
+void ht_set_slab(hashtable_t *ht, slab_t *slab)
+{
+	ht->slab = slab;
+}
+
+void ht_set_hash(hashtable_t *ht, key_hash_fn key_hash, unsigned int seed)
 {
-	unsigned int idx = ht->hash_function(key);
-	idx = idx % ht->hmax;
+	ht->key_hash = key_hash;
+	ht->hash_seed = seed;
+}
 
-	node_t *curr = ht->buckets[idx]->head;
+static unsigned int ht_hash(hashtable_t *ht, void *key)
+{
+	if (ht->key_hash)
+		return ht->key_hash(key, ht->hash_seed);
 
-	while (curr != NULL) {
-		if (ht->compare_function(key, ((pair_t *)curr->data)->key) == 0)
-			return 1;
+	return ht->hash_function(key);
+}
 
-		curr = curr->next;
+/**
+ * Frees a node and its pair. With a slab, the key and the value were
+ * allocated by ht_put, so their sizes are known.
+ */
+static void ht_free_node(hashtable_t *ht, node_t *node)
+{
+	pair_t *pair = (pair_t *)node->data;
+
+	if (ht->slab) {
+		slab_free(ht->slab, pair->key, pair->key_size);
+		slab_free(ht->slab, pair->value, pair->value_size);
+	} else {
+		ht->key_val_free_function(pair);
 	}
 
-	return 0;
+	slab_free(ht->slab, pair, sizeof(pair_t));
+	slab_free(ht->slab, node, sizeof(node_t));
 }
 
-void *ht_get(hashtable_t *ht, void *key)
+/**
+ * Returns the bucket that holds a key with the given hash. When alloc is set,
+ * the bucket is also ready to take a new node.
+ */
+static list_t *ht_bucket_of(hashtable_t *ht, unsigned int hash, int alloc)
+{
+	if (ht->old_buckets) {
+		unsigned int old_idx = hash % ht->old_hmax;
+
+		/**
+		 * A bucket that wasn't moved yet lives in an allocated segment,
+		 * unless it is empty and nobody puts something in it.
+		 */
+		if (old_idx >= ht->rehash_idx) {
+			if (alloc)
+				return ht_slot_alloc(ht->old_buckets, old_idx,
+									 ht->old_hmax);
+			return ht_slot(ht->old_buckets, old_idx);
+		}
+	}
+
+	if (alloc)
+		return ht_slot_alloc(ht->buckets, hash % ht->hmax, ht->hmax);
+	return ht_slot(ht->buckets, hash % ht->hmax);
+}
+
+static void ht_bucket_push(list_t *bucket, node_t *node)
+{
+	node->next = bucket->head;
+	bucket->head = node;
+	bucket->size++;
+}
+
+static void ht_rehash_step(hashtable_t *ht)
+{
+	unsigned int moved = 0;
+
+	while (ht->rehash_idx < ht->old_hmax && moved < HT_REHASH_STEP) {
+		list_t *bucket = ht_slot(ht->old_buckets, ht->rehash_idx);
+		node_t *curr = bucket->head;
+
+		/**
+		 * The nodes are relinked in the new array, nothing is copied, and
+		 * the hashes come from the pairs, so no key is hashed again.
+		 */
+		while (curr != NULL) {
+			node_t *next = curr->next;
+			unsigned int hash = ((pair_t *)curr->data)->hash;
+
+			ht_bucket_push(ht_slot_alloc(ht->buckets, hash % ht->hmax,
+										 ht->hmax), curr);
+			curr = next;
+		}
+
+		if (bucket != &empty_bucket) {
+			bucket->head = NULL;
+			bucket->size = 0;
+		}
+		ht->rehash_idx++;
+		moved++;
+
+		if (ht->rehash_idx % HT_SEGMENT == 0 ||
+			ht->rehash_idx == ht->old_hmax) {
+			unsigned int seg = (ht->rehash_idx - 1) / HT_SEGMENT;
+
+			free(ht->old_buckets[seg]);
+			ht->old_buckets[seg] = NULL;
+		}
+	}
+
+	if (ht->rehash_idx == ht->old_hmax) {
+		free(ht->old_buckets);
+		ht->old_buckets = NULL;
+		ht->old_hmax = 0;
+		ht->rehash_idx = 0;
+	}
+}
+
+static void ht_start_resize(hashtable_t *ht, unsigned int new_hmax)
 {
-	unsigned int idx = ht->hash_function(key);
-	idx = idx % ht->hmax;
+	ht->old_buckets = ht->buckets;
+	ht->old_hmax = ht->hmax;
+	ht->rehash_idx = 0;
 
-	node_t *curr = ht->buckets[idx]->head;
+	ht->buckets = ht_alloc_buckets(new_hmax);
+	ht->hmax = new_hmax;
+}
+
+/**
+ * Called after every update: moves a few buckets if a resize is in progress,
+ * or starts a new one if the load factor went out of bounds.
+ */
+static void ht_maintain(hashtable_t *ht)
+{
+	if (ht->paused)
+		return;
+
+	if (ht->old_buckets) {
+		ht_rehash_step(ht);
+		return;
+	}
+
+	if (ht->size > HT_MAX_LOAD * ht->hmax)
+		ht_start_resize(ht, 2 * ht->hmax);
+	else if (ht->hmax > ht->min_hmax && ht->size < ht->hmax / HT_MIN_LOAD_DIV)
+		ht_start_resize(ht, MAX(ht->hmax / 2, ht->min_hmax));
+}
+
+/**
+ * Walks the chain of a bucket for the key. The hash of every entry is kept
+ * in its pair, so most of the other keys are rejected without comparing
+ * them. The node before the found one is returned through prev.
+ */
+static node_t *ht_find(hashtable_t *ht, list_t *bucket, void *key,
+					   unsigned int hash, node_t **prev)
+{
+	node_t *curr = bucket->head;
 
+	*prev = NULL;
 	while (curr != NULL) {
-		if (ht->compare_function(key, ((pair_t *)curr->data)->key) == 0)
-			return ((pair_t *)curr->data)->value;
+		pair_t *pair = (pair_t *)curr->data;
+
+		if (pair->hash == hash && ht->compare_function(key, pair->key) == 0)
+			return curr;
 
+		*prev = curr;
 		curr = curr->next;
 	}
 
 	return NULL;
 }
 
-void ht_put(hashtable_t *ht, void *key, unsigned int key_size,
+int ht_has_key(hashtable_t *ht, void *key)
+{
+	return ht_has_key_hashed(ht, key, ht_hash(ht, key));
+}
+
+int ht_has_key_hashed(hashtable_t *ht, void *key, unsigned int hash)
+{
+	node_t *prev;
+
+	return ht_find(ht, ht_bucket_of(ht, hash, 0), key, hash, &prev) != NULL;
+}
+
+void *ht_get(hashtable_t *ht, void *key)
+{
+	return ht_get_hashed(ht, key, ht_hash(ht, key));
+}
+
+void *ht_get_hashed(hashtable_t *ht, void *key, unsigned int hash)
+{
+	node_t *prev;
+	node_t *node = ht_find(ht, ht_bucket_of(ht, hash, 0), key, hash, &prev);
+
+	return node ? ((pair_t *)node->data)->value : NULL;
+}
+
+int ht_put(hashtable_t *ht, void *key, unsigned int key_size,
 	void *value, unsigned int value_size)
 {
-	if (ht_has_key(ht, key) == 1)
-		return;
+	return ht_put_hashed(ht, key, ht_hash(ht, key), key_size, value,
+						 value_size);
+}
+
+/**
+ * Replaces the value of a pair, in its old buffer if the new value fits.
+ */
+static void ht_set_value(hashtable_t *ht, pair_t *pair, void *value,
+						 unsigned int value_size)
+{
+	if (!slab_fits(ht->slab, pair->value_size, value_size)) {
+		slab_free(ht->slab, pair->value, pair->value_size);
+		pair->value = slab_alloc(ht->slab, value_size);
+		DIE(!pair->value, "Error while updating a (key, value) pair.\n");
+	}
 
-	unsigned int idx = ht->hash_function(key);
-	idx %= ht->hmax;
+	memcpy(pair->value, value, value_size);
+	pair->value_size = value_size;
+}
+
+/**
+ * The chain is walked only once: the key is either found and (with replace
+ * set) updated, or it is missing and the new pair goes in the same bucket.
+ * Returns 1 if the key was inserted, and 0 if it already existed.
+ */
+int ht_upsert_hashed(hashtable_t *ht, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size, int replace, void **stored_key)
+{
+	list_t *bucket = ht_bucket_of(ht, hash, 1);
+	node_t *prev;
+	node_t *node = ht_find(ht, bucket, key, hash, &prev);
+
+	if (node) {
+		if (replace)
+			ht_set_value(ht, (pair_t *)node->data, value, value_size);
+		if (stored_key)
+			*stored_key = ((pair_t *)node->data)->key;
+		return 0;
+	}
 
 	pair_t pair;
-	pair.key = malloc(key_size);
+	pair.key = slab_alloc(ht->slab, key_size);
 	DIE(!pair.key, "Error while creating a (key, value) pair.\n");
 	memcpy(pair.key, key, key_size);
-	pair.value = malloc(value_size);
+	pair.value = slab_alloc(ht->slab, value_size);
 	DIE(!pair.value, "Error while creating a (key, value) pair.\n");
 	memcpy(pair.value, value, value_size);
+	pair.key_size = key_size;
+	pair.value_size = value_size;
+	pair.hash = hash;
 
-	ll_add_nth_node(ht->buckets[idx], 0, &pair);
+	ht_bucket_push(bucket, create_node(ht->slab, &pair, sizeof(pair_t)));
 	ht->size++;
+
+	if (stored_key)
+		*stored_key = pair.key;
+
+	ht_maintain(ht);
+
+	return 1;
+}
+
+int ht_put_hashed(hashtable_t *ht, void *key, unsigned int hash,
+				  unsigned int key_size, void *value, unsigned int value_size)
+{
+	return ht_upsert_hashed(ht, key, hash, key_size, value, value_size, 1,
+							NULL);
+}
+
+int ht_insert_hashed(hashtable_t *ht, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size)
+{
+	return ht_upsert_hashed(ht, key, hash, key_size, value, value_size, 0,
+							NULL);
+}
+
+void ht_prefetch_hashed(hashtable_t *ht, unsigned int hash, int depth)
+{
+	list_t *bucket = ht_bucket_of(ht, hash, 0);
+
+	if (depth == 0)
+		PREFETCH(bucket);
+	else if (bucket->head)
+		PREFETCH(bucket->head);
 }
 
 void ht_remove_entry(hashtable_t *ht, void *key)
 {
-	unsigned int idx = ht->hash_function(key);
-	idx = idx % ht->hmax;
-
-	node_t *curr = ht->buckets[idx]->head;
-	unsigned int i = 0;
-	while(curr != NULL) {
-		if (ht->compare_function(key, ((pair_t *)curr->data)->key) == 0) {
-			node_t *erase = ll_remove_nth_node(ht->buckets[idx], i);
-			ht->key_val_free_function(erase->data);
-			free(erase->data);
-			free(erase);
-			ht->size--;
-			return;
-		}
+	ht_remove_entry_hashed(ht, key, ht_hash(ht, key));
+}
 
-		curr = curr->next;
-		i++;
+void ht_remove_entry_hashed(hashtable_t *ht, void *key, unsigned int hash)
+{
+	list_t *bucket = ht_bucket_of(ht, hash, 0);
+	node_t *prev;
+	node_t *node = ht_find(ht, bucket, key, hash, &prev);
+
+	if (!node)
+		return;
+
+	if (prev)
+		prev->next = node->next;
+	else
+		bucket->head = node->next;
+	bucket->size--;
+
+	ht_free_node(ht, node);
+	ht->size--;
+
+	ht_maintain(ht);
+}
+
+static void ht_free_buckets(hashtable_t *ht, list_t **segments,
+							unsigned int from, unsigned int hmax)
+{
+	/**
+	 * The nodes cut from a slab are released together with it, by the
+	 * owner of the slab, so there is no need to walk them.
+	 */
+	for (unsigned int i = from; i < hmax && !ht->slab; i++) {
+		node_t *curr = ht_slot(segments, i)->head;
+
+		while (curr != NULL) {
+			node_t *next = curr->next;
+
+			ht_free_node(ht, curr);
+			curr = next;
+		}
 	}
+
+	for (unsigned int i = from / HT_SEGMENT; i * HT_SEGMENT < hmax; i++)
+		free(segments[i]);
+	free(segments);
 }
 
 void ht_free(hashtable_t *ht)
 {
-	for (unsigned int i = 0; i < ht->hmax; i++) {
-		node_t *curr = ht->buckets[i]->head;
-		for (unsigned int j = 0; j < ht->buckets[i]->size; j++) {
-			ht->key_val_free_function(curr->data);
-			curr = curr->next;
+	if (ht->old_buckets)
+		ht_free_buckets(ht, ht->old_buckets, ht->rehash_idx, ht->old_hmax);
+	ht_free_buckets(ht, ht->buckets, 0, ht->hmax);
+	free(ht);
+}
+
+static void ht_filter_buckets(hashtable_t *ht, list_t **segments,
+							  unsigned int from, unsigned int hmax,
+							  ht_keep_fn keep, void *arg)
+{
+	for (unsigned int i = from; i < hmax; i++) {
+		list_t *bucket = ht_slot(segments, i);
+		node_t *curr = bucket->head;
+		node_t *prev = NULL;
+
+		while (curr != NULL) {
+			node_t *next = curr->next;
+			pair_t *pair = (pair_t *)curr->data;
+
+			if (keep(pair->key, pair->value, pair->hash, arg)) {
+				prev = curr;
+				curr = next;
+				continue;
+			}
+
+			if (prev)
+				prev->next = next;
+			else
+				bucket->head = next;
+			bucket->size--;
+
+			ht_free_node(ht, curr);
+			ht->size--;
+
+			curr = next;
+		}
+	}
+}
+
+void ht_filter(hashtable_t *ht, ht_keep_fn keep, void *arg)
+{
+	/**
+	 * The buckets must stay in place during the walk, even if the callback
+	 * updates the table.
+	 */
+	ht->paused++;
+	if (ht->old_buckets)
+		ht_filter_buckets(ht, ht->old_buckets, ht->rehash_idx, ht->old_hmax,
+						  keep, arg);
+	ht_filter_buckets(ht, ht->buckets, 0, ht->hmax, keep, arg);
+	ht->paused--;
+
+	ht_maintain(ht);
+}
+
+static void ht_drain_buckets(list_t **segments, unsigned int from,
+							 unsigned int hmax, ht_take_fn take, void *arg)
+{
+	for (unsigned int i = from; i < hmax; i++) {
+		list_t *bucket = ht_slot(segments, i);
+		node_t *curr = bucket->head;
+
+		/* the bucket is unlinked first, take may reuse the node right away */
+		if (bucket != &empty_bucket) {
+			bucket->head = NULL;
+			bucket->size = 0;
 		}
 
-		ll_free(&ht->buckets[i]);
+		while (curr != NULL) {
+			node_t *next = curr->next;
+
+			curr->next = NULL;
+			take(curr, ((pair_t *)curr->data)->hash, arg);
+			curr = next;
+		}
 	}
-	free(ht->buckets);
-	free(ht);
+}
+
+void ht_drain(hashtable_t *ht, ht_take_fn take, void *arg)
+{
+	ht->paused++;
+	if (ht->old_buckets)
+		ht_drain_buckets(ht->old_buckets, ht->rehash_idx, ht->old_hmax, take,
+						 arg);
+	ht_drain_buckets(ht->buckets, 0, ht->hmax, take, arg);
+	ht->size = 0;
+	ht->paused--;
+
+	ht_maintain(ht);
+}
+
+/**
+ * The old buckets that were not moved yet and the new ones are seen as one
+ * row, the old ones first, like ht_drain walks them, and the row is cut in
+ * parts of the same length.
+ */
+void ht_drain_part(hashtable_t *ht, unsigned int part, unsigned int parts,
+				   ht_take_fn take, void *arg)
+{
+	unsigned int old = ht->old_buckets ? ht->old_hmax - ht->rehash_idx : 0;
+	unsigned long long total = (unsigned long long)old + ht->hmax;
+	unsigned int from = total * part / parts;
+	unsigned int to = total * (part + 1) / parts;
+
+	if (from < old)
+		ht_drain_buckets(ht->old_buckets, ht->rehash_idx + from,
+						 ht->rehash_idx + MIN(to, old), take, arg);
+	if (to > old)
+		ht_drain_buckets(ht->buckets, from > old ? from - old : 0, to - old,
+						 take, arg);
+}
+
+void ht_drain_done(hashtable_t *ht)
+{
+	ht->size = 0;
+	ht_maintain(ht);
+}
+
+/**
+ * The node is linked as it is: the key, the value, the pair and the node
+ * itself are only handed over to the slab of the table.
+ */
+int ht_adopt_node(hashtable_t *ht, node_t *node, slab_t *from,
+				  void **stored_key)
+{
+	pair_t *pair = (pair_t *)node->data;
+	list_t *bucket = ht_bucket_of(ht, pair->hash, 1);
+	node_t *prev;
+
+	slab_take(ht->slab, from, pair->key, pair->key_size);
+	slab_take(ht->slab, from, pair->value, pair->value_size);
+	slab_take(ht->slab, from, pair, sizeof(pair_t));
+	slab_take(ht->slab, from, node, sizeof(node_t));
+
+	if (ht_find(ht, bucket, pair->key, pair->hash, &prev)) {
+		ht_free_node(ht, node);
+		return 0;
+	}
+
+	ht_bucket_push(bucket, node);
+	ht->size++;
+
+	if (stored_key)
+		*stored_key = pair->key;
+
+	ht_maintain(ht);
+
+	return 1;
 }
 
 unsigned int ht_get_size(hashtable_t *ht)
@@ -246,6 +693,135 @@ void key_val_free_function(void *data)
 	free(((pair_t *)data)->value);
 }
 
+/**
+ * @section Id Map
+ */
+static unsigned int id_map_slot(id_map_t *map, unsigned int id)
+{
+	/**
+	 * Fibonacci hashing: the high bits of the product depend on every bit of
+	 * the id, so ids that only differ in their high bits (a stride of 1024,
+	 * say) still spread over the whole map.
+	 */
+	return (id * 2654435769u) >> map->shift;
+}
+
+id_map_t *id_map_create(unsigned int capacity)
+{
+	id_map_t *map = malloc(sizeof(id_map_t));
+	DIE(!map, "Failed id_map_create\n");
+
+	map->capacity = 16;
+	map->shift = 28;
+	while (map->capacity < 2 * capacity) {
+		map->capacity <<= 1;
+		map->shift--;
+	}
+	map->size = 0;
+
+	map->slots = malloc(map->capacity * sizeof(id_slot_t));
+	DIE(!map->slots, "Failed id_map_create -> slots\n");
+	for (unsigned int i = 0; i < map->capacity; i++)
+		map->slots[i].index = -1;
+
+	return map;
+}
+
+int id_map_get(id_map_t *map, unsigned int id)
+{
+	unsigned int i = id_map_slot(map, id);
+
+	while (map->slots[i].index != -1) {
+		if (map->slots[i].id == id)
+			return map->slots[i].index;
+
+		i = (i + 1) & (map->capacity - 1);
+	}
+
+	return -1;
+}
+
+static void id_map_grow(id_map_t *map)
+{
+	id_slot_t *old_slots = map->slots;
+	unsigned int old_capacity = map->capacity;
+
+	map->capacity <<= 1;
+	map->shift--;
+	map->size = 0;
+	map->slots = malloc(map->capacity * sizeof(id_slot_t));
+	DIE(!map->slots, "Failed id_map_grow\n");
+	for (unsigned int i = 0; i < map->capacity; i++)
+		map->slots[i].index = -1;
+
+	for (unsigned int i = 0; i < old_capacity; i++)
+		if (old_slots[i].index != -1)
+			id_map_set(map, old_slots[i].id, old_slots[i].index);
+
+	free(old_slots);
+}
+
+void id_map_set(id_map_t *map, unsigned int id, int index)
+{
+	/* keep the load factor under 1/2, so the probe chains stay short */
+	if (2 * (map->size + 1) > map->capacity)
+		id_map_grow(map);
+
+	unsigned int i = id_map_slot(map, id);
+
+	while (map->slots[i].index != -1) {
+		if (map->slots[i].id == id) {
+			map->slots[i].index = index;
+			return;
+		}
+
+		i = (i + 1) & (map->capacity - 1);
+	}
+
+	map->slots[i].id = id;
+	map->slots[i].index = index;
+	map->size++;
+}
+
+void id_map_remove(id_map_t *map, unsigned int id)
+{
+	unsigned int mask = map->capacity - 1;
+	unsigned int i = id_map_slot(map, id);
+
+	while (map->slots[i].index != -1 && map->slots[i].id != id)
+		i = (i + 1) & mask;
+
+	if (map->slots[i].index == -1)
+		return;
+
+	/**
+	 * Backward shift deletion: move back every slot of the cluster that
+	 * would become unreachable through the hole, so no tombstones are needed.
+	 */
+	unsigned int hole = i;
+	unsigned int j = (i + 1) & mask;
+
+	while (map->slots[j].index != -1) {
+		unsigned int home = id_map_slot(map, map->slots[j].id);
+
+		if (((j - home) & mask) >= ((j - hole) & mask)) {
+			map->slots[hole] = map->slots[j];
+			hole = j;
+		}
+
+		j = (j + 1) & mask;
+	}
+
+	map->slots[hole].index = -1;
+	map->size--;
+}
+
+void id_map_free(id_map_t *map)
+{
+	free(map->slots);
+	free(map);
+}
+
 int compare_function_ints(void *a, void *b)
 {
 	int int_a = *((int *)a);
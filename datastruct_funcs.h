@@ -8,6 +8,7 @@
 #include "utils.h"
 
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
 
 /**
  * Functions for Single Linked Lists from the lab
@@ -22,21 +23,118 @@ void ll_free(list_t** pp_list);
 
 /**
  * Functions for Hashtables
- * Those are my implementations from the Hashtable Lab
+ * Those are my implementations from the Hashtable Lab, extended with
+ * incremental resizing. The hmax given to ht_create is also the minimum
+ * number of buckets. ht_put replaces the value of an existing key (reusing
+ * its buffer when the new value fits), and returns 1 if the key was inserted,
+ * 0 if it was updated.
 */
 hashtable_t *ht_create(unsigned int hmax, unsigned int (*hash_function)(void*),
                         void (*key_val_free_function)(void *),
                         int (*compare_function)(void*, void*));
 int ht_has_key(hashtable_t *ht, void *key);
 void *ht_get(hashtable_t *ht, void *key);
-void ht_put(hashtable_t *ht, void *key, unsigned int key_size, void *value,
-            unsigned int value_size);
+int ht_put(hashtable_t *ht, void *key, unsigned int key_size, void *value,
+           unsigned int value_size);
 void ht_remove_entry(hashtable_t *ht, void *key);
+
+/**
+ * The same operations, for a key whose hash was already computed with the
+ * hash function of the table. The hash is stored in the entry, so the table
+ * never hashes the key again.
+*/
+int ht_has_key_hashed(hashtable_t *ht, void *key, unsigned int hash);
+void *ht_get_hashed(hashtable_t *ht, void *key, unsigned int hash);
+int ht_put_hashed(hashtable_t *ht, void *key, unsigned int hash,
+				  unsigned int key_size, void *value, unsigned int value_size);
+
+/**
+ * Like ht_put_hashed, but an existing key keeps its value. Returns 1 if the
+ * key was inserted, and 0 if it already existed.
+*/
+int ht_insert_hashed(hashtable_t *ht, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size);
+
+/**
+ * Both of the above: with replace set, it is ht_put_hashed, otherwise it is
+ * ht_insert_hashed. If stored_key isn't NULL, it is set to the key kept by
+ * the table, which stays at the same address until the key is removed.
+*/
+int ht_upsert_hashed(hashtable_t *ht, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size, int replace, void **stored_key);
+void ht_remove_entry_hashed(hashtable_t *ht, void *key, unsigned int hash);
+
+/**
+ * Starts loading the memory that a lookup of the hash will read: with depth
+ * 0 the bucket, and with depth 1 the first node of its chain, which reads the
+ * bucket, so it should come after a prefetch with depth 0.
+*/
+void ht_prefetch_hashed(hashtable_t *ht, unsigned int hash, int depth);
 void ht_free(hashtable_t *ht);
 unsigned int ht_get_size(hashtable_t *ht);
 unsigned int ht_get_hmax(hashtable_t *ht);
+
+/**
+ * Walks every entry of the hashtable, and removes the ones for which keep
+ * returns 0. The stored hash of the key is given to keep. The buckets stay in
+ * place for the whole walk.
+*/
+void ht_filter(hashtable_t *ht, ht_keep_fn keep, void *arg);
+
+/**
+ * Empties the hashtable in one walk over its buckets: every node is unlinked
+ * and handed to take, with the stored hash of its key, and nothing is freed.
+ * A node given to take no longer belongs to the table.
+*/
+void ht_drain(hashtable_t *ht, ht_take_fn take, void *arg);
+
+/**
+ * Like ht_drain, for one of parts slices of the buckets, so different threads
+ * can empty the slices at once; the nodes of the slices, taken in the order
+ * of the parts, come in the order of ht_drain. Nothing else may use the
+ * hashtable until every slice is empty and ht_drain_done is called.
+*/
+void ht_drain_part(hashtable_t *ht, unsigned int part, unsigned int parts,
+				   ht_take_fn take, void *arg);
+void ht_drain_done(hashtable_t *ht);
+
+/**
+ * Links a node taken out of another hashtable by ht_drain, without copying
+ * its key or value. The blocks of the node were allocated from the slab from,
+ * and are handed over to the slab of the table (see slab_take). If the key
+ * already exists, it keeps its value and the node is freed. Returns 1 if the
+ * node was linked, 0 if it was freed; stored_key is set like in
+ * ht_upsert_hashed.
+*/
+int ht_adopt_node(hashtable_t *ht, node_t *node, slab_t *from,
+				  void **stored_key);
 void key_val_free_function(void *data);
 
+/**
+ * Makes the hashtable allocate its nodes, keys and values from a slab. It has
+ * to be called while the table is empty; the slab outlives the table, and
+ * ht_free leaves the entries to slab_destroy.
+*/
+void ht_set_slab(hashtable_t *ht, slab_t *slab);
+
+/**
+ * Makes the hashtable hash its keys with a seeded hash function, instead of
+ * the one given to ht_create. It has to be called while the table is empty.
+*/
+void ht_set_hash(hashtable_t *ht, key_hash_fn key_hash, unsigned int seed);
+
+/**
+ * Functions for the map from server ids to indices in the array of servers.
+ * It uses linear probing, and id_map_get returns -1 for a missing id.
+*/
+id_map_t *id_map_create(unsigned int capacity);
+int id_map_get(id_map_t *map, unsigned int id);
+void id_map_set(id_map_t *map, unsigned int id, int index);
+void id_map_remove(id_map_t *map, unsigned int id);
+void id_map_free(id_map_t *map);
+
 /**
  * Those functions are taken from the lab
  * General purpose functions
@@ -0,0 +1,593 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdlib.h>
+#include <string.h>
+
+#include "flat_table.h"
+#include "slab.h"
+
+/**
+ * The keys and the values of a flat table are always strings, so their sizes
+ * are known when they are freed. An entry is found by
+ * probing from its home slot, and Robin Hood insertion keeps every chain
+ * ordered by distance, so a lookup stops as soon as it meets a slot that is
+ * closer to its home than the key would be.
+ */
+
+/* Fibonacci hashing spreads even the weak low bits of the key hash */
+static inline unsigned int ft_home(unsigned int hash, unsigned int shift)
+{
+	return (hash * 2654435769u) >> shift;
+}
+
+static unsigned int ft_log2(unsigned int capacity)
+{
+	unsigned int bits = 0;
+
+	while ((1u << bits) < capacity)
+		bits++;
+
+	return bits;
+}
+
+static flat_slot_t *ft_alloc_slots(unsigned int capacity)
+{
+	flat_slot_t *slots = calloc(capacity, sizeof(flat_slot_t));
+	DIE(!slots, "Failed while creating the slots of a flat table\n");
+
+	return slots;
+}
+
+flat_table_t *ft_create(unsigned int capacity,
+						unsigned int (*hash_function)(void*))
+{
+	flat_table_t *ft = malloc(sizeof(flat_table_t));
+	DIE(!ft, "Failed ft_create\n");
+
+	ft->capacity = FT_MIN_CAPACITY;
+	while (ft->capacity < capacity)
+		ft->capacity <<= 1;
+	ft->shift = 32 - ft_log2(ft->capacity);
+	ft->min_capacity = ft->capacity;
+	ft->slots = ft_alloc_slots(ft->capacity);
+	ft->size = 0;
+
+	ft->old_slots = NULL;
+	ft->old_capacity = 0;
+	ft->old_shift = 0;
+	ft->old_size = 0;
+	ft->migrate_idx = 0;
+	ft->paused = 0;
+
+	ft->hash_function = hash_function;
+	ft->key_hash = NULL;
+	ft->hash_seed = 0;
+	ft->slab = NULL;
+
+	return ft;
+}
+
+void ft_set_slab(flat_table_t *ft, slab_t *slab)
+{
+	ft->slab = slab;
+}
+
+void ft_set_hash(flat_table_t *ft, key_hash_fn key_hash, unsigned int seed)
+{
+	ft->key_hash = key_hash;
+	ft->hash_seed = seed;
+}
+
+static unsigned int ft_hash(flat_table_t *ft, void *key)
+{
+	if (ft->key_hash)
+		return ft->key_hash(key, ft->hash_seed);
+
+	return ft->hash_function(key);
+}
+
+static void ft_free_strings(flat_table_t *ft, flat_slot_t *slot)
+{
+	if (!slot->key)
+		return;
+
+	slab_free(ft->slab, slot->key, strlen(slot->key) + 1);
+	slab_free(ft->slab, slot->value, strlen(slot->value) + 1);
+}
+
+static flat_slot_t *ft_find(flat_slot_t *slots, unsigned int capacity,
+							unsigned int shift, unsigned int hash, void *key)
+{
+	unsigned int mask = capacity - 1;
+	unsigned int i = ft_home(hash, shift);
+	unsigned int dist = 1;
+
+	while (slots[i].dist >= dist) {
+		if (slots[i].hash == hash && slots[i].key &&
+			strcmp(key, slots[i].key) == 0)
+			return &slots[i];
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the slot of the key from whichever array holds it, or NULL.
+ */
+static flat_slot_t *ft_lookup(flat_table_t *ft, unsigned int hash, void *key,
+							  int *in_old)
+{
+	flat_slot_t *slot = ft_find(ft->slots, ft->capacity, ft->shift, hash, key);
+
+	*in_old = 0;
+	if (slot || !ft->old_slots)
+		return slot;
+
+	*in_old = 1;
+	return ft_find(ft->old_slots, ft->old_capacity, ft->old_shift, hash, key);
+}
+
+/**
+ * Places the entry in the new array, starting from slot i, where the entry
+ * would be at distance entry.dist from its home.
+ */
+static void ft_insert_from(flat_table_t *ft, unsigned int i, flat_slot_t entry)
+{
+	unsigned int mask = ft->capacity - 1;
+
+	while (ft->slots[i].dist) {
+		/* the entry that is closer to its home gives up its slot */
+		if (ft->slots[i].dist < entry.dist) {
+			flat_slot_t aux = ft->slots[i];
+			ft->slots[i] = entry;
+			entry = aux;
+		}
+
+		i = (i + 1) & mask;
+		entry.dist++;
+	}
+
+	ft->slots[i] = entry;
+}
+
+static void ft_insert_slot(flat_table_t *ft, flat_slot_t entry)
+{
+	entry.dist = 1;
+	ft_insert_from(ft, ft_home(entry.hash, ft->shift), entry);
+}
+
+/**
+ * Backward shift deletion from the new array: the rest of the chain moves
+ * one slot closer to home, so no tombstones are needed.
+ */
+static void ft_erase_slot(flat_table_t *ft, flat_slot_t *slot)
+{
+	unsigned int mask = ft->capacity - 1;
+	unsigned int i = slot - ft->slots;
+	unsigned int next = (i + 1) & mask;
+
+	while (ft->slots[next].dist > 1) {
+		ft->slots[i] = ft->slots[next];
+		ft->slots[i].dist--;
+		i = next;
+		next = (next + 1) & mask;
+	}
+
+	ft->slots[i].dist = 0;
+	ft->slots[i].key = NULL;
+	ft->slots[i].value = NULL;
+}
+
+static void ft_migrate_step(flat_table_t *ft)
+{
+	unsigned int moved = 0;
+
+	while (ft->migrate_idx < ft->old_capacity && moved < FT_MIGRATE_STEP) {
+		flat_slot_t *slot = &ft->old_slots[ft->migrate_idx];
+
+		/* the slot stays as a tombstone, the chains behind it need it */
+		if (slot->dist && slot->key) {
+			ft_insert_slot(ft, *slot);
+			slot->key = NULL;
+			slot->value = NULL;
+			ft->old_size--;
+		}
+
+		ft->migrate_idx++;
+		moved++;
+	}
+
+	if (ft->migrate_idx == ft->old_capacity) {
+		free(ft->old_slots);
+		ft->old_slots = NULL;
+		ft->old_capacity = 0;
+		ft->migrate_idx = 0;
+	}
+}
+
+static void ft_start_resize(flat_table_t *ft, unsigned int new_capacity)
+{
+	ft->old_slots = ft->slots;
+	ft->old_capacity = ft->capacity;
+	ft->old_shift = ft->shift;
+	ft->old_size = ft->size;
+	ft->migrate_idx = 0;
+
+	ft->slots = ft_alloc_slots(new_capacity);
+	ft->capacity = new_capacity;
+	ft->shift = 32 - ft_log2(new_capacity);
+}
+
+static void ft_maintain(flat_table_t *ft)
+{
+	if (ft->paused)
+		return;
+
+	if (ft->old_slots) {
+		ft_migrate_step(ft);
+		return;
+	}
+
+	if (100ULL * ft->size > (unsigned long long)FT_MAX_LOAD * ft->capacity)
+		ft_start_resize(ft, 2 * ft->capacity);
+	else if (ft->capacity > ft->min_capacity &&
+			 ft->size < ft->capacity / FT_MIN_LOAD_DIV)
+		ft_start_resize(ft, ft->capacity / 2);
+}
+
+int ft_has_key(flat_table_t *ft, void *key)
+{
+	return ft_has_key_hashed(ft, key, ft_hash(ft, key));
+}
+
+int ft_has_key_hashed(flat_table_t *ft, void *key, unsigned int hash)
+{
+	int in_old;
+
+	return ft_lookup(ft, hash, key, &in_old) != NULL;
+}
+
+void *ft_get(flat_table_t *ft, void *key)
+{
+	return ft_get_hashed(ft, key, ft_hash(ft, key));
+}
+
+void *ft_get_hashed(flat_table_t *ft, void *key, unsigned int hash)
+{
+	int in_old;
+	flat_slot_t *slot = ft_lookup(ft, hash, key, &in_old);
+
+	return slot ? slot->value : NULL;
+}
+
+int ft_put(flat_table_t *ft, void *key, unsigned int key_size, void *value,
+		   unsigned int value_size)
+{
+	return ft_put_hashed(ft, key, ft_hash(ft, key), key_size, value,
+						 value_size);
+}
+
+/**
+ * Replaces the value of an entry, in its old buffer if the new value fits.
+ */
+static void ft_set_value(flat_table_t *ft, flat_slot_t *slot, void *value,
+						 unsigned int value_size)
+{
+	unsigned int old_size = strlen(slot->value) + 1;
+
+	if (!slab_fits(ft->slab, old_size, value_size)) {
+		slab_free(ft->slab, slot->value, old_size);
+		slot->value = slab_alloc(ft->slab, value_size);
+		DIE(!slot->value, "Error while updating a (key, value) pair.\n");
+	}
+
+	memcpy(slot->value, value, value_size);
+}
+
+/**
+ * Finds the key in one probe of the new array: the walk stops either at the
+ * key, or at the slot where Robin Hood would place it. Only if the key isn't
+ * there, and a resize is in progress, the old array is searched too. With
+ * replace set, an existing value is overwritten. Returns 1 if the key was
+ * inserted, and 0 if it already existed.
+ */
+int ft_upsert_hashed(flat_table_t *ft, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size, int replace, void **stored_key)
+{
+	unsigned int mask = ft->capacity - 1;
+	unsigned int i = ft_home(hash, ft->shift);
+	unsigned int dist = 1;
+	flat_slot_t *slot = NULL;
+
+	while (ft->slots[i].dist >= dist) {
+		if (ft->slots[i].hash == hash && strcmp(key, ft->slots[i].key) == 0) {
+			slot = &ft->slots[i];
+			break;
+		}
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	if (!slot && ft->old_slots)
+		slot = ft_find(ft->old_slots, ft->old_capacity, ft->old_shift, hash,
+					   key);
+
+	if (slot) {
+		if (replace)
+			ft_set_value(ft, slot, value, value_size);
+		if (stored_key)
+			*stored_key = slot->key;
+		return 0;
+	}
+
+	flat_slot_t entry;
+	entry.hash = hash;
+	entry.dist = dist;
+	entry.key = slab_alloc(ft->slab, key_size);
+	DIE(!entry.key, "Error while creating a (key, value) pair.\n");
+	memcpy(entry.key, key, key_size);
+	entry.value = slab_alloc(ft->slab, value_size);
+	DIE(!entry.value, "Error while creating a (key, value) pair.\n");
+	memcpy(entry.value, value, value_size);
+
+	ft_insert_from(ft, i, entry);
+	ft->size++;
+
+	if (stored_key)
+		*stored_key = entry.key;
+
+	ft_maintain(ft);
+
+	return 1;
+}
+
+int ft_put_hashed(flat_table_t *ft, void *key, unsigned int hash,
+				  unsigned int key_size, void *value, unsigned int value_size)
+{
+	return ft_upsert_hashed(ft, key, hash, key_size, value, value_size, 1,
+							NULL);
+}
+
+int ft_insert_hashed(flat_table_t *ft, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size)
+{
+	return ft_upsert_hashed(ft, key, hash, key_size, value, value_size, 0,
+							NULL);
+}
+
+/**
+ * Frees the key and the value of a slot, and takes it out of its array.
+ */
+static void ft_drop(flat_table_t *ft, flat_slot_t *slot, int in_old)
+{
+	ft_free_strings(ft, slot);
+
+	if (in_old) {
+		slot->key = NULL;
+		slot->value = NULL;
+		ft->old_size--;
+	} else {
+		ft_erase_slot(ft, slot);
+	}
+
+	ft->size--;
+}
+
+void ft_prefetch_hashed(flat_table_t *ft, unsigned int hash, int depth)
+{
+	flat_slot_t *slot = &ft->slots[ft_home(hash, ft->shift)];
+
+	if (depth == 0)
+		PREFETCH(slot);
+	else if (slot->key)
+		PREFETCH(slot->key);
+}
+
+void ft_remove_entry(flat_table_t *ft, void *key)
+{
+	ft_remove_entry_hashed(ft, key, ft_hash(ft, key));
+}
+
+void ft_remove_entry_hashed(flat_table_t *ft, void *key, unsigned int hash)
+{
+	int in_old;
+	flat_slot_t *slot = ft_lookup(ft, hash, key, &in_old);
+
+	if (!slot)
+		return;
+
+	ft_drop(ft, slot, in_old);
+	ft_maintain(ft);
+}
+
+void ft_filter(flat_table_t *ft, ht_keep_fn keep, void *arg)
+{
+	ft->paused++;
+
+	for (unsigned int i = ft->migrate_idx; i < ft->old_capacity; i++) {
+		flat_slot_t *slot = &ft->old_slots[i];
+
+		if (slot->dist && slot->key &&
+			!keep(slot->key, slot->value, slot->hash, arg))
+			ft_drop(ft, slot, 1);
+	}
+
+	/**
+	 * Erasing a slot pulls the rest of its chain back by one, so the same
+	 * position has to be checked again. An entry pulled over the end of the
+	 * array may be seen twice, which only asks keep again.
+	 */
+	unsigned int i = 0;
+	while (i < ft->capacity) {
+		flat_slot_t *slot = &ft->slots[i];
+
+		if (slot->dist && !keep(slot->key, slot->value, slot->hash, arg)) {
+			ft_drop(ft, slot, 0);
+			continue;
+		}
+
+		i++;
+	}
+
+	ft->paused--;
+
+	ft_maintain(ft);
+}
+
+/**
+ * The slots are sorted by hash, and a growing flat table that gets its keys
+ * in that order packs them all in its first slots, where every insert walks
+ * to the end of one long chain. So the slots are visited with a stride of
+ * about 0.618 of the array: it is odd, so every slot is visited once, and the
+ * hashes seen so far are always spread over the whole range.
+ */
+static void ft_drain_slots(flat_slot_t *slots, unsigned int capacity,
+						   unsigned int from, unsigned int to,
+						   ft_take_fn take, void *arg)
+{
+	unsigned int mask = capacity - 1;
+	unsigned int step = (unsigned int)(((unsigned long long)capacity *
+										2654435769u) >> 32) | 1;
+	unsigned int i = (unsigned int)((unsigned long long)from * step) & mask;
+
+	for (unsigned int n = from; n < to; n++, i = (i + step) & mask) {
+		flat_slot_t slot = slots[i];
+
+		/* a tombstone stays one, the rest of the array is emptied */
+		if (slot.key)
+			slots[i].dist = 0;
+		slots[i].key = NULL;
+		slots[i].value = NULL;
+
+		if (slot.dist && slot.key)
+			take(slot.key, slot.value, slot.hash, arg);
+	}
+}
+
+/**
+ * The arrays are cleared as they are walked, so the table ends up empty,
+ * at its current capacity.
+ */
+void ft_drain(flat_table_t *ft, ft_take_fn take, void *arg)
+{
+	ft->paused++;
+
+	if (ft->old_slots)
+		ft_drain_slots(ft->old_slots, ft->old_capacity, 0, ft->old_capacity,
+					   take, arg);
+	ft->old_size = 0;
+
+	ft_drain_slots(ft->slots, ft->capacity, 0, ft->capacity, take, arg);
+	ft->size = 0;
+
+	ft->paused--;
+
+	ft_maintain(ft);
+}
+
+/**
+ * The visits of both arrays, the old one first, are cut in parts of the same
+ * length; a part starts in the middle of the walk of ft_drain_slots.
+ */
+void ft_drain_part(flat_table_t *ft, unsigned int part, unsigned int parts,
+				   ft_take_fn take, void *arg)
+{
+	unsigned int old = ft->old_slots ? ft->old_capacity : 0;
+	unsigned long long total = (unsigned long long)old + ft->capacity;
+	unsigned int from = total * part / parts;
+	unsigned int to = total * (part + 1) / parts;
+
+	if (from < old)
+		ft_drain_slots(ft->old_slots, old, from, to < old ? to : old, take,
+					   arg);
+	if (to > old)
+		ft_drain_slots(ft->slots, ft->capacity, from > old ? from - old : 0,
+					   to - old, take, arg);
+}
+
+void ft_drain_done(flat_table_t *ft)
+{
+	ft->old_size = 0;
+	ft->size = 0;
+	ft_maintain(ft);
+}
+
+/**
+ * Like ft_upsert_hashed without replace, but the entry keeps the buffers it
+ * was given.
+ */
+int ft_adopt(flat_table_t *ft, void *key, unsigned int hash, void *value,
+			 slab_t *from)
+{
+	unsigned int mask = ft->capacity - 1;
+	unsigned int i = ft_home(hash, ft->shift);
+	unsigned int dist = 1;
+	int found = 0;
+
+	slab_take(ft->slab, from, key, strlen(key) + 1);
+	slab_take(ft->slab, from, value, strlen(value) + 1);
+
+	while (ft->slots[i].dist >= dist) {
+		if (ft->slots[i].hash == hash && strcmp(key, ft->slots[i].key) == 0) {
+			found = 1;
+			break;
+		}
+
+		i = (i + 1) & mask;
+		dist++;
+	}
+
+	if (!found && ft->old_slots)
+		found = ft_find(ft->old_slots, ft->old_capacity, ft->old_shift, hash,
+						key) != NULL;
+
+	if (found) {
+		slab_free(ft->slab, key, strlen(key) + 1);
+		slab_free(ft->slab, value, strlen(value) + 1);
+		return 0;
+	}
+
+	flat_slot_t entry;
+	entry.hash = hash;
+	entry.dist = dist;
+	entry.key = key;
+	entry.value = value;
+
+	ft_insert_from(ft, i, entry);
+	ft->size++;
+
+	ft_maintain(ft);
+
+	return 1;
+}
+
+void ft_free(flat_table_t *ft)
+{
+	/* with a slab, the strings are released together with it */
+	if (!ft->slab) {
+		for (unsigned int i = ft->migrate_idx; i < ft->old_capacity; i++)
+			ft_free_strings(ft, &ft->old_slots[i]);
+
+		for (unsigned int i = 0; i < ft->capacity; i++)
+			ft_free_strings(ft, &ft->slots[i]);
+	}
+
+	free(ft->old_slots);
+	free(ft->slots);
+	free(ft);
+}
+
+unsigned int ft_get_size(flat_table_t *ft)
+{
+	return ft->size;
+}
+
+unsigned int ft_get_capacity(flat_table_t *ft)
+{
+	return ft->capacity;
+}
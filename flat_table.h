@@ -0,0 +1,99 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef FLAT_TABLE_H_
+#define FLAT_TABLE_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions for the flat hashtable. They follow the ones of the lab
+ * hashtable, but the entries live in one array of slots, with their hashes,
+ * instead of lists of nodes. The capacity given to ft_create is also the
+ * minimum capacity, rounded up to a power of two. ft_put replaces the value
+ * of an existing key, and returns 1 if the key was inserted, 0 if updated.
+*/
+flat_table_t *ft_create(unsigned int capacity,
+						unsigned int (*hash_function)(void*));
+int ft_has_key(flat_table_t *ft, void *key);
+void *ft_get(flat_table_t *ft, void *key);
+int ft_put(flat_table_t *ft, void *key, unsigned int key_size, void *value,
+		   unsigned int value_size);
+void ft_remove_entry(flat_table_t *ft, void *key);
+void ft_filter(flat_table_t *ft, ht_keep_fn keep, void *arg);
+void ft_free(flat_table_t *ft);
+unsigned int ft_get_size(flat_table_t *ft);
+unsigned int ft_get_capacity(flat_table_t *ft);
+
+/**
+ * Makes the flat table allocate its keys and values from a slab. It has to
+ * be called while the table is empty, and ft_free leaves the strings to
+ * slab_destroy.
+*/
+void ft_set_slab(flat_table_t *ft, slab_t *slab);
+
+/**
+ * Makes the flat table hash its keys with a seeded hash function, instead of
+ * the one given to ft_create. It has to be called while the table is empty.
+*/
+void ft_set_hash(flat_table_t *ft, key_hash_fn key_hash, unsigned int seed);
+
+/**
+ * The operations for a key whose hash was already computed with the hash
+ * function of the table.
+*/
+int ft_has_key_hashed(flat_table_t *ft, void *key, unsigned int hash);
+void *ft_get_hashed(flat_table_t *ft, void *key, unsigned int hash);
+int ft_put_hashed(flat_table_t *ft, void *key, unsigned int hash,
+				  unsigned int key_size, void *value, unsigned int value_size);
+
+/**
+ * Like ft_put_hashed, but an existing key keeps its value. Returns 1 if the
+ * key was inserted, and 0 if it already existed.
+*/
+int ft_insert_hashed(flat_table_t *ft, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size);
+
+/**
+ * Both of the above: with replace set, it is ft_put_hashed, otherwise it is
+ * ft_insert_hashed. If stored_key isn't NULL, it is set to the key kept by
+ * the table, which stays at the same address until the key is removed.
+*/
+int ft_upsert_hashed(flat_table_t *ft, void *key, unsigned int hash,
+					 unsigned int key_size, void *value,
+					 unsigned int value_size, int replace, void **stored_key);
+void ft_remove_entry_hashed(flat_table_t *ft, void *key, unsigned int hash);
+
+/**
+ * Starts loading the memory that a lookup of the hash will read: with depth
+ * 0 the home slot of the key, and with depth 1 the key kept in that slot.
+*/
+void ft_prefetch_hashed(flat_table_t *ft, unsigned int hash, int depth);
+
+/**
+ * Empties the flat table in one walk over its slots: every key and value is
+ * handed to take, with the stored hash of the key, and nothing is freed.
+*/
+void ft_drain(flat_table_t *ft, ft_take_fn take, void *arg);
+
+/**
+ * Like ft_drain, for one of parts slices of the walk, so different threads
+ * can empty the slices at once; the entries of the slices, taken in the order
+ * of the parts, come in the order of ft_drain. Nothing else may use the table
+ * until every slice is empty and ft_drain_done is called.
+*/
+void ft_drain_part(flat_table_t *ft, unsigned int part, unsigned int parts,
+				   ft_take_fn take, void *arg);
+void ft_drain_done(flat_table_t *ft);
+
+/**
+ * Stores a key and a value taken out of another flat table by ft_drain,
+ * keeping their buffers, which were allocated from the slab from and are
+ * handed over to the slab of the table (see slab_take). If the key already
+ * exists, it keeps its value and the buffers are freed. Returns 1 if the key
+ * was stored, 0 if it already existed.
+*/
+int ft_adopt(flat_table_t *ft, void *key, unsigned int hash, void *value,
+			 slab_t *from);
+
+#endif  // FLAT_TABLE_H_
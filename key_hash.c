@@ -0,0 +1,88 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdint.h>
+#include <string.h>
+
+#include "key_hash.h"
+#include "data_structs.h"
+#include "utils.h"
+
+#define KH_PRIME_1 0x9e3779b97f4a7c15ULL
+#define KH_PRIME_2 0xc2b2ae3d27d4eb4fULL
+#define KH_PRIME_3 0xff51afd7ed558ccdULL
+
+unsigned int key_hash_djb2(void *key, unsigned int seed)
+{
+	unsigned char *puchar_a = (unsigned char *)key;
+	unsigned int hash = 5381;
+	int c;
+
+	(void)seed;
+	while ((c = *puchar_a++))
+		hash = ((hash << 5u) + hash) + c;
+
+	return hash;
+}
+
+/* the word is copied, because the bytes of a key have no alignment */
+static inline uint64_t kh_read(const unsigned char *bytes)
+{
+	uint64_t word;
+
+	memcpy(&word, bytes, sizeof(word));
+	return word;
+}
+
+static inline uint64_t kh_mix(uint64_t lane, uint64_t word)
+{
+	lane ^= word * KH_PRIME_2;
+	lane = (lane << 31) | (lane >> 33);
+	return lane * KH_PRIME_1;
+}
+
+unsigned int key_hash_fast(void *key, unsigned int seed)
+{
+	const unsigned char *bytes = key;
+
+	/**
+	 * The length comes from strlen, which the C library already scans with
+	 * vector instructions, so the loops below know where to stop and never
+	 * look at the bytes one by one.
+	 */
+	size_t len = strlen(key);
+	uint64_t first = seed ^ KH_PRIME_1 ^ (len * KH_PRIME_3);
+	uint64_t second = ((uint64_t)seed << 32) ^ KH_PRIME_2;
+
+	for (; len >= 16; len -= 16, bytes += 16) {
+		first = kh_mix(first, kh_read(bytes));
+		second = kh_mix(second, kh_read(bytes + 8));
+	}
+
+	if (len >= 8) {
+		first = kh_mix(first, kh_read(bytes));
+		bytes += 8;
+		len -= 8;
+	}
+
+	/* the last bytes are padded with zeros; the length was mixed in above */
+	uint64_t tail = 0;
+	memcpy(&tail, bytes, len);
+	second = kh_mix(second, tail);
+
+	uint64_t hash = first ^ ((second << 29) | (second >> 35));
+
+	hash ^= hash >> 33;
+	hash *= KH_PRIME_3;
+	hash ^= hash >> 29;
+	hash *= KH_PRIME_2;
+	hash ^= hash >> 32;
+
+	return (unsigned int)hash;
+}
+
+key_hash_fn key_hash_get(key_hash_t mode)
+{
+	if (mode == KEY_HASH_FAST)
+		return key_hash_fast;
+
+	return key_hash_djb2;
+}
@@ -0,0 +1,31 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef KEY_HASH_H_
+#define KEY_HASH_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Hash functions for the keys (strings ended by 0). All of them take a seed,
+ * and the same key gets another hash under another seed, so the keys that
+ * collide under one seed are spread by the others.
+*/
+
+/**
+ * @brief djb2, one byte at a time. It is the legacy hash of the homework,
+ * which ignores the seed, so the keys land on the same servers as before.
+ */
+unsigned int key_hash_djb2(void *key, unsigned int seed);
+
+/**
+ * @brief A hash that reads the key 8 bytes at a time, in two independent
+ * lanes, and mixes the words with 64 bit multiplications.
+ */
+unsigned int key_hash_fast(void *key, unsigned int seed);
+
+/**
+ * @brief Gets the hash function of a mode.
+ */
+key_hash_fn key_hash_get(key_hash_t mode);
+
+#endif  // KEY_HASH_H_
@@ -0,0 +1,266 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdlib.h>
+#include <string.h>
+
+#include "key_index.h"
+#include "slab.h"
+#include "data_structs.h"
+#include "utils.h"
+
+static key_index_bucket_t *ki_alloc_buckets(unsigned int bits)
+{
+	key_index_bucket_t *buckets = calloc(1u << bits,
+										 sizeof(key_index_bucket_t));
+	DIE(!buckets, "Failed while resizing a key index.\n");
+
+	return buckets;
+}
+
+static void ki_free_entries(key_index_t *ki, key_index_bucket_t *bucket)
+{
+	if (bucket->capacity)
+		slab_free(ki->slab, bucket->entries,
+				  bucket->capacity * sizeof(key_index_entry_t));
+
+	bucket->entries = NULL;
+	bucket->size = 0;
+	bucket->capacity = 0;
+}
+
+static void ki_set_capacity(key_index_t *ki, key_index_bucket_t *bucket,
+							unsigned int capacity)
+{
+	key_index_entry_t *entries = slab_alloc(ki->slab, capacity *
+											sizeof(key_index_entry_t));
+	DIE(!entries, "Failed while indexing a key.\n");
+
+	unsigned int size = bucket->size;
+	if (size)
+		memcpy(entries, bucket->entries, size * sizeof(key_index_entry_t));
+	ki_free_entries(ki, bucket);
+
+	bucket->entries = entries;
+	bucket->size = size;
+	bucket->capacity = capacity;
+}
+
+static void ki_push(key_index_t *ki, key_index_bucket_t *bucket,
+					key_index_entry_t entry)
+{
+	if (bucket->size == bucket->capacity)
+		ki_set_capacity(ki, bucket, bucket->capacity ? 2 * bucket->capacity :
+									KI_MIN_ENTRIES);
+
+	bucket->entries[bucket->size++] = entry;
+}
+
+/**
+ * A bucket that lost most of its keys gives back half of its entries.
+ */
+static void ki_shrink_bucket(key_index_t *ki, key_index_bucket_t *bucket)
+{
+	if (bucket->size == 0)
+		ki_free_entries(ki, bucket);
+	else if (bucket->capacity > KI_MIN_ENTRIES &&
+			 bucket->size <= bucket->capacity / 4)
+		ki_set_capacity(ki, bucket, bucket->capacity / 2);
+}
+
+/**
+ * While a split is in progress, the old buckets from split_idx on still hold
+ * their keys, the others were moved to the new array.
+ */
+static key_index_bucket_t *ki_bucket(key_index_t *ki, unsigned int hash)
+{
+	if (ki->old_buckets) {
+		unsigned int j = hash >> (33 - ki->bits);
+
+		if (j >= ki->split_idx)
+			return &ki->old_buckets[j];
+	}
+
+	return &ki->buckets[hash >> (32 - ki->bits)];
+}
+
+/**
+ * The old bucket j becomes the new buckets 2j and 2j + 1, which are still
+ * empty: its entries go to 2j as they are, and the ones with the next bit of
+ * the hash set move on to 2j + 1.
+ */
+static void ki_split_step(key_index_t *ki, unsigned int steps)
+{
+	unsigned int old_count = 1u << (ki->bits - 1);
+	unsigned int bit = 1u << (32 - ki->bits);
+
+	while (ki->old_buckets && steps--) {
+		unsigned int j = ki->split_idx;
+		key_index_bucket_t *low = &ki->buckets[2 * j];
+		key_index_bucket_t *high = &ki->buckets[2 * j + 1];
+
+		*low = ki->old_buckets[j];
+
+		for (unsigned int i = 0; i < low->size;) {
+			if (low->entries[i].hash & bit) {
+				ki_push(ki, high, low->entries[i]);
+				low->entries[i] = low->entries[--low->size];
+			} else {
+				i++;
+			}
+		}
+		ki_shrink_bucket(ki, low);
+
+		ki->split_idx++;
+		if (ki->split_idx == old_count) {
+			free(ki->old_buckets);
+			ki->old_buckets = NULL;
+		}
+	}
+}
+
+/**
+ * Halves the number of buckets all at once, because it only happens after
+ * most of the keys left.
+ */
+static void ki_merge(key_index_t *ki)
+{
+	key_index_bucket_t *old = ki->buckets;
+	unsigned int count = 1u << (ki->bits - 1);
+
+	ki->bits--;
+	ki->buckets = ki_alloc_buckets(ki->bits);
+
+	for (unsigned int j = 0; j < count; j++) {
+		key_index_bucket_t *high = &old[2 * j + 1];
+
+		ki->buckets[j] = old[2 * j];
+		for (unsigned int i = 0; i < high->size; i++)
+			ki_push(ki, &ki->buckets[j], high->entries[i]);
+		ki_free_entries(ki, high);
+	}
+
+	free(old);
+}
+
+static void ki_maintain(key_index_t *ki)
+{
+	if (ki->old_buckets) {
+		ki_split_step(ki, KI_SPLIT_STEP);
+		return;
+	}
+
+	unsigned long long count = 1ull << ki->bits;
+
+	if (ki->size > count * KI_MAX_LOAD && ki->bits < 30) {
+		ki->old_buckets = ki->buckets;
+		ki->bits++;
+		ki->buckets = ki_alloc_buckets(ki->bits);
+		ki->split_idx = 0;
+		ki_split_step(ki, KI_SPLIT_STEP);
+	} else if (ki->bits > KI_MIN_BITS &&
+			   ki->size < count * KI_MAX_LOAD / KI_MIN_LOAD_DIV) {
+		ki_merge(ki);
+	}
+}
+
+key_index_t *ki_create(slab_t *slab)
+{
+	key_index_t *ki = malloc(sizeof(key_index_t));
+	DIE(!ki, "Failed ki_create\n");
+
+	ki->slab = slab;
+	ki->bits = KI_MIN_BITS;
+	ki->buckets = ki_alloc_buckets(ki->bits);
+	ki->old_buckets = NULL;
+	ki->split_idx = 0;
+	ki->size = 0;
+
+	return ki;
+}
+
+void ki_insert(key_index_t *ki, unsigned int hash, char *key)
+{
+	key_index_entry_t entry = {hash, key};
+
+	ki_push(ki, ki_bucket(ki, hash), entry);
+	ki->size++;
+
+	ki_maintain(ki);
+}
+
+void ki_remove(key_index_t *ki, unsigned int hash, char *key)
+{
+	key_index_bucket_t *bucket = ki_bucket(ki, hash);
+
+	for (unsigned int i = 0; i < bucket->size; i++) {
+		key_index_entry_t *entry = &bucket->entries[i];
+
+		if (entry->hash != hash || strcmp(entry->key, key))
+			continue;
+
+		*entry = bucket->entries[--bucket->size];
+		ki_shrink_bucket(ki, bucket);
+		ki->size--;
+
+		ki_maintain(ki);
+		return;
+	}
+}
+
+void ki_filter_range(key_index_t *ki, unsigned int first, unsigned int last,
+					 ht_keep_fn keep, void *arg)
+{
+	/**
+	 * A split in progress is finished first, so all the buckets of the range
+	 * are next to each other, in the same array.
+	 */
+	if (ki->old_buckets)
+		ki_split_step(ki, 1u << (ki->bits - 1));
+
+	unsigned int shift = 32 - ki->bits;
+
+	for (unsigned int b = first >> shift; b <= last >> shift; b++) {
+		key_index_bucket_t *bucket = &ki->buckets[b];
+
+		for (unsigned int i = 0; i < bucket->size;) {
+			key_index_entry_t entry = bucket->entries[i];
+
+			if (entry.hash < first || entry.hash > last ||
+				keep(entry.key, NULL, entry.hash, arg)) {
+				i++;
+				continue;
+			}
+
+			bucket->entries[i] = bucket->entries[--bucket->size];
+			ki->size--;
+		}
+
+		ki_shrink_bucket(ki, bucket);
+	}
+
+	ki_maintain(ki);
+}
+
+unsigned int ki_get_size(key_index_t *ki)
+{
+	return ki->size;
+}
+
+void ki_free(key_index_t *ki)
+{
+	/**
+	 * The entries cut from a slab are released together with it, by the
+	 * owner of the slab.
+	 */
+	if (!ki->slab) {
+		for (unsigned int j = 0; j < (1u << ki->bits); j++)
+			free(ki->buckets[j].entries);
+
+		for (unsigned int j = ki->split_idx;
+			 ki->old_buckets && j < (1u << (ki->bits - 1)); j++)
+			free(ki->old_buckets[j].entries);
+	}
+
+	free(ki->buckets);
+	free(ki->old_buckets);
+	free(ki);
+}
@@ -0,0 +1,30 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef KEY_INDEX_H_
+#define KEY_INDEX_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions for the key index of a server: its keys, ordered by the first
+ * bits of their hashes. The index doesn't copy the keys, it only points to
+ * the ones kept by the storage of the server, so a key has to be removed
+ * from the index before it is freed. Many keys can share a hash. A NULL slab
+ * means plain malloc and free.
+*/
+key_index_t *ki_create(slab_t *slab);
+void ki_insert(key_index_t *ki, unsigned int hash, char *key);
+void ki_remove(key_index_t *ki, unsigned int hash, char *key);
+unsigned int ki_get_size(key_index_t *ki);
+void ki_free(key_index_t *ki);
+
+/**
+ * Calls keep for every key whose hash is between first and last (both
+ * included), and removes from the index the keys for which it returns 0.
+ * The index doesn't know the values, so keep gets NULL instead. Only the
+ * buckets of the range are visited, and keep must not change the index.
+*/
+void ki_filter_range(key_index_t *ki, unsigned int first, unsigned int last,
+					 ht_keep_fn keep, void *arg);
+
+#endif  // KEY_INDEX_H_
@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "load_balancer.h"
+#include "key_hash.h"
 #include "utils.h"
 
 unsigned int hash_function_servers(void *a) {
@@ -15,17 +16,343 @@ unsigned int hash_function_servers(void *a) {
 }
 
 unsigned int hash_function_key(void *a) {
-	unsigned char *puchar_a = (unsigned char *)a;
-	unsigned int hash = 5381;
-	int c;
+	return key_hash_djb2(a, 0);
+}
+
+/**
+ * Every thread that uses a concurrent Load Balancer gets a number, the same
+ * for all of them, which is its place in the readers arrays. The number is
+ * taken without locks the first time, and given back when the thread exits.
+ */
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+static int reader_taken[LB_MAX_READERS];
+
+static void release_reader(void *slot)
+{
+	__atomic_store_n(&reader_taken[(unsigned long)slot - 1], 0,
+					 __ATOMIC_RELEASE);
+}
+
+static void create_reader_key(void)
+{
+	DIE(pthread_key_create(&reader_key, release_reader),
+		"Failed while creating the readers.\n");
+}
+
+static unsigned int reader_slot(void)
+{
+	pthread_once(&reader_once, create_reader_key);
+
+	unsigned long slot = (unsigned long)pthread_getspecific(reader_key);
+	if (slot)
+		return slot - 1;
+
+	for (slot = 0; slot < LB_MAX_READERS; slot++) {
+		int free_slot = 0;
+
+		if (__atomic_compare_exchange_n(&reader_taken[slot], &free_slot, 1, 0,
+										__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			break;
+	}
+	DIE(slot == LB_MAX_READERS, "Too many threads use the load balancer.\n");
+
+	pthread_setspecific(reader_key, (void *)(slot + 1));
+	return slot;
+}
+
+/**
+ * A request of a concurrent Load Balancer writes the epoch it sees before
+ * it reads the snapshot. A snapshot replaced at epoch e is freed once every
+ * request in progress saw an epoch of at least e: those requests started
+ * after the new snapshot was published, so they never read the old one.
+ */
+static lb_snapshot_t *enter_epoch(load_balancer_t *main, lb_reader_t *reader)
+{
+	__atomic_store_n(&reader->epoch,
+					 __atomic_load_n(&main->epoch, __ATOMIC_SEQ_CST),
+					 __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&main->snapshot, __ATOMIC_SEQ_CST);
+}
 
-	while ((c = *puchar_a++))
-		hash = ((hash << 5u) + hash) + c;
+/* the epoch of the calling thread, or NULL if the Load Balancer has none */
+static lb_reader_t *get_reader(load_balancer_t *main)
+{
+	return main->concurrent ? &main->readers[reader_slot()] : NULL;
+}
 
-	return hash;
+static void leave_epoch(lb_reader_t *reader)
+{
+	if (reader)
+		__atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+static void *copy_array(const void *array, unsigned int count, size_t size)
+{
+	if (!array || !count)
+		return NULL;
+
+	void *copy = malloc(count * size);
+	DIE(!copy, "Failed while taking a snapshot of the load balancer.\n");
+
+	return memcpy(copy, array, count * size);
+}
+
+/**
+ * Copies the fields used by get_server, get_index and route_many, so the
+ * requests can route with the copy while the Load Balancer changes.
+ */
+static lb_snapshot_t *take_snapshot(load_balancer_t *main)
+{
+	lb_snapshot_t *snapshot = calloc(1, sizeof(lb_snapshot_t));
+	DIE(!snapshot, "Failed while taking a snapshot of the load balancer.\n");
+	load_balancer_t *view = &snapshot->view;
+
+	view->router = main->router;
+	view->ring_layout = main->ring_layout;
+	view->key_hash = main->key_hash;
+	view->hash_seed = main->hash_seed;
+	view->replicas = main->replicas;
+
+	view->num_servers = main->num_servers;
+	view->max_servers = main->num_servers;
+	view->servers = copy_array(main->servers, main->num_servers,
+							   sizeof(server_t));
+	view->indices = id_map_create(main->num_servers);
+	for (unsigned int i = 0; i < main->num_servers; i++)
+		id_map_set(view->indices, main->servers[i].server_id, i);
+
+	view->hashring_size = main->hashring_size;
+	view->hashring = copy_array(main->hashring, main->hashring_size,
+								sizeof(ring_t));
+	view->ring_hashes = copy_array(main->ring_hashes, main->hashring_size + 1,
+								   sizeof(unsigned int));
+	view->ring_ids = copy_array(main->ring_ids, main->hashring_size + 1,
+								sizeof(unsigned int));
+
+	view->lookup_size = main->lookup_size;
+	view->lookup = copy_array(main->lookup, main->lookup_size,
+							  sizeof(unsigned int));
+
+	unsigned int padded = (main->hrw_size + HRW_BLOCK - 1) / HRW_BLOCK *
+						  HRW_BLOCK;
+	view->hrw_size = main->hrw_size;
+	view->hrw_seeds = copy_array(main->hrw_seeds, padded ? padded : HRW_BLOCK,
+								 sizeof(unsigned int));
+	view->hrw_ids = copy_array(main->hrw_ids, padded ? padded : HRW_BLOCK,
+							   sizeof(unsigned int));
+
+	return snapshot;
+}
+
+static void free_snapshot(lb_snapshot_t *snapshot)
+{
+	load_balancer_t *view = &snapshot->view;
+
+	free(view->servers);
+	id_map_free(view->indices);
+	free(view->hashring);
+	free(view->ring_hashes);
+	free(view->ring_ids);
+	free(view->lookup);
+	free(view->hrw_seeds);
+	free(view->hrw_ids);
+
+	for (unsigned int i = 0; i < snapshot->num_removed; i++)
+		free_server_memory(snapshot->removed[i]);
+	free(snapshot->removed);
+
+	free(snapshot);
+}
+
+/**
+ * Frees the retired snapshots that no request can still read. They are
+ * kept from the newest to the oldest, so once one can go, all the older ones
+ * can go too.
+ */
+static void reclaim_snapshots(load_balancer_t *main)
+{
+	unsigned long long oldest = -1ULL;
+
+	for (unsigned int i = 0; i < LB_MAX_READERS; i++) {
+		unsigned long long epoch = __atomic_load_n(&main->readers[i].epoch,
+												   __ATOMIC_SEQ_CST);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	lb_snapshot_t **link = &main->retired;
+
+	while (*link && (*link)->retired > oldest)
+		link = &(*link)->next;
+
+	while (*link) {
+		lb_snapshot_t *snapshot = *link;
+
+		*link = snapshot->next;
+		free_snapshot(snapshot);
+	}
+}
+
+/**
+ * Replaces the snapshot after a change of the servers. The removed servers
+ * can still be reached through the old snapshot, so they are freed with it.
+ */
+static void publish_snapshot(load_balancer_t *main, server_memory_t **removed,
+							 unsigned int num_removed)
+{
+	lb_snapshot_t *old = main->snapshot;
+
+	__atomic_store_n(&main->snapshot, take_snapshot(main), __ATOMIC_SEQ_CST);
+
+	old->removed = removed;
+	old->num_removed = num_removed;
+	old->retired = __atomic_add_fetch(&main->epoch, 1, __ATOMIC_SEQ_CST);
+	old->next = main->retired;
+	main->retired = old;
+}
+
+/**
+ * A change of the servers locks every server it moves objects from or to,
+ * the first time it touches it, and keeps it locked until the new snapshot
+ * is published. The requests that were routed to those servers by the old
+ * snapshot wait, and route again.
+ */
+static void hold_server(load_balancer_t *main, server_memory_t *memory)
+{
+	if (!main->concurrent || memory->held)
+		return;
+
+	if (main->num_held == main->held_capacity) {
+		main->held_capacity = main->held_capacity ? 2 * main->held_capacity :
+													16;
+		main->held = realloc(main->held, main->held_capacity *
+							 sizeof(server_memory_t *));
+		DIE(!main->held, "Failed while locking the servers.\n");
+	}
+
+	server_lock(memory, 1);
+	memory->held = 1;
+	main->held[main->num_held++] = memory;
+}
+
+static void release_servers(load_balancer_t *main)
+{
+	for (unsigned int i = 0; i < main->num_held; i++) {
+		main->held[i]->held = 0;
+		server_unlock(main->held[i]);
+	}
+
+	main->num_held = 0;
+}
+
+static void unlock_memory(load_balancer_t *main, server_memory_t *memory)
+{
+	if (main->concurrent)
+		server_unlock(memory);
+}
+
+/* the hash of a key, with the hash function of the Load Balancer */
+static inline unsigned int hash_key(load_balancer_t *main, char *key)
+{
+	return main->key_hash(key, main->hash_seed);
+}
+
+/**
+ * Finds the server of a key, and locks it in a concurrent Load Balancer.
+ * The key is routed with the snapshot, which may be replaced before the
+ * server is locked; then the key may have moved, so it is routed again.
+ * Returns NULL if there is no server.
+ */
+static server_memory_t *route_locked(load_balancer_t *main,
+									 lb_reader_t *reader, unsigned int hash,
+									 int writing, unsigned int *server_id)
+{
+	if (!main->concurrent) {
+		if (main->num_servers == 0)
+			return NULL;
+
+		*server_id = get_server(main, hash);
+		return main->servers[get_index(main, *server_id)].memory;
+	}
+
+	while (1) {
+		lb_snapshot_t *snapshot = enter_epoch(main, reader);
+		load_balancer_t *view = &snapshot->view;
+		if (view->num_servers == 0)
+			return NULL;
+
+		*server_id = get_server(view, hash);
+		server_memory_t *memory = view->servers[get_index(view,
+														  *server_id)].memory;
+
+		server_lock(memory, writing);
+		if (__atomic_load_n(&main->snapshot, __ATOMIC_SEQ_CST) == snapshot)
+			return memory;
+		server_unlock(memory);
+	}
+}
+
+/**
+ * Hashes the pair (server_id, replica) as one 64 bit label, so that two
+ * different pairs never share a label, whatever the ids are.
+ */
+static unsigned int hash_function_replica(unsigned int server_id,
+										  unsigned int replica)
+{
+	unsigned long long label = ((unsigned long long)replica << 32) | server_id;
+
+	label = (label ^ (label >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	label = (label ^ (label >> 27)) * 0x94d049bb133111ebULL;
+	label = label ^ (label >> 31);
+
+	return (unsigned int)(label ^ (label >> 32));
+}
+
+static int compare_rings(const void *a, const void *b)
+{
+	unsigned int hash_a = ((const ring_t *)a)->hash;
+	unsigned int hash_b = ((const ring_t *)b)->hash;
+
+	return (hash_a > hash_b) - (hash_a < hash_b);
+}
+
+void lb_config_defaults(lb_config_t *config)
+{
+	config->engine = SERVER_ENGINE_CHAINED;
+	config->replicas = LB_DEFAULT_REPLICAS;
+	config->key_index = 1;
+	config->router = LB_ROUTER_RING;
+	config->lookup_size = MAGLEV_TABLE_SIZE;
+	config->ring_layout = RING_LAYOUT_SORTED;
+	config->key_hash = KEY_HASH_DJB2;
+	config->hash_seed = 0;
+	config->concurrent = 0;
+	config->drain_threads = 1;
+}
+
+static int is_prime(unsigned int n)
+{
+	if (n < 2)
+		return 0;
+
+	for (unsigned int d = 2; d <= n / d; d++)
+		if (n % d == 0)
+			return 0;
+
+	return 1;
 }
 
 load_balancer_t *init_load_balancer() {
+	lb_config_t config;
+
+	lb_config_defaults(&config);
+	return init_load_balancer_with(&config);
+}
+
+load_balancer_t *init_load_balancer_with(const lb_config_t *config)
+{
 	load_balancer_t *load_balancer = malloc(sizeof(load_balancer_t));
 	DIE(!load_balancer, "Failed while creating the load_balancer.\n");
 
@@ -43,134 +370,380 @@ load_balancer_t *init_load_balancer() {
 	load_balancer->num_servers = 0;
 
 	/**
-	 * For the hashring, I need triple space, because, for one server added,
-	 * there are 3 places occupied in the hashring.
+	 * Every server with weight 1 occupies "replicas" places in the hashring,
+	 * so I start with room for SERVER_INC such servers. The heavier servers
+	 * make the hashring grow on its own (see insert_ring).
 	 */
-	load_balancer->hashring = malloc(3 * SERVER_INC * sizeof(ring_t));
+	DIE(config->replicas == 0, "A server needs at least one ring.\n");
+	load_balancer->replicas = config->replicas;
+	load_balancer->hashring_capacity = config->replicas * SERVER_INC;
+	load_balancer->hashring = malloc(load_balancer->hashring_capacity *
+									 sizeof(ring_t));
 	DIE(!load_balancer->hashring, "Failed while creating the load_balancer.\n");
 
 	load_balancer->hashring_size = 0;
+	load_balancer->ring_layout = config->ring_layout;
+	load_balancer->ring_hashes = NULL;
+	load_balancer->ring_ids = NULL;
+
+	load_balancer->indices = id_map_create(SERVER_INC);
+	load_balancer->engine = config->engine;
+	load_balancer->router = config->router;
+	load_balancer->moved = 0;
+	load_balancer->key_hash = key_hash_get(config->key_hash);
+	load_balancer->hash_seed = config->hash_seed;
+	load_balancer->drain_threads = config->drain_threads ?
+								   config->drain_threads : 1;
+	load_balancer->concurrent = config->concurrent;
+	load_balancer->snapshot = NULL;
+	load_balancer->retired = NULL;
+	load_balancer->epoch = 1;
+	load_balancer->readers = NULL;
+	load_balancer->held = NULL;
+	load_balancer->num_held = 0;
+	load_balancer->held_capacity = 0;
+	DIE(pthread_mutex_init(&load_balancer->topology, NULL),
+		"Failed while creating the load_balancer.\n");
+
+	/**
+	 * The other routers replace the hashring, so the keys can't be moved by
+	 * arcs of the hashring, and the key index would be of no use.
+	 */
+	load_balancer->lookup = NULL;
+	load_balancer->lookup_size = 0;
+	load_balancer->hrw_seeds = NULL;
+	load_balancer->hrw_ids = NULL;
+	load_balancer->hrw_size = 0;
+	load_balancer->key_index = config->router == LB_ROUTER_RING ?
+							   config->key_index : 0;
+
+	if (config->router == LB_ROUTER_MAGLEV) {
+		DIE(!is_prime(config->lookup_size),
+			"The size of the lookup table has to be a prime.\n");
+
+		load_balancer->lookup_size = config->lookup_size;
+		load_balancer->lookup = malloc(config->lookup_size *
+									   sizeof(unsigned int));
+		DIE(!load_balancer->lookup, "Failed while creating the load_balancer.\n");
+	}
+
+	/**
+	 * The requests of a concurrent Load Balancer start from a snapshot of
+	 * it without servers.
+	 */
+	if (load_balancer->concurrent) {
+		DIE(posix_memalign((void **)&load_balancer->readers, LB_CACHE_LINE,
+						   LB_MAX_READERS * sizeof(lb_reader_t)),
+			"Failed while creating the load_balancer.\n");
+		memset(load_balancer->readers, 0,
+			   LB_MAX_READERS * sizeof(lb_reader_t));
+		load_balancer->snapshot = take_snapshot(load_balancer);
+	}
 
 	return load_balancer;
 }
 
 void loader_add_server(load_balancer_t *main, int server_id)
 {
+	loader_add_server_weighted(main, server_id, 1);
+}
+
+void loader_add_server_weighted(load_balancer_t *main, int server_id,
+								unsigned int weight)
+{
+	loader_change_servers(main, &server_id, &weight, 1, NULL, 0);
+}
+
+void loader_remove_server(load_balancer_t *main, int server_id) {
+	loader_change_servers(main, NULL, NULL, 0, &server_id, 1);
+}
+
+/**
+ * Creates a new server on the last position of the array. Because of the way
+ * the hashring works I don't bother sorting the servers, I don't need them
+ * to be sorted. Its rings are added at the end of the hashring.
+ */
+static void create_server(load_balancer_t *main, unsigned int server_id,
+						  unsigned int weight)
+{
+	if (weight == 0)
+		weight = 1;
+
+	DIE(weight > -1U / main->replicas, "The weight of the server is too big.\n");
+	unsigned int replicas = weight * main->replicas;
+
 	/**
-	 * Increase the memory for the arrays, if it is needed
+	 * Increase the memory for the array of servers, if it is needed. The
+	 * hashring grows by itself.
 	 */
 	if (main->max_servers == main->num_servers) {
 		main->max_servers += SERVER_INC;
 
 		main->servers = realloc(main->servers, main->max_servers *
 								sizeof(server_t));
-
-		main->hashring = realloc(main->hashring, 3 * main->max_servers *
-								sizeof(ring_t));
+		DIE(!main->servers, "Failed while adding a server.\n");
 	}
 
-	/**
-	 * Create and add a new server on the last position. Because of the way
-	 * the hashring works I don't bother sorting the servers, I don't need
-	 * them to be sorted.
-	 */
 	unsigned int idx = main->num_servers;
-	main->servers[idx].memory = init_server_memory();
+	main->servers[idx].memory = init_server_memory_engine(main->engine);
+	server_set_hash(main->servers[idx].memory, main->key_hash,
+					main->hash_seed);
+	server_set_index(main->servers[idx].memory, main->key_index);
 	main->servers[idx].server_id = server_id;
+	main->servers[idx].replicas = replicas;
 	main->num_servers++;
+	id_map_set(main->indices, server_id, idx);
 
-	/**
-	 * Add corresponding hashes to the hashring.
-	 */
-	add_hash(main, server_id);
+	if (main->router == LB_ROUTER_RING)
+		add_hash(main, server_id, replicas);
+}
 
-	/**
-	 * Get all the corresponding hashes from the hashring.
-	 */
-	unsigned int org_hash, dup1, dup2;
-	get_duplicates(server_id, &org_hash, &dup1, &dup2);
+/**
+ * Gives back the memory of the arrays after servers are removed. The array
+ * of servers keeps at most 2 * SERVER_INC free places, and the hashring is
+ * halved while it is less than a quarter full, so adding a server right
+ * after removing one doesn't reallocate anything.
+ */
+static void shrink_arrays(load_balancer_t *main)
+{
+	if (main->max_servers - main->num_servers > 2 * SERVER_INC) {
+		main->max_servers = main->num_servers + SERVER_INC;
+		main->servers = realloc(main->servers, main->max_servers *
+								sizeof(server_t));
+		DIE(!main->servers, "Failed while removing the servers.\n");
+	}
 
-	/**
-	 * Remap the objects from the neighbours of the 3 replicas. 
-	 */
-	remap_objects(main, org_hash);
-	remap_objects(main, dup1);
-	remap_objects(main, dup2);
+	unsigned int capacity = main->hashring_capacity;
+	while (capacity / 2 >= main->replicas * SERVER_INC &&
+		   main->hashring_size < capacity / 4)
+		capacity /= 2;
+
+	if (capacity != main->hashring_capacity) {
+		main->hashring_capacity = capacity;
+		main->hashring = realloc(main->hashring, capacity * sizeof(ring_t));
+		DIE(!main->hashring, "Failed while removing the servers.\n");
+	}
 }
 
-void loader_remove_server(load_balancer_t *main, int server_id) {
+/* like route_to_owner, from many threads at once: nothing is locked here */
+static int pick_owner(char *key, unsigned int key_hash, void *arg)
+{
+	load_balancer_t *main = arg;
+
+	(void)key;
+	return get_index(main, get_server(main, key_hash));
+}
+
+static void claim_owner(server_memory_t *memory, void *arg)
+{
+	hold_server(arg, memory);
+}
+
+/**
+ * The objects of a removed server are moved by drain_threads threads, which
+ * leave every server as a single thread would. The destinations are locked
+ * before any thread writes to them.
+ */
+static unsigned int drain_removed(load_balancer_t *main,
+								  server_memory_t *memory)
+{
+	if (main->drain_threads <= 1)
+		return server_drain(memory, route_to_owner, main);
+
+	server_memory_t **dests = malloc(main->num_servers *
+									 sizeof(server_memory_t *));
+	DIE(!dests, "Failed while removing the servers.\n");
+
+	for (unsigned int i = 0; i < main->num_servers; i++)
+		dests[i] = main->servers[i].memory;
+
+	unsigned int moved = server_drain_parallel(memory, dests,
+											   main->num_servers, pick_owner,
+											   claim_owner, main,
+											   main->drain_threads);
+	free(dests);
+
+	return moved;
+}
+
+void loader_change_servers(load_balancer_t *main, const int *add_ids,
+						   const unsigned int *weights, unsigned int num_add,
+						   const int *remove_ids, unsigned int num_remove)
+{
 	/**
-	 * Remove the hashes corresponding to the server id within
-	 * the hashring.
+	 * Every server of the batch is marked in a map, so I can tell the
+	 * rings of the removed and of the added servers apart later.
 	 */
-	remove_id(main, server_id);
+	id_map_t *batch = id_map_create(num_add + num_remove);
+
+	if (main->concurrent)
+		pthread_mutex_lock(&main->topology);
+	main->moved = 0;
 
 	/**
-	 * I have to remap all the objects from the server, and delete the
-	 * server from the array, so I need to know it's index.
+	 * The servers that leave are taken out of the array, but their memory
+	 * is kept until the new hashring is ready and their objects can be
+	 * sent straight to their final place. Removing an unknown server does
+	 * nothing.
 	 */
-	unsigned int idx = get_index(main, server_id);
+	server_memory_t **removed = malloc((num_remove + 1) *
+									   sizeof(server_memory_t *));
+	DIE(!removed, "Failed while removing the servers.\n");
+	unsigned int num_removed = 0;
+
+	for (unsigned int i = 0; i < num_remove; i++) {
+		int idx = get_index(main, remove_ids[i]);
+		if (idx == -1)
+			continue;
+
+		id_map_set(batch, remove_ids[i], BATCH_REMOVED);
+		removed[num_removed++] = detach_server(main, idx);
+	}
+
+	if (num_removed && main->router == LB_ROUTER_RING)
+		remove_rings(main, batch);
 
 	/**
-	 * I have to go through the all buckets of hashtable 
+	 * The ids are unique, adding the same server twice does nothing. All
+	 * the new rings go at the end of the hashring, and are merged with the
+	 * rest only once.
 	 */
-	for (unsigned int i = 0; i < HMAX; i++) {
-		list_t *list = main->servers[idx].memory->storage->buckets[i];
+	unsigned int old_size = main->hashring_size;
+	unsigned int num_added = 0;
 
-		if (list->size == 0)
+	for (unsigned int i = 0; i < num_add; i++) {
+		if (get_index(main, add_ids[i]) != -1)
 			continue;
 
-		for (unsigned int j = 0; j < list->size; j++) {
-			node_t *curr = get_nth_node(list, j);
-			char *key = (char *)((pair_t *)curr->data)->key;
-			char *value = (char *)((pair_t *)curr->data)->value;
-
-			unsigned int key_hash = hash_function_key(key);
+		id_map_set(batch, add_ids[i], BATCH_ADDED);
+		create_server(main, add_ids[i], weights ? weights[i] : 1);
+		num_added++;
+	}
 
-			/**
-			 * I already deleted the hashes from the hashring, so the
-			 * get_server function will ignore the server we want to delete,
-			 * and will find the next suitable place for the objects.
-			 */
-			unsigned int serv_id = get_server(main, key_hash);
-			unsigned int idx_to_store = get_index(main, serv_id);
+	if (main->router != LB_ROUTER_RING) {
+		if (num_added || num_removed)
+			remap_all(main, batch, num_added);
+	} else {
+		if (num_added) {
+			unsigned int added = main->hashring_size - old_size;
 
-			server_store(main->servers[idx_to_store].memory, key, value);
+			qsort(main->hashring + old_size, added, sizeof(ring_t),
+				  compare_rings);
+			order_rings(main, added);
 		}
+
+		/* the objects are moved by get_server, which needs the new layout */
+		if (num_added || num_removed)
+			build_ring_layout(main);
+
+		if (num_added)
+			remap_objects(main, batch);
 	}
 
 	/**
-	 * After I transfered the objects from the server to others, I can
-	 * properly remove the server.
+	 * The hashring is final, so every object of a removed server moves only
+	 * once, and its nodes are relinked in the new owners without copying a
+	 * byte. If it was the last server, there is no place left for its
+	 * objects.
 	 */
-	delete_server(main, idx);
+	for (unsigned int i = 0; i < num_removed; i++) {
+		hold_server(main, removed[i]);
+		if (main->num_servers > 0)
+			main->moved += drain_removed(main, removed[i]);
+
+		if (!main->concurrent)
+			free_server_memory(removed[i]);
+	}
+
+	if (num_removed)
+		shrink_arrays(main);
+
+	/**
+	 * The new snapshot is published while the servers that changed are
+	 * still locked, so the requests waiting for them find it.
+	 */
+	if (main->concurrent) {
+		if (num_added || num_removed) {
+			publish_snapshot(main, removed, num_removed);
+			removed = NULL;
+		}
+		release_servers(main);
+		reclaim_snapshots(main);
+		pthread_mutex_unlock(&main->topology);
+	}
+
+	free(removed);
+	id_map_free(batch);
 }
 
-void loader_store(load_balancer_t *main, char *key, char *value,
-				  int *server_id)
+server_memory_t *route_to_owner(char *key, unsigned int key_hash, void *arg)
+{
+	load_balancer_t *main = arg;
+	unsigned int serv_id = get_server(main, key_hash);
+
+	server_memory_t *memory = main->servers[get_index(main, serv_id)].memory;
+
+	(void)key;
+	hold_server(main, memory);
+
+	return memory;
+}
+
+int loader_store(load_balancer_t *main, char *key, char *value,
+				 int *server_id)
+{
+	return loader_store_hashed(main, key, hash_key(main, key), value,
+							   server_id);
+}
+
+int loader_store_hashed(load_balancer_t *main, char *key, unsigned int hash,
+						char *value, int *server_id)
 {
 	/**
-	 * Get the hash of the key, find the server where to put the
-	 * object, and then get the index of the server from the servers
-	 * array.
+	 * Find the server where to put the object, and then get the index of
+	 * the server from the servers array.
 	 */
-	unsigned int hash = hash_function_key(key);
-	unsigned int serv_id = get_server(main, hash);
-	unsigned int idx = get_index(main, serv_id);
+	lb_reader_t *reader = get_reader(main);
+	unsigned int serv_id;
+	server_memory_t *memory = route_locked(main, reader, hash, 1, &serv_id);
+
+	if (!memory) {
+		leave_epoch(reader);
+		*server_id = -1;
+		return STORE_NO_SERVER;
+	}
 
-	server_store(main->servers[idx].memory, key, value);
+	int inserted = server_store_hashed(memory, key, hash, value);
+	unlock_memory(main, memory);
+	leave_epoch(reader);
 
 	*server_id = serv_id;
+
+	return inserted ? STORE_INSERTED : STORE_UPDATED;
 }
 
-char *loader_retrieve(load_balancer_t *main, char *key, int *server_id)
+/**
+ * Finds the value of a key. With a buffer, the value is also copied there
+ * (cut to size bytes, with the terminator) before the server is unlocked,
+ * and length gets its length.
+ */
+static char *retrieve_value(load_balancer_t *main, char *key,
+							unsigned int hash, int *server_id, char *buffer,
+							unsigned int size, int *length)
 {
+	lb_reader_t *reader = get_reader(main);
+	unsigned int serv_id;
+
 	/**
 	 * Find the server where the key is stored
 	 */
-	unsigned int hash = hash_function_key(key);
-	unsigned int serv_id = get_server(main, hash);
-	unsigned int idx = get_index(main, serv_id);
+	server_memory_t *memory = route_locked(main, reader, hash, 0, &serv_id);
+
+	if (!memory) {
+		leave_epoch(reader);
+		*server_id = -1;
+		return NULL;
+	}
 
 	*server_id = serv_id;
 
@@ -178,11 +751,268 @@ char *loader_retrieve(load_balancer_t *main, char *key, int *server_id)
 	 * Retrive the value from the server, if it exists. If it doesn't, it
 	 * will return NULL.
 	 */
-	char *value = server_retrieve(main->servers[idx].memory, key);
+	char *value = server_retrieve_hashed(memory, key, hash);
+
+	if (value && buffer) {
+		*length = strlen(value);
+		if (size) {
+			unsigned int copied = MIN((unsigned int)*length, size - 1);
+
+			memcpy(buffer, value, copied);
+			buffer[copied] = 0;
+		}
+	}
+	unlock_memory(main, memory);
+	leave_epoch(reader);
 
 	return value;
 }
 
+char *loader_retrieve(load_balancer_t *main, char *key, int *server_id)
+{
+	return retrieve_value(main, key, hash_key(main, key), server_id, NULL, 0,
+						  NULL);
+}
+
+char *loader_retrieve_hashed(load_balancer_t *main, char *key,
+							 unsigned int hash, int *server_id)
+{
+	return retrieve_value(main, key, hash, server_id, NULL, 0, NULL);
+}
+
+int loader_retrieve_copy(load_balancer_t *main, char *key, char *buffer,
+						 unsigned int size, int *server_id)
+{
+	int length = -1;
+
+	retrieve_value(main, key, hash_key(main, key), server_id, buffer, size,
+				   &length);
+
+	return length;
+}
+
+/* the keys are sorted by hash, and the equal ones keep their order */
+static int compare_routed(const void *a, const void *b)
+{
+	const routed_key_t *key_a = a, *key_b = b;
+
+	if (key_a->hash != key_b->hash)
+		return (key_a->hash > key_b->hash) - (key_a->hash < key_b->hash);
+
+	return (key_a->index > key_b->index) - (key_a->index < key_b->index);
+}
+
+/**
+ * Finds the first ring from pos on whose hash is not smaller than the given
+ * one, for hashes that only grow: the step doubles until it goes past the
+ * hash, and the last step is binary searched, so close hashes cost little.
+ */
+static unsigned int ring_gallop(load_balancer_t *main, unsigned int pos,
+								unsigned int hash)
+{
+	unsigned int size = main->hashring_size, step = 1;
+
+	if (pos == size || main->hashring[pos].hash >= hash)
+		return pos;
+
+	while (pos + step < size && main->hashring[pos + step].hash < hash) {
+		pos += step;
+		step *= 2;
+	}
+
+	unsigned int left = pos + 1;
+	unsigned int right = pos + step < size ? pos + step : size;
+
+	while (left < right) {
+		unsigned int mid = left + (right - left) / 2;
+
+		if (main->hashring[mid].hash < hash)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return left;
+}
+
+/**
+ * Hashes the keys and, with the hashring, sorts them by hash, so the
+ * hashring is walked only once, forwards, by route_sorted.
+ */
+static void hash_many(load_balancer_t *main, char **keys, unsigned int count,
+					  routed_key_t *routed)
+{
+	for (unsigned int i = 0; i < count; i++) {
+		routed[i].hash = hash_key(main, keys[i]);
+		routed[i].index = i;
+	}
+
+	if (main->router == LB_ROUTER_RING)
+		qsort(routed, count, sizeof(routed_key_t), compare_routed);
+}
+
+/**
+ * Finds the servers of the keys hashed by hash_many. The keys that follow
+ * each other often go to the same server, whose memory is looked up only
+ * once. Returns 0 if there is no server.
+ */
+static int route_sorted(load_balancer_t *main, routed_key_t *routed,
+						unsigned int count)
+{
+	if (main->num_servers == 0)
+		return 0;
+
+	if (main->router == LB_ROUTER_RING) {
+		unsigned int pos = 0;
+
+		for (unsigned int i = 0; i < count; i++) {
+			pos = ring_gallop(main, pos, routed[i].hash);
+			routed[i].server_id = main->hashring[pos == main->hashring_size ?
+												 0 : pos].server_id;
+		}
+	} else {
+		for (unsigned int i = 0; i < count; i++)
+			routed[i].server_id = get_server(main, routed[i].hash);
+	}
+
+	server_memory_t *memory = NULL;
+	unsigned int last_id = 0;
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (!memory || routed[i].server_id != last_id) {
+			last_id = routed[i].server_id;
+			memory = main->servers[get_index(main, last_id)].memory;
+		}
+
+		routed[i].memory = memory;
+	}
+
+	return 1;
+}
+
+/**
+ * The tables of the keys that come next are loaded while a key is looked up:
+ * their buckets LB_PREFETCH_DISTANCE keys ahead, and the chains of those
+ * buckets half as far. Finding a bucket reads the table, so in a concurrent
+ * Load Balancer only the keys of the locked server are prefetched.
+ */
+static void prefetch_ahead(load_balancer_t *main, routed_key_t *routed,
+						   unsigned int i, unsigned int count)
+{
+	unsigned int far = i + LB_PREFETCH_DISTANCE;
+	unsigned int near = i + LB_PREFETCH_DISTANCE / 2;
+
+	if (far < count && (!main->concurrent ||
+						routed[far].memory == routed[i].memory))
+		server_prefetch(routed[far].memory, routed[far].hash, 0);
+
+	if (near < count && (!main->concurrent ||
+						 routed[near].memory == routed[i].memory))
+		server_prefetch(routed[near].memory, routed[near].hash, 1);
+}
+
+/**
+ * In a concurrent Load Balancer, the server of a key is locked only when it
+ * is not the server locked for the previous key, which is then unlocked.
+ * Returns 0 if the snapshot the key was routed with was replaced; then the
+ * server is not locked, and the key has to be routed again.
+ */
+static int lock_next(load_balancer_t *main, lb_snapshot_t *snapshot,
+					 server_memory_t **locked, server_memory_t *memory,
+					 int writing)
+{
+	if (!main->concurrent || *locked == memory)
+		return 1;
+
+	if (*locked)
+		server_unlock(*locked);
+
+	server_lock(memory, writing);
+	*locked = memory;
+	if (__atomic_load_n(&main->snapshot, __ATOMIC_SEQ_CST) == snapshot)
+		return 1;
+
+	server_unlock(memory);
+	*locked = NULL;
+
+	return 0;
+}
+
+/**
+ * Both batched requests: the values of the keys are found (writing 0), or
+ * stored (writing 1). A batch is routed in chunks; in a concurrent Load
+ * Balancer, a chunk is routed with the snapshot of its time, and the keys
+ * not served yet are routed again if the snapshot is replaced.
+ */
+static void serve_many(load_balancer_t *main, char **keys, char **values,
+					   unsigned int count, int *server_ids, int *results,
+					   int writing)
+{
+	routed_key_t routed[LB_BATCH_CHUNK];
+	lb_reader_t *reader = get_reader(main);
+
+	for (unsigned int base = 0; base < count; base += LB_BATCH_CHUNK) {
+		unsigned int chunk = MIN(count - base, LB_BATCH_CHUNK);
+		lb_snapshot_t *snapshot = reader ? enter_epoch(main, reader) : NULL;
+		server_memory_t *locked = NULL;
+
+		hash_many(main, keys + base, chunk, routed);
+		int has_servers = route_sorted(snapshot ? &snapshot->view : main,
+									   routed, chunk);
+
+		for (unsigned int i = 0; i < chunk; i++) {
+			unsigned int idx = base + routed[i].index;
+
+			while (has_servers && !lock_next(main, snapshot, &locked,
+											 routed[i].memory, writing)) {
+				snapshot = enter_epoch(main, reader);
+				has_servers = route_sorted(&snapshot->view, routed + i,
+										   chunk - i);
+			}
+
+			if (!has_servers) {
+				server_ids[idx] = -1;
+				if (!writing)
+					values[idx] = NULL;
+				else if (results)
+					results[idx] = STORE_NO_SERVER;
+				continue;
+			}
+
+			prefetch_ahead(main, routed, i, chunk);
+			server_ids[idx] = routed[i].server_id;
+
+			if (!writing) {
+				values[idx] = server_retrieve_hashed(routed[i].memory,
+													 keys[idx],
+													 routed[i].hash);
+				continue;
+			}
+
+			int inserted = server_store_hashed(routed[i].memory, keys[idx],
+											   routed[i].hash, values[idx]);
+			if (results)
+				results[idx] = inserted ? STORE_INSERTED : STORE_UPDATED;
+		}
+
+		if (locked)
+			server_unlock(locked);
+		leave_epoch(reader);
+	}
+}
+
+void loader_retrieve_many(load_balancer_t *main, char **keys,
+						  unsigned int count, char **values, int *server_ids)
+{
+	serve_many(main, keys, values, count, server_ids, NULL, 0);
+}
+
+void loader_store_many(load_balancer_t *main, char **keys, char **values,
+					   unsigned int count, int *server_ids, int *results)
+{
+	serve_many(main, keys, values, count, server_ids, results, 1);
+}
+
 void free_load_balancer(load_balancer_t *main)
 {
 	/**
@@ -196,6 +1026,27 @@ void free_load_balancer(load_balancer_t *main)
 	 */
 	free(main->servers);
 	free(main->hashring);
+	free(main->ring_hashes);
+	free(main->ring_ids);
+	free(main->lookup);
+	free(main->hrw_seeds);
+	free(main->hrw_ids);
+	id_map_free(main->indices);
+	pthread_mutex_destroy(&main->topology);
+
+	/**
+	 * Nobody uses the Load Balancer anymore, so all the snapshots can go.
+	 */
+	if (main->snapshot)
+		free_snapshot(main->snapshot);
+	while (main->retired) {
+		lb_snapshot_t *snapshot = main->retired;
+
+		main->retired = snapshot->next;
+		free_snapshot(snapshot);
+	}
+	free(main->readers);
+	free(main->held);
 
 	/**
 	 * And then, free the memory occupied by the Load Balancer
@@ -203,197 +1054,333 @@ void free_load_balancer(load_balancer_t *main)
 	free(main);
 }
 
-void order_rings(load_balancer_t *main)
+void order_rings(load_balancer_t *main, unsigned int added)
 {
-	unsigned int i1, i2;
-	i1 = 0;
-	i2 = main->hashring_size - 3;
+	unsigned int old_size = main->hashring_size - added;
 
 	/**
-	 * If the two indices are equal, then it's the first time, we put
-	 * something in our array.
+	 * If there is nothing before the new rings, then it's the first time,
+	 * we put something in our array.
 	 */
-	if (i1 == i2)
+	if (old_size == 0 || added == 0)
 		return;
 
-	ring_t *sorted_arr = calloc(main->hashring_size, sizeof(ring_t));
-	DIE(!sorted_arr, "Failed while modifying the hashring.\n");
-
-	unsigned int idx = 0;
-
 	/**
-	 * Concatenate the last 3 items of the array with the rest of the array.
+	 * Only the new rings are copied aside, the old ones are merged in place.
+	 * Filling the array from the back, a ring is never overwritten before it
+	 * is moved, because the free places are always behind the old rings
+	 * that are left.
 	 */
-	while (i1 < main->hashring_size - 3 && i2 < main->hashring_size) {
-		if (main->hashring[i1].hash < main->hashring[i2].hash) {
-			sorted_arr[idx] = main->hashring[i1];
-			idx++;
-			i1++;
-			continue;
-		}
+	ring_t *new_rings = malloc(added * sizeof(ring_t));
+	DIE(!new_rings, "Failed while modifying the hashring.\n");
+	memcpy(new_rings, main->hashring + old_size, added * sizeof(ring_t));
 
-		sorted_arr[idx] = main->hashring[i2];
-		idx++;
-		i2++;
-	}
+	unsigned int i1 = old_size, i2 = added;
+	unsigned int idx = main->hashring_size;
 
 	/**
-	 * After one of the i's comes to the end, one of the two for's will
-	 * actually be efective.
+	 * A new ring goes before an old one with the same hash, so, from the
+	 * back, the old one is placed first.
 	 */
-	while (i1 < main->hashring_size - 3) {
-		sorted_arr[idx] = main->hashring[i1];
-		idx++;
-		i1++;
-	}
-
-	while (i2 < main->hashring_size) {
-		sorted_arr[idx] = main->hashring[i2];
-		idx++;
-		i2++;
+	while (i2 > 0) {
+		if (i1 > 0 && main->hashring[i1 - 1].hash >= new_rings[i2 - 1].hash)
+			main->hashring[--idx] = main->hashring[--i1];
+		else
+			main->hashring[--idx] = new_rings[--i2];
 	}
 
 	/**
-	 * Transfer the elements of the sorted array in the hashring array.
+	 * The old rings that are left are already in their place.
 	 */
-	for (unsigned int i = 0; i < main->hashring_size; i++)
-		main->hashring[i] = sorted_arr[i];
-
-	free(sorted_arr);
+	free(new_rings);
 }
 
 void insert_ring(load_balancer_t *main, ring_t new_ring)
 {
 	/**
-	 * Every time I add a hash, it will be placed at the end of the hashring.
+	 * Every time I add a hash, it will be placed at the end of the hashring,
+	 * which doubles when it is full.
 	 */
+	if (main->hashring_size == main->hashring_capacity) {
+		main->hashring_capacity *= 2;
+		main->hashring = realloc(main->hashring, main->hashring_capacity *
+								 sizeof(ring_t));
+		DIE(!main->hashring, "Failed while modifying the hashring.\n");
+	}
+
 	unsigned int idx = main->hashring_size;
 	main->hashring[idx] = new_ring;
 	main->hashring_size++;
 }
 
-void add_hash(load_balancer_t *main, unsigned int server_id)
+void add_hash(load_balancer_t *main, unsigned int server_id,
+			  unsigned int replicas)
 {
-	unsigned int hash = hash_function_servers(&server_id);
-
-	unsigned int label1 = 1 * 100000 + server_id;
-	unsigned int label2 = 2 * 100000 + server_id;
-
-	unsigned int hash_dup1 = hash_function_servers(&label1);
-	unsigned int hash_dup2 = hash_function_servers(&label2);
+	/**
+	 * I store the hashes of the server into rings that are placed at the end
+	 * of the hashring. The caller orders them and merges them with the rest,
+	 * once for all the servers it adds.
+	 */
+	for (unsigned int k = 0; k < replicas; k++) {
+		ring_t ring;
+		ring.hash = get_replica_hash(server_id, k);
+		ring.server_id = server_id;
 
-	unsigned int first, second, third;
+		insert_ring(main, ring);
+	}
+}
 
-	first = hash_dup1;
-	second = hash_dup2;
-	third = hash;
+unsigned int ring_lower_bound(load_balancer_t *main, unsigned int hash)
+{
+	unsigned int left = 0, right = main->hashring_size;
 
 	/**
-	 * Firstly, I order hash_dup1, and hash_dup2. At the begginig we considered
-	 * that hash_dup1 is bigger than hash_dup2.
+	 * The hashring is always sorted, so I can search for the first ring
+	 * whose hash is not smaller than the given one, instead of walking the
+	 * whole array.
 	 */
-	if (hash_dup2 < hash_dup1) {
-		first = hash_dup2;
-		second = hash_dup1;
+	while (left < right) {
+		unsigned int mid = left + (right - left) / 2;
+
+		if (main->hashring[mid].hash < hash)
+			left = mid + 1;
+		else
+			right = mid;
 	}
 
-	/**
-	 * At this point we now that hash_dup1, and hash_dup2 are in the correct
-	 * order, and they are stored in "first" and "second"
-	 * 
-	 */
-	if (hash < first) {
-		third = second;
-		second = first;
-		first = hash;
+	return left;
+}
+
+/**
+ * Jump consistent hash (Lamping and Veach): the key jumps forward through
+ * the buckets, and the last bucket before the end is its place. A key only
+ * changes its bucket when it jumps to a new bucket, at the end.
+ */
+static unsigned int jump_bucket(unsigned int key_hash, unsigned int buckets)
+{
+	unsigned long long key = key_hash * 0x9e3779b97f4a7c15ULL;
+	long long bucket = -1, next = 0;
+
+	while (next < buckets) {
+		bucket = next;
+		key = key * 2862933555777941757ULL + 1;
+		next = (bucket + 1) * ((double)(1LL << 31) /
+							   (double)((key >> 33) + 1));
 	}
 
-	/**
-	 * Make comparisions with the hash, to determine the order
-	 */
-	if (hash > second)
-		third = hash;
+	return bucket;
+}
+
+static inline unsigned int hrw_score(unsigned int seed, unsigned int key_hash)
+{
+	unsigned int x = seed ^ key_hash;
+
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	x = ((x >> 16) ^ x) * 0x45d9f3b;
+	return (x >> 16) ^ x;
+}
+
+/**
+ * Every seed is scored against the key, and the server of the highest score
+ * wins (the smaller id, on a tie). The scores of a block don't depend on
+ * each other, so that loop is vectorized, together with the maximum of the
+ * block; the scores are compared one by one only in the blocks that can
+ * hold a new best. Plain x86-64 has no vector multiplication of 32 bit
+ * numbers, so with GCC on x86-64 there is also an AVX2 version of the
+ * function, picked when the program is loaded.
+ */
+HRW_TARGETS
+static unsigned int rendezvous_server(load_balancer_t *main,
+									  unsigned int key_hash)
+{
+	unsigned int scores[HRW_BLOCK];
+	unsigned int best_score = 0, best_id = main->hrw_ids[0];
+
+	for (unsigned int base = 0; base < main->hrw_size; base += HRW_BLOCK) {
+		const unsigned int *seeds = main->hrw_seeds + base;
+		unsigned int block_max = 0;
+
+		for (unsigned int j = 0; j < HRW_BLOCK; j++) {
+			scores[j] = hrw_score(seeds[j], key_hash);
+			block_max = block_max > scores[j] ? block_max : scores[j];
+		}
+
+		if (block_max < best_score)
+			continue;
 
-	if (hash > first && hash < second) {
-		third = second;
-		second = hash;
+		for (unsigned int j = 0; j < HRW_BLOCK && base + j < main->hrw_size;
+			 j++) {
+			unsigned int id = main->hrw_ids[base + j];
+
+			if (scores[j] > best_score ||
+				(scores[j] == best_score && id < best_id)) {
+				best_score = scores[j];
+				best_id = id;
+			}
+		}
 	}
 
+	return best_id;
+}
+
+/**
+ * Places the rings from position i of the hashring in the subtree of node k,
+ * in order: the left subtree, the node, the right subtree. Returns the next
+ * ring to place.
+ */
+static unsigned int eytzinger_fill(load_balancer_t *main, unsigned int i,
+								   unsigned int k)
+{
+	if (k > main->hashring_size)
+		return i;
+
+	i = eytzinger_fill(main, i, 2 * k);
+	main->ring_hashes[k] = main->hashring[i].hash;
+	main->ring_ids[k] = main->hashring[i].server_id;
+
+	return eytzinger_fill(main, i + 1, 2 * k + 1);
+}
+
+void build_ring_layout(load_balancer_t *main)
+{
+	unsigned int size = main->hashring_size;
+
+	free(main->ring_hashes);
+	free(main->ring_ids);
+	main->ring_hashes = malloc((size + 1) * sizeof(unsigned int));
+	main->ring_ids = malloc((size + 1) * sizeof(unsigned int));
+	DIE(!main->ring_hashes || !main->ring_ids,
+		"Failed while building the search layout of the hashring.\n");
+
 	/**
-	 * I store the infos into 3 rings that have to be placed in the hashring
+	 * There is one more id than hashes, the one of the first ring, where a
+	 * search that finds nothing ends up: past the end of the sorted array,
+	 * or at the node 0 of the tree, which is not used otherwise.
 	 */
-	ring_t ring1, ring2, ring3;
-	ring1.server_id = ring2.server_id = ring3.server_id = server_id;
-	ring1.hash = first;
-	ring2.hash = second;
-	ring3.hash = third;
+	unsigned int first = size ? main->hashring[0].server_id : 0;
 
-	insert_ring(main, ring1);
-	insert_ring(main, ring2);
-	insert_ring(main, ring3);
+	if (main->ring_layout == RING_LAYOUT_EYTZINGER) {
+		eytzinger_fill(main, 0, 1);
+		main->ring_hashes[0] = 0;
+		main->ring_ids[0] = first;
+		return;
+	}
 
-	order_rings(main);
+	for (unsigned int i = 0; i < size; i++) {
+		main->ring_hashes[i] = main->hashring[i].hash;
+		main->ring_ids[i] = main->hashring[i].server_id;
+	}
+	main->ring_ids[size] = first;
 }
 
-unsigned int get_server(load_balancer_t *main, unsigned int key_hash)
+/**
+ * A lower bound without branches: the half to keep is chosen by a
+ * conditional move, and the middles of both halves are loaded ahead.
+ */
+static unsigned int search_sorted(const unsigned int *hashes,
+								  unsigned int size, unsigned int hash)
 {
-	unsigned int curr_hash, next_hash;
-	curr_hash = main->hashring[0].hash;
+	const unsigned int *base = hashes;
+	unsigned int len = size;
+
+	if (len == 0)
+		return 0;
+
+	while (len > 1) {
+		unsigned int half = len / 2;
+
+		PREFETCH(base + (len - half) / 2);
+		PREFETCH(base + half + (len - half) / 2);
+		base = base[half] < hash ? base + half : base;
+		len -= half;
+	}
 
-	if (key_hash < curr_hash)
-		return main->hashring[0].server_id;
+	return (base - hashes) + (*base < hash);
+}
 
-	for (unsigned int i = 0; i < main->hashring_size - 1; i++) {
-		curr_hash = main->hashring[i].hash;
-		next_hash = main->hashring[i + 1].hash;
+/**
+ * The children of the node k are 2k and 2k + 1, so the search goes down the
+ * tree without branches, and the nodes 4 levels below (16 hashes, one cache
+ * line) are loaded ahead. The bits of k tell the turns taken: the answer is
+ * the last node where the search went left, so the trailing turns to the
+ * right are dropped, together with that last left turn.
+ */
+static unsigned int search_eytzinger(const unsigned int *hashes,
+									 unsigned int size, unsigned int hash)
+{
+	unsigned int k = 1;
 
-		if (curr_hash < key_hash &&  key_hash <= next_hash)
-			return main->hashring[i + 1].server_id;
+	while (k <= size) {
+		PREFETCH(hashes + 16 * k);
+		k = 2 * k + (hashes[k] < hash);
 	}
 
+#if defined(__GNUC__)
+	return k >> __builtin_ffs(~k);
+#else
+	while (k & 1)
+		k >>= 1;
+	return k >> 1;
+#endif
+}
+
+unsigned int get_server(load_balancer_t *main, unsigned int key_hash)
+{
 	/**
-	 * If it reaches this point means that the hash is bigger that all
-	 * the other hashes in the hashring, and it has to be stored on the
-	 * first server.
+	 * The hash is scaled to the size of the lookup table with a
+	 * multiplication, which is cheaper than a modulo.
 	 */
-	return main->hashring[0].server_id;
+	if (main->router == LB_ROUTER_MAGLEV)
+		return main->lookup[((unsigned long long)key_hash *
+							 main->lookup_size) >> 32];
+
+	if (main->router == LB_ROUTER_JUMP)
+		return main->servers[jump_bucket(key_hash,
+										 main->num_servers)].server_id;
+
+	if (main->router == LB_ROUTER_RENDEZVOUS)
+		return rendezvous_server(main, key_hash);
+
+	/**
+	 * If no hash is bigger, the key wraps around to the first server, whose
+	 * id is where both searches end up in that case.
+	 */
+	if (main->ring_layout == RING_LAYOUT_EYTZINGER)
+		return main->ring_ids[search_eytzinger(main->ring_hashes,
+											   main->hashring_size, key_hash)];
+
+	return main->ring_ids[search_sorted(main->ring_hashes, main->hashring_size,
+										key_hash)];
 }
 
-unsigned int get_index(load_balancer_t *main, unsigned int server_id)
+int get_index(load_balancer_t *main, unsigned int server_id)
 {
-	for (unsigned int i = 0; i < main->num_servers; i++)
-		if (main->servers[i].server_id == server_id)
-			return i;
-
 	/**
-	 * It will never reach this point, beacause the parameter server_id we 
-	 * send it is a valid id, that already exists in the array of servers.
+	 * The map is kept up to date by create_server and detach_server,
+	 * so there is no need to walk the array of servers.
 	 */
-	return IRELLEVANT;
+	return id_map_get(main->indices, server_id);
 }
 
-void remove_id(load_balancer_t *main, unsigned int server_id)
+void remove_rings(load_balancer_t *main, id_map_t *batch)
 {
-	unsigned int i = 0;
+	unsigned int kept = 0;
 
 	/**
-	 * Delete all the hashes associated with the server_id, and keep the
-	 * array sorted.
+	 * Delete all the hashes of the removed servers in a single pass, moving
+	 * every kept ring only once, so the array stays sorted.
 	 */
-	while (i < main->hashring_size) {
-		if (main->hashring[i].server_id == server_id) {
-			for (unsigned int j = i; j < main->hashring_size - 1; j++)
-				main->hashring[j] = main->hashring[j + 1];
-
-			main->hashring_size--;
+	for (unsigned int i = 0; i < main->hashring_size; i++) {
+		if (id_map_get(batch, main->hashring[i].server_id) == BATCH_REMOVED)
 			continue;
-		}
 
-		i++;
+		main->hashring[kept++] = main->hashring[i];
 	}
+
+	main->hashring_size = kept;
 }
 
-void delete_server(load_balancer_t *main, unsigned int index)
+server_memory_t *detach_server(load_balancer_t *main, unsigned int index)
 {
 	/**
 	 * I don't need the servers to be in ascending or descending or some
@@ -408,89 +1395,295 @@ void delete_server(load_balancer_t *main, unsigned int index)
 	main->servers[index] = main->servers[last];
 	main->servers[last] = aux;
 
-	free_server_memory(main->servers[last].memory);
+	/**
+	 * The last server moved in the place of the deleted one, so its index
+	 * changes too.
+	 */
+	id_map_remove(main->indices, aux.server_id);
+	if (index != last)
+		id_map_set(main->indices, main->servers[index].server_id, index);
 
 	main->num_servers--;
+
+	return aux.memory;
+}
+
+void delete_server(load_balancer_t *main, unsigned int index)
+{
+	free_server_memory(detach_server(main, index));
+}
+
+/**
+ * Without key indices, every old server that follows a new ring is walked
+ * once. I walk the hashring backwards from the ring of an old server,
+ * remembering the last old server I have seen.
+ */
+static void remap_neighbours(load_balancer_t *main, id_map_t *batch,
+							 unsigned int start)
+{
+	unsigned int size = main->hashring_size;
+	unsigned int *neighbours = malloc(main->num_servers * sizeof(unsigned int));
+	DIE(!neighbours, "Failed while remapping the objects.\n");
+	unsigned int count = 0;
+	unsigned int next_id = main->hashring[start].server_id;
+
+	for (unsigned int i = 1; i < size; i++) {
+		unsigned int pos = (start + size - i) % size;
+		unsigned int server_id = main->hashring[pos].server_id;
+		int mark = id_map_get(batch, server_id);
+
+		if (mark != BATCH_ADDED) {
+			next_id = server_id;
+			continue;
+		}
+
+		/**
+		 * Many rings can share the same neighbour, and one pass over a
+		 * server moves all the objects it lost, so every neighbour is
+		 * collected only once.
+		 */
+		if (id_map_get(batch, next_id) != BATCH_NEIGHBOUR) {
+			id_map_set(batch, next_id, BATCH_NEIGHBOUR);
+			neighbours[count++] = next_id;
+		}
+	}
+
+	/**
+	 * Get the index of every neighbour, and move the objects that now
+	 * belong to the new servers.
+	 */
+	for (unsigned int i = 0; i < count; i++) {
+		int serv_idx = get_index(main, neighbours[i]);
+
+		hold_server(main, main->servers[serv_idx].memory);
+		main->moved += server_migrate(main->servers[serv_idx].memory,
+									  route_to_owner, main);
+	}
+
+	free(neighbours);
+}
+
+/**
+ * With key indices, only the keys that move are touched. A run of new rings
+ * between two old rings takes the arc from the first old ring up to the last
+ * new ring, and all those keys are on the server of the second old ring. I
+ * walk the hashring forwards from the ring of an old server, and go around
+ * it once, so a run that ends before the start is closed too.
+ */
+static void remap_ranges(load_balancer_t *main, id_map_t *batch,
+						 unsigned int start)
+{
+	unsigned int size = main->hashring_size;
+	unsigned int before = main->hashring[start].hash;
+	unsigned int last_new = 0;
+	int in_run = 0;
+
+	for (unsigned int i = 1; i <= size; i++) {
+		ring_t ring = main->hashring[(start + i) % size];
+
+		if (id_map_get(batch, ring.server_id) == BATCH_ADDED) {
+			last_new = ring.hash;
+			in_run = 1;
+			continue;
+		}
+
+		if (in_run) {
+			int serv_idx = get_index(main, ring.server_id);
+
+			hold_server(main, main->servers[serv_idx].memory);
+			main->moved += server_migrate_range(main->servers[serv_idx].memory,
+												before, last_new,
+												route_to_owner, main);
+			in_run = 0;
+		}
+
+		before = ring.hash;
+	}
 }
 
-void remap_objects(load_balancer_t *main, unsigned int hash)
+void remap_objects(load_balancer_t *main, id_map_t *batch)
 {
 	/**
 	 * At the time this functions is called, the hashes corresponding to
-	 * this server had already been placed on the hashring, and is very
+	 * the new servers had already been placed on the hashring, and is very
 	 * easily to remap the objects.
 	 */
+	unsigned int size = main->hashring_size;
+	unsigned int start = 0;
 
 	/**
-	 * Search for the id of the server that has the potential to share objects
-	 * with the new server.
+	 * The objects of every new ring come from the first old server that
+	 * follows it on the hashring. If there is no old server, there is
+	 * nothing to move.
 	 */
-	unsigned int next_id;
-	for (unsigned int i = 0; i < main->hashring_size; i++) {
-		if (main->hashring[i].hash == hash) {
-			/**
-			 * The case when the server was added on the last position, and
-			 * it's neighbour is the first server.
-			 */
-			if (i == main->hashring_size - 1) {
-				next_id = main->hashring[0].server_id;
-				break;
-			}
+	while (start < size &&
+		   id_map_get(batch, main->hashring[start].server_id) == BATCH_ADDED)
+		start++;
 
-			next_id = main->hashring[i + 1].server_id;
-			break;
-		}
-	}
+	if (start == size)
+		return;
+
+	if (main->key_index)
+		remap_ranges(main, batch, start);
+	else
+		remap_neighbours(main, batch, start);
+}
+
+static int compare_server_ids(const void *a, const void *b)
+{
+	unsigned int id_a = ((const server_t *)a)->server_id;
+	unsigned int id_b = ((const server_t *)b)->server_id;
+
+	return (id_a > id_b) - (id_a < id_b);
+}
+
+void build_lookup(load_balancer_t *main)
+{
+	unsigned int size = main->lookup_size;
+	unsigned int count = main->num_servers;
+
+	if (count == 0)
+		return;
 
 	/**
-	 * Get the index of the server, and store the objects in the new one.
+	 * The table only depends on the set of servers, not on their order in
+	 * the array, which changes when a server is removed, so the servers
+	 * take their turns sorted by id.
 	 */
-	unsigned int serv_idx = get_index(main, next_id);
-	for (unsigned int i = 0; i < HMAX; i++) {
-		list_t *list = main->servers[serv_idx].memory->storage->buckets[i];
+	server_t *order = malloc(count * sizeof(server_t));
+	unsigned int *pos = malloc(count * sizeof(unsigned int));
+	unsigned int *skip = malloc(count * sizeof(unsigned int));
+	char *taken = calloc(size, sizeof(char));
+	DIE(!order || !pos || !skip || !taken,
+		"Failed while building the lookup table.\n");
 
-		if (list->size == 0)
-			continue;
+	memcpy(order, main->servers, count * sizeof(server_t));
+	qsort(order, count, sizeof(server_t), compare_server_ids);
+
+	/**
+	 * Every server walks the table in its own order: it starts from an
+	 * offset and jumps by a skip, both given by its id. The skip is never
+	 * 0, and the size is a prime, so the walk goes through every slot.
+	 */
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int id = order[i].server_id;
+
+		pos[i] = hash_function_replica(id, -1U) % size;
+		skip[i] = hash_function_replica(id, -2U) % (size - 1) + 1;
+	}
 
-		node_t *temp = list->head;
+	/**
+	 * In every round, each server takes the next free slot of its walk,
+	 * once for every unit of its weight, until the table is full.
+	 */
+	unsigned int filled = 0;
 
-		while (temp != NULL) {
-			char *key = (char *)((pair_t *)temp->data)->key;
-			char *value = (char *)((pair_t *)temp->data)->value;
+	while (filled < size) {
+		for (unsigned int i = 0; i < count && filled < size; i++) {
+			unsigned int turns = order[i].replicas / main->replicas;
 
-			unsigned int temp_hash = hash_function_key(key);
-			unsigned int to_store = get_server(main, temp_hash);
-			unsigned int new_idx = get_index(main, to_store);
+			for (unsigned int t = 0; t < turns && filled < size; t++) {
+				while (taken[pos[i]])
+					pos[i] = (pos[i] + skip[i]) % size;
 
-			/**
-			 * Move objects from the server if it is needed.
-			 */
-			if (server_retrieve(main->servers[new_idx].memory, key) == NULL) {
-				server_store(main->servers[new_idx].memory, key, value);
-				temp = temp->next;
-				server_remove(main->servers[serv_idx].memory, key);
-				continue;
+				main->lookup[pos[i]] = order[i].server_id;
+				taken[pos[i]] = 1;
+				filled++;
 			}
+		}
+	}
+
+	free(order);
+	free(pos);
+	free(skip);
+	free(taken);
+}
+
+/**
+ * A server with weight w gets w seeds, so it wins the keys of w servers. The
+ * padding of the last block gets seeds too, that are never looked at.
+ */
+static void build_rendezvous(load_balancer_t *main)
+{
+	unsigned int size = 0;
 
-			temp = temp->next;
+	for (unsigned int i = 0; i < main->num_servers; i++)
+		size += main->servers[i].replicas / main->replicas;
+
+	unsigned int padded = (size + HRW_BLOCK - 1) / HRW_BLOCK * HRW_BLOCK;
+
+	free(main->hrw_seeds);
+	free(main->hrw_ids);
+	main->hrw_seeds = calloc(padded ? padded : HRW_BLOCK, sizeof(unsigned int));
+	main->hrw_ids = calloc(padded ? padded : HRW_BLOCK, sizeof(unsigned int));
+	DIE(!main->hrw_seeds || !main->hrw_ids,
+		"Failed while building the rendezvous seeds.\n");
+	main->hrw_size = size;
+
+	unsigned int k = 0;
+	for (unsigned int i = 0; i < main->num_servers; i++) {
+		unsigned int weight = main->servers[i].replicas / main->replicas;
+
+		for (unsigned int w = 0; w < weight; w++, k++) {
+			main->hrw_seeds[k] = get_replica_hash(main->servers[i].server_id,
+												  w);
+			main->hrw_ids[k] = main->servers[i].server_id;
 		}
 	}
 }
 
-void get_duplicates(unsigned int server_id, unsigned int *original_hash,
-					unsigned int *duplicate1, unsigned int *duplicate2)
+void remap_all(load_balancer_t *main, id_map_t *batch, unsigned int num_added)
 {
+	if (main->router == LB_ROUTER_MAGLEV)
+		build_lookup(main);
+	else if (main->router == LB_ROUTER_RENDEZVOUS)
+		build_rendezvous(main);
+
 	/**
-	 * Calculate the hashes for the server_id.
+	 * With rendezvous hashing, the keys of a server that leaves go to their
+	 * second choice, and no other key moves.
 	 */
-	unsigned int hash = hash_function_servers(&server_id);
-	*original_hash = hash;
+	if (main->router == LB_ROUTER_RENDEZVOUS && num_added == 0)
+		return;
 
-	unsigned int temp = 1 * 100000 + server_id;
+	/**
+	 * Any key may change its server, so every old server is walked. The
+	 * objects of the removed servers are moved by the caller.
+	 */
+	for (unsigned int i = 0; i < main->num_servers; i++) {
+		if (id_map_get(batch, main->servers[i].server_id) == BATCH_ADDED)
+			continue;
 
-	*duplicate1 = hash_function_servers(&temp);
+		hold_server(main, main->servers[i].memory);
+		main->moved += server_migrate(main->servers[i].memory,
+									  route_to_owner, main);
+	}
+}
 
-	temp = 2 * 100000 + server_id;
+unsigned int loader_get_moved(load_balancer_t *main)
+{
+	if (main->concurrent)
+		pthread_mutex_lock(&main->topology);
+	unsigned int moved = main->moved;
+	if (main->concurrent)
+		pthread_mutex_unlock(&main->topology);
+
+	return moved;
+}
+
+unsigned int get_replica_hash(unsigned int server_id, unsigned int replica)
+{
+	/**
+	 * The small ids keep their old labels, so the hashring of a Load Balancer
+	 * with 3 replicas stays the same as before. A bigger id could take the
+	 * label of a replica of a small one (100005 is also 1 * 100000 + 5), so
+	 * those get a label made from both numbers.
+	 */
+	if (server_id < RING_LABEL_BASE && replica < RING_LEGACY_REPLICAS) {
+		unsigned int label = replica * RING_LABEL_BASE + server_id;
+
+		return hash_function_servers(&label);
+	}
 
-	*duplicate2 = hash_function_servers(&temp);
+	return hash_function_replica(server_id, replica);
 }
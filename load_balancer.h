@@ -7,12 +7,52 @@
 #include "datastruct_funcs.h"
 
 /**
- * @brief Initializes the memory for a new load balancer and its fields.
+ * @brief Fills a configuration with the default options: servers that use
+ * the lab hashtable and keep a key index, and LB_DEFAULT_REPLICAS rings for
+ * every server on the hashring, whose hashes are searched in a sorted array
+ * of their own (ring_layout; RING_LAYOUT_EYTZINGER pays off only for rings of
+ * about a million hashes). The other routers replace the hashring, and
+ * the servers don't keep key indices with them: LB_ROUTER_MAGLEV uses a lookup
+ * table of lookup_size slots (by default, MAGLEV_TABLE_SIZE), LB_ROUTER_JUMP
+ * uses jump consistent hash over the array of servers (the weights are
+ * ignored), and LB_ROUTER_RENDEZVOUS gives every key to the server with the
+ * highest score. The keys are hashed with the legacy djb2 (key_hash), which
+ * places them where the homework does; KEY_HASH_FAST is faster on long keys,
+ * and its hash_seed changes the hash of every key, which spreads the keys
+ * crafted to collide under another seed. The router, the servers and the
+ * moves between them all use the same hash.
+ *
+ * The Load Balancer is used by one thread at a time, unless concurrent is
+ * set: then many threads can store and retrieve keys at once (the servers
+ * are locked one by one, and the readers of a server share its lock), while
+ * a change of the servers waits for all of them and runs alone.
+ *
+ * The objects of a removed server are moved by drain_threads threads (1 by
+ * default): they route the objects of a slice of the server each, and then
+ * fill a few of the destinations each, so the servers end up the same with
+ * any number of threads. The objects taken by an added server are always
+ * moved by the calling thread.
+ *
+ * @param config The configuration to fill.
+ */
+void lb_config_defaults(lb_config_t *config);
+
+/**
+ * @brief Initializes the memory for a new load balancer and its fields,
+ * with the default options.
  *
  * @return Pointer to the load balancer struct.
  */
 load_balancer_t *init_load_balancer();
 
+/**
+ * @brief Initializes the memory for a new load balancer and its fields.
+ *
+ * @param config The options of the load balancer, see lb_config_t.
+ * @return Pointer to the load balancer struct.
+ */
+load_balancer_t *init_load_balancer_with(const lb_config_t *config);
+
 /**
  * @brief Frees the memory of every field that is related to the
  * load balancer (servers, hashring).
@@ -24,16 +64,20 @@ void free_load_balancer(load_balancer_t *main);
 /**
  * @brief Stores the key-value pair inside the system. The load balancer 
  * will use Consistent Hashing to distribute the load across the servers.
- * The chosen server ID will be returned using the last parameter.
+ * The chosen server ID will be returned using the last parameter. Storing a
+ * key that already exists replaces its value.
  *
  * @param main Load balancer which distributes the work.
  * @param key Key represented as a string.
  * @param value Value represented as a string.
  * @param server_id This function will RETURN via this parameter
  * the server ID which stores the object.
+ * @return STORE_INSERTED for a new key, STORE_UPDATED for an existing one,
+ * or STORE_NO_SERVER if there is no server in the system (the server ID is
+ * -1 then).
  */
-void loader_store(load_balancer_t *main, char *key, char *value,
-				  int *server_id);
+int loader_store(load_balancer_t *main, char *key, char *value,
+				 int *server_id);
 
 /**
  * @brief Gets a value associated with the key. The load balancer will search
@@ -48,15 +92,106 @@ void loader_store(load_balancer_t *main, char *key, char *value,
 char *loader_retrieve(load_balancer_t *main, char *key, int *server_id);
 
 /**
- * @brief  Adds a new server to the system. The load balancer will generate
- * 3 replica labels and it will place them inside the hash ring. The neighbor
- * servers will distribute some the objects to the added server.
+ * @brief Like loader_store and loader_retrieve, with the hash of the key
+ * already computed, by the hash function of the Load Balancer (for example,
+ * read from a command log). A wrong hash puts the key on a wrong server.
+ */
+int loader_store_hashed(load_balancer_t *main, char *key, unsigned int hash,
+						char *value, int *server_id);
+char *loader_retrieve_hashed(load_balancer_t *main, char *key,
+							 unsigned int hash, int *server_id);
+
+/**
+ * @brief Like loader_retrieve, but the value is copied while its server is
+ * locked. In a concurrent Load Balancer, the value returned by
+ * loader_retrieve can be replaced by another thread right after it was
+ * found, so the threads should use this one.
+ *
+ * @param main Load balancer which distributes the work.
+ * @param key Key represented as a string.
+ * @param buffer RETURNS the value, cut to size - 1 characters if needed.
+ * @param size The size of the buffer, in bytes.
+ * @param server_id RETURNS the server ID of the key, or -1 if there is no
+ * server in the system.
+ * @return The length of the value (which was cut if it is not smaller than
+ * size), or -1 if the key does NOT exist in the system.
+ */
+int loader_retrieve_copy(load_balancer_t *main, char *key, char *buffer,
+						 unsigned int size, int *server_id);
+
+/**
+ * @brief Gets the values of many keys at once. All the keys are hashed
+ * first, then routed together (with the hashring, in the order of their
+ * hashes, walking the hashring once), and the tables of the next keys are
+ * prefetched while a key is looked up.
+ *
+ * @param main Load balancer which distributes the work.
+ * @param keys The keys, as strings.
+ * @param count The number of keys.
+ * @param values RETURNS the value of every key, or NULL for a missing key.
+ * @param server_ids RETURNS the server ID of every key, or -1 if there is no
+ * server in the system.
+ */
+void loader_retrieve_many(load_balancer_t *main, char **keys,
+						  unsigned int count, char **values, int *server_ids);
+
+/**
+ * @brief Stores many key-value pairs at once, like loader_retrieve_many. A
+ * key given more than once ends up with its last value, as if the pairs were
+ * stored one by one.
+ *
+ * @param main Load balancer which distributes the work.
+ * @param keys The keys, as strings.
+ * @param values The values, as strings.
+ * @param count The number of pairs.
+ * @param server_ids RETURNS the server ID of every key, or -1 if there is no
+ * server in the system.
+ * @param results RETURNS the result of every store, like loader_store; it
+ * can be NULL.
+ */
+void loader_store_many(load_balancer_t *main, char **keys, char **values,
+					   unsigned int count, int *server_ids, int *results);
+
+/**
+ * @brief  Adds a new server to the system, with weight 1. The load balancer
+ * will generate a replica label for every ring of the server (3, by default)
+ * and it will place them inside the hash ring. The neighbor servers will
+ * distribute some the objects to the added server.
  * 
  * @param main Load balancer which distributes the work.
  * @param server_id ID of the new server.
  */
 void loader_add_server(load_balancer_t *main, int server_id);
 
+/**
+ * @brief  Adds a new server to the system, that gets weight times more rings
+ * than a server with weight 1, so it will get weight times more objects.
+ * 
+ * @param main Load balancer which distributes the work.
+ * @param server_id ID of the new server.
+ * @param weight The weight of the server; 0 is the same as 1.
+ */
+void loader_add_server_weighted(load_balancer_t *main, int server_id,
+								unsigned int weight);
+
+/**
+ * @brief Adds and removes many servers at once. The removed servers leave
+ * first, then the new ones are added, the hashring is rebuilt only once, and
+ * every object that has to move is moved only once, straight to its final
+ * server. Unknown ids to remove, and ids that already exist to add, are
+ * ignored.
+ * 
+ * @param main Load balancer which distributes the work.
+ * @param add_ids IDs of the new servers.
+ * @param weights The weights of the new servers, or NULL for weight 1.
+ * @param num_add The number of new servers.
+ * @param remove_ids IDs of the removed servers.
+ * @param num_remove The number of removed servers.
+ */
+void loader_change_servers(load_balancer_t *main, const int *add_ids,
+						   const unsigned int *weights, unsigned int num_add,
+						   const int *remove_ids, unsigned int num_remove);
+
 /**
  * @brief Removes a specific server from the system. The load balancer will 
  * distribute ALL objects stored on the removed server and will delete ALL
@@ -68,18 +203,21 @@ void loader_add_server(load_balancer_t *main, int server_id);
 void loader_remove_server(load_balancer_t *main, int server_id);
 
 /**
- * @brief Based on the server id, there will be generated 3 different hashes,
- * one for each replica, and they will be aded at the end of the hashring as
- * ring_t structs. They will be aded at the end in ascending order. 
+ * @brief Based on the server id, there will be generated a hash for each
+ * replica, and they will be aded at the end of the hashring as ring_t
+ * structs. They have to be ordered and merged with the rest of the hashring
+ * after that (see order_rings).
  * 
  * @param main The Load Balancer which distributes the work.
  * @param server_id The id of the server to be added in the hashring.
+ * @param replicas The number of rings of the server.
 */
-void add_hash(load_balancer_t *main, unsigned int server_id);
+void add_hash(load_balancer_t *main, unsigned int server_id,
+			  unsigned int replicas);
 
 /**
  * @brief Inserts a new ring at the end of the hashring, and increase the size
- * of the hashring.
+ * of the hashring. The array of rings grows if it is full.
  * 
  * @param main The Load Balancer which distributes the work.
  * @param new_ring The new ring_t struct that has to be inserted in the hashring.
@@ -88,17 +226,44 @@ void insert_ring(load_balancer_t *main, ring_t new_ring);
 
 /**
  * @brief AOrder the hashring in the ascending order by hash. Actually, this 
- * function makes a concatenation between the last 3 elements of the hashring,
- * and the rest of the hashring, because it is always called after 3 calls of
- * insert_ring(), and the hashring remains sorted in the rest of the time.
+ * function makes a concatenation between the last added elements of the
+ * hashring, and the rest of the hashring, because it is always called after
+ * the rings of a server are inserted in order with insert_ring(), and the
+ * hashring remains sorted in the rest of the time.
+ * 
+ * @param main The Load Balancer which distributes the work.
+ * @param added The number of rings inserted at the end.
+ */
+void order_rings(load_balancer_t *main, unsigned int added);
+
+/**
+ * @brief Copies the hashes and the server ids of the hashring in the arrays
+ * searched by get_server, in the order of the layout of the load balancer.
+ * It has to be called after every change of the hashring.
+ *
+ * @param main The Load Balancer which distributes the work.
+ */
+void build_ring_layout(load_balancer_t *main);
+
+/**
+ * @brief Binary search the sorted hashring for the first ring whose hash is
+ * greater than or equal to the given hash.
  * 
  * @param main The Load Balancer which distributes the work.
+ * @param hash The hash to look for.
+ * @return The position of the ring, or hashring_size if every hash on the
+ * hashring is smaller than the given one.
  */
-void order_rings(load_balancer_t *main);
+unsigned int ring_lower_bound(load_balancer_t *main, unsigned int hash);
 
 /**
  * @brief Search through the hashring to find the server where the new object
- * with the key_hash has to be put.
+ * with the key_hash has to be put. The search is logarithmic, and a hash
+ * bigger than every ring wraps around to the first ring. Only the hashes are
+ * searched, in the layout built by build_ring_layout. With the Maglev
+ * router, it is a single read from the lookup table; jump consistent hash
+ * takes a logarithmic number of steps, and rendezvous hashing scores every
+ * server.
  * 
  * @param main The Load Balancer which distributes the work.
  * @param key_hash The hash of the key that have to be added.
@@ -107,24 +272,32 @@ void order_rings(load_balancer_t *main);
 unsigned int get_server(load_balancer_t *main, unsigned int key_hash);
 
 /**
- * @brief Search through the array of servers within the load balancer, to
- * find the index of the server with the given server_id.
+ * @brief Find the index of the server with the given server_id in the array
+ * of servers, using the id map of the load balancer, in constant time.
  * 
  * @param main The Load Balancer which distributes the work.
  * @param server_id The id of the server to find.
- * @return The index of the server, or the IRELLEVANT value, but it never
- * reaches that far in the code, that's why it is called irellevant.
+ * @return The index of the server, or -1 if there is no server with that id.
+ */
+int get_index(load_balancer_t *main, unsigned int server_id);
+
+/**
+ * @brief Remove all the rings in the hashring that belong to the servers
+ * marked with BATCH_REMOVED, in a single pass.
+ * 
+ * @param main The Load Balancer which distributes the work.
+ * @param batch The marks of the servers in the batch.
  */
-unsigned int get_index(load_balancer_t *main, unsigned int server_id);
+void remove_rings(load_balancer_t *main, id_map_t *batch);
 
 /**
- * @brief Remove all the rings in the hashring that posses a given id.
+ * @brief Takes a server out of the array of servers, without freeing it.
  * 
  * @param main The Load Balancer which distributes the work.
- * @param server_id The id of the server that wants to be removed from
- * the hashring.
+ * @param index The index of the server that have to be removed.
+ * @return The memory of the server.
  */
-void remove_id(load_balancer_t *main, unsigned int index);
+server_memory_t *detach_server(load_balancer_t *main, unsigned int index);
 
 /**
  * @brief Deletes a server from the array of servers with the given index.
@@ -135,25 +308,67 @@ void remove_id(load_balancer_t *main, unsigned int index);
 void delete_server(load_balancer_t *main, unsigned int idx);
 
 /**
- * @brief Rebalance the objects when a new server is added. The function is called
- * for each replica of the server.
+ * @brief Callback for server_migrate that sends every key to the server that
+ * owns it according to the hashring.
  * 
+ * @param key The key of the object.
+ * @param key_hash The hash of the key, stored next to it.
+ * @param arg The Load Balancer which distributes the work.
+ * @return The server where the object belongs.
+ */
+server_memory_t *route_to_owner(char *key, unsigned int key_hash, void *arg);
+
+/**
+ * @brief Rebalance the objects when new servers are added. Every old server
+ * that follows a ring of a new server gives the new servers the objects that
+ * now belong to them, in a single pass.
+ * 
+ * @param main The Load Balancer which distributes the work.
+ * @param batch The marks of the servers in the batch; the new servers are
+ * marked with BATCH_ADDED, and already are on the hashring.
+ */
+void remap_objects(load_balancer_t *main, id_map_t *batch);
+
+/**
+ * @brief Fills the lookup table of a Load Balancer with the Maglev router:
+ * every server walks the table in its own order, and takes the next free
+ * slot, in turns (as many turns per round as its weight), until the table is
+ * full. A change of the servers moves only a few slots of the others.
+ *
+ * @param main The Load Balancer which distributes the work.
+ */
+void build_lookup(load_balancer_t *main);
+
+/**
+ * @brief Rebalance the objects after servers are added or removed, for the
+ * routers other than the hashring: their structures (the Maglev table, the
+ * rendezvous seeds) are rebuilt, and every old server gives away the objects
+ * that now belong to other servers. The objects of the removed servers are
+ * left to the caller.
+ *
+ * @param main The Load Balancer which distributes the work.
+ * @param batch The marks of the servers in the batch.
+ * @param num_added The number of servers that were added.
+ */
+void remap_all(load_balancer_t *main, id_map_t *batch, unsigned int num_added);
+
+/**
+ * @brief Gets the number of objects that changed servers during the last
+ * topology change (adding or removing servers, or a batch of them).
+ *
  * @param main The Load Balancer which distributes the work.
- * @param hash The hash from the hashring, that corresponds to the new server. It
- * also can be the hash of a replica of the new server.
+ * @return The number of moved objects.
  */
-void remap_objects(load_balancer_t *main, unsigned int hash);
+unsigned int loader_get_moved(load_balancer_t *main);
 
 /**
- * @brief Get all the 3 hashes corresponding to a server id, from the hashring.
- * The hashes are returned by the other 3 params.
+ * @brief Get the hash of one replica of a server. The replica 0 is the
+ * original hash of the server.
  * 
  * @param server_id The id of the server which hashes you want to get.
- * @param original_hash The original hash.
- * @param duplicate1 The hash of the first duplicate.
- * @param duplicate2 The hash of the second duplicate.
+ * @param replica The number of the replica.
+ * @return The hash of the replica, the place of the ring on the hashring.
  */
-void get_duplicates(unsigned int server_id, unsigned int *original_hash,
-					unsigned int *duplicate1, unsigned int *duplicate2);
+unsigned int get_replica_hash(unsigned int server_id, unsigned int replica);
 
 #endif /* LOAD_BALANCER_H_ */
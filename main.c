@@ -1,115 +1,186 @@
 /* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "command_log.h"
 #include "load_balancer.h"
+#include "request_executor.h"
+#include "request_reader.h"
+#include "result_writer.h"
 #include "utils.h"
 
-#define REQUEST_LENGTH 1024
-#define KEY_LENGTH 128
-#define VALUE_LENGTH 65536
-
-void get_key_value(char* key, char* value, char* request) {
-	int key_start = 0, value_start = 0;
-	int key_finish = 0, value_finish = 0;
-	int key_index = 0, value_index = 0;
-
-	for (unsigned int i = 0; i < strlen(request); ++i) {
-		if (request[i] == '"' && value_start != 1) {
-			if (key_start == 0) {
-				key_start = 1;
-			} else if (key_finish == 0) {
-				key_finish = 1;
-			} else if (value_start == 0) {
-				value_start = 1;
-			}
-		} else {
-			if (key_start == 1 && key_finish == 0) {
-				key[key_index++] = request[i];
-			} else if (value_start == 1 && value_finish == 0) {
-				value[value_index++] = request[i];
-			}
-		}
+/**
+ * The requests come from a text file, or from a command log, whose keys are
+ * already hashed, with the hash function written in the log.
+ */
+void apply_requests(int input_fd, lb_config_t *config,
+					const run_options_t *options) {
+	request_source_t source = {NULL, NULL, NULL};
+	int status;
+
+	if (options->replay)
+		source.log = command_log_open(input_fd, &config->key_hash,
+									  &config->hash_seed);
+	else
+		source.reader = request_reader_create(input_fd);
+
+	load_balancer_t* main_server = init_load_balancer_with(config);
+	/* the results are written by the writer only, stdout isn't used */
+	result_writer_t *results = result_writer_create(STDOUT_FILENO,
+													options->format,
+													options->echo_values);
+
+	if (options->shards)
+		status = execute_sharded(main_server, &source, results,
+								 options->shards);
+	else if (options->pipeline)
+		status = execute_pipelined(main_server, &source, results);
+	else
+		status = execute_requests(main_server, &source, results);
+
+	/**
+	 * The results of the requests before a bad one are still in the buffer
+	 * of the writer, and DIE doesn't know about it.
+	 */
+	if (status < 0) {
+		result_flush(results);
+		errno = EINVAL;
+		DIE(1, source.error);
 	}
 
-	value[value_index - 1] = 0;
+	if (source.log)
+		command_log_free(source.log);
+	else
+		request_reader_free(source.reader);
+	result_writer_free(results);
+	free_load_balancer(main_server);
 }
 
-void get_key(char* key, char* request) {
-	int key_start = 0, key_index = 0;
-
-	for (unsigned int i = 0; i < strlen(request); ++i) {
-		if (request[i] == '"') {
-			key_start = 1;
-		} else if (key_start == 1) {
-			key[key_index++] = request[i];
-		}
+/**
+ * Writes the requests of a text file in a command log, without applying
+ * them.
+ */
+void convert_requests(int input_fd, const lb_config_t *config,
+					  const char *path) {
+	int output = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	DIE(output < 0, "Failed while creating the command log");
+
+	request_reader_t *reader = request_reader_create(input_fd);
+	command_log_writer_t *log = command_log_create(output, config->key_hash,
+												   config->hash_seed);
+	request_t request;
+	int status;
+
+	while ((status = request_next(reader, &request)) > 0)
+		command_log_append(log, &request);
+
+	/* the log keeps the requests before a bad one */
+	command_log_close(log);
+	if (status < 0) {
+		errno = EINVAL;
+		DIE(1, reader->error);
 	}
+
+	request_reader_free(reader);
+	close(output);
 }
 
-void apply_requests(FILE* input_file) {
-	char request[REQUEST_LENGTH] = {0};
-	char key[KEY_LENGTH] = {0};
-	char value[VALUE_LENGTH] = {0};
-	load_balancer_t* main_server = init_load_balancer();
-
-	while (fgets(request, REQUEST_LENGTH, input_file)) {
-		request[strlen(request) - 1] = 0;
-		if (!strncmp(request, "store", sizeof("store") - 1)) {
-			get_key_value(key, value, request);
-
-			int index_server = 0;
-			loader_store(main_server, key, value, &index_server);
-			printf("Stored %s on server %d.\n", value, index_server);
-
-			memset(key, 0, sizeof(key));
-			memset(value, 0, sizeof(value));
-		} else if (!strncmp(request, "retrieve", sizeof("retrieve") - 1)) {
-			get_key(key, request);
-
-			int index_server = 0;
-			char *retrieved_value = loader_retrieve(main_server,
-											key, &index_server);
-			if (retrieved_value) {
-				printf("Retrieved %s from server %d.\n",
-						retrieved_value, index_server);
-			} else {
-				printf("Key %s not present.\n", key);
-			}
-
-			memset(key, 0, sizeof(key));
-		} else if (!strncmp(request, "add_server", sizeof("add_server") - 1)) {
-			int server_id = atoi(request + sizeof("add_server"));
-
-			loader_add_server(main_server, server_id);
-		} else if (!strncmp(request, "remove_server",
-					sizeof("remove_server") - 1)) {
-			int server_id = atoi(request + sizeof("remove_server"));
-
-			loader_remove_server(main_server, server_id);
-		} else {
-			DIE(1, "unknown function call");
-		}
+/**
+ * Parses the options given before the input file. Returns 0 on success, and
+ * -1 for an unknown or invalid option.
+ */
+int parse_options(int argc, char* argv[], lb_config_t *config,
+				  run_options_t *options) {
+	for (int i = 1; i < argc - 1; ++i) {
+		if (!strcmp(argv[i], "--engine=chained"))
+			config->engine = SERVER_ENGINE_CHAINED;
+		else if (!strcmp(argv[i], "--engine=flat"))
+			config->engine = SERVER_ENGINE_FLAT;
+		else if (!strcmp(argv[i], "--router=ring"))
+			config->router = LB_ROUTER_RING;
+		else if (!strcmp(argv[i], "--router=maglev"))
+			config->router = LB_ROUTER_MAGLEV;
+		else if (!strcmp(argv[i], "--router=jump"))
+			config->router = LB_ROUTER_JUMP;
+		else if (!strcmp(argv[i], "--router=rendezvous"))
+			config->router = LB_ROUTER_RENDEZVOUS;
+		else if (!strcmp(argv[i], "--ring-layout=sorted"))
+			config->ring_layout = RING_LAYOUT_SORTED;
+		else if (!strcmp(argv[i], "--ring-layout=eytzinger"))
+			config->ring_layout = RING_LAYOUT_EYTZINGER;
+		else if (!strcmp(argv[i], "--key-hash=djb2"))
+			config->key_hash = KEY_HASH_DJB2;
+		else if (!strcmp(argv[i], "--key-hash=fast"))
+			config->key_hash = KEY_HASH_FAST;
+		else if (!strncmp(argv[i], "--hash-seed=", sizeof("--hash-seed=") - 1))
+			config->hash_seed = strtoul(argv[i] + sizeof("--hash-seed=") - 1,
+										NULL, 0);
+		else if (!strncmp(argv[i], "--drain-threads=",
+						  sizeof("--drain-threads=") - 1) &&
+				 atoi(argv[i] + sizeof("--drain-threads=") - 1) > 0)
+			config->drain_threads = atoi(argv[i] +
+										 sizeof("--drain-threads=") - 1);
+		else if (!strcmp(argv[i], "--output=text"))
+			options->format = RESULT_TEXT;
+		else if (!strcmp(argv[i], "--output=binary"))
+			options->format = RESULT_BINARY;
+		else if (!strcmp(argv[i], "--no-values"))
+			options->echo_values = 0;
+		else if (!strcmp(argv[i], "--replay"))
+			options->replay = 1;
+		else if (!strcmp(argv[i], "--pipeline"))
+			options->pipeline = 1;
+		else if (!strncmp(argv[i], "--shards=", sizeof("--shards=") - 1) &&
+				 atoi(argv[i] + sizeof("--shards=") - 1) > 0 &&
+				 atoi(argv[i] + sizeof("--shards=") - 1) <= SHARDS_MAX)
+			options->shards = atoi(argv[i] + sizeof("--shards=") - 1);
+		else if (!strncmp(argv[i], "--convert=", sizeof("--convert=") - 1) &&
+				 argv[i][sizeof("--convert=") - 1])
+			options->convert = argv[i] + sizeof("--convert=") - 1;
+		else if (!strcmp(argv[i], "--no-key-index"))
+			config->key_index = 0;
+		else if (!strncmp(argv[i], "--replicas=", sizeof("--replicas=") - 1)
+				 && atoi(argv[i] + sizeof("--replicas=") - 1) > 0)
+			config->replicas = atoi(argv[i] + sizeof("--replicas=") - 1);
+		else
+			return -1;
 	}
 
-	free_load_balancer(main_server);
+	return 0;
 }
 
 int main(int argc, char* argv[]) {
-	FILE *input;
-
-	if (argc != 2) {
-		printf("Usage:%s input_file \n", argv[0]);
+	int input;
+	lb_config_t config;
+	run_options_t options = {RESULT_TEXT, 1, 0, 0, 0, NULL};
+
+	lb_config_defaults(&config);
+	if (argc < 2 || parse_options(argc, argv, &config, &options) ||
+		(options.replay && options.convert)) {
+		printf("Usage:%s [--engine=chained|flat] [--replicas=N] "
+			   "[--router=ring|maglev|jump|rendezvous] "
+			   "[--ring-layout=sorted|eytzinger] [--key-hash=djb2|fast] "
+			   "[--hash-seed=N] [--no-key-index] [--drain-threads=N] "
+			   "[--output=text|binary] [--no-values] "
+			   "[--pipeline | --shards=N] "
+			   "[--convert=command_log | --replay] "
+			   "input_file \n",
+			   argv[0]);
 		return -1;
 	}
 
-	input = fopen(argv[1], "rt");
-	DIE(input == NULL, "missing input file");
+	input = open(argv[argc - 1], O_RDONLY);
+	DIE(input < 0, "missing input file");
 
-	apply_requests(input);
+	if (options.convert)
+		convert_requests(input, &config, options.convert);
+	else
+		apply_requests(input, &config, &options);
 
-	fclose(input);
+	close(input);
 
 	return 0;
 }
@@ -0,0 +1,566 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "request_executor.h"
+#include "command_log.h"
+#include "load_balancer.h"
+#include "request_reader.h"
+#include "result_writer.h"
+#include "server.h"
+#include "spsc_ring.h"
+#include "data_structs.h"
+#include "utils.h"
+
+int source_next(request_source_t *source, request_t *request)
+{
+	int status;
+
+	if (source->log) {
+		status = command_log_next(source->log, request);
+		if (status < 0)
+			source->error = source->log->error;
+	} else {
+		status = request_next(source->reader, request);
+		if (status < 0)
+			source->error = source->reader->error;
+	}
+
+	return status;
+}
+
+/**
+ * Applies the servers gathered in the batch, all at once.
+ */
+static void flush_batch(load_balancer_t *main_server, server_batch_t *batch)
+{
+	if (batch->removing)
+		loader_change_servers(main_server, NULL, NULL, 0, batch->ids,
+							  batch->size);
+	else
+		loader_change_servers(main_server, batch->ids, batch->weights,
+							  batch->size, NULL, 0);
+
+	batch->size = 0;
+}
+
+/**
+ * The consecutive add_server (or remove_server) requests are gathered and
+ * applied together, when a request of another kind comes.
+ */
+static void batch_push(load_balancer_t *main_server, server_batch_t *batch,
+					   int removing, int server_id, unsigned int weight)
+{
+	if (batch->size && batch->removing != removing)
+		flush_batch(main_server, batch);
+
+	if (batch->size == batch->capacity) {
+		batch->capacity = batch->capacity ? 2 * batch->capacity : 16;
+		batch->ids = realloc(batch->ids, batch->capacity * sizeof(int));
+		batch->weights = realloc(batch->weights,
+								 batch->capacity * sizeof(unsigned int));
+		DIE(!batch->ids || !batch->weights, "realloc failed");
+	}
+
+	batch->removing = removing;
+	batch->ids[batch->size] = server_id;
+	batch->weights[batch->size] = weight;
+	batch->size++;
+}
+
+int execute_request(load_balancer_t *main_server, server_batch_t *batch,
+					request_t *request, int *server_id, char **value)
+{
+	/* the keys have to find the servers in place */
+	if (batch->size && (request->type == REQUEST_STORE ||
+		request->type == REQUEST_RETRIEVE))
+		flush_batch(main_server, batch);
+
+	*server_id = 0;
+	if (request->type == REQUEST_STORE) {
+		if (request->hashed)
+			loader_store_hashed(main_server, request->key, request->hash,
+								request->value, server_id);
+		else
+			loader_store(main_server, request->key, request->value,
+						 server_id);
+		return RESULT_STORED;
+	}
+
+	if (request->type == REQUEST_RETRIEVE) {
+		*value = request->hashed ?
+			loader_retrieve_hashed(main_server, request->key, request->hash,
+								   server_id) :
+			loader_retrieve(main_server, request->key, server_id);
+		return *value ? RESULT_RETRIEVED : RESULT_MISSING;
+	}
+
+	batch_push(main_server, batch, request->type == REQUEST_REMOVE_SERVER,
+			   request->server_id, request->weight);
+	return 0;
+}
+
+static void write_result(result_writer_t *results, const request_t *request,
+						 int kind, int server_id, const char *value,
+						 unsigned int value_len)
+{
+	if (kind == RESULT_STORED)
+		result_stored(results, request->value, request->value_len,
+					  server_id);
+	else if (kind == RESULT_RETRIEVED)
+		result_retrieved(results, value, value_len, server_id);
+	else if (kind == RESULT_MISSING)
+		result_missing(results, request->key, request->key_len);
+}
+
+int execute_requests(load_balancer_t *main_server, request_source_t *source,
+					 result_writer_t *results)
+{
+	server_batch_t batch = {NULL, NULL, 0, 0, 0};
+	request_t request;
+	int status;
+
+	while ((status = source_next(source, &request)) > 0) {
+		int server_id;
+		char *value = NULL;
+		int kind = execute_request(main_server, &batch, &request, &server_id,
+								   &value);
+
+		write_result(results, &request, kind, server_id, value,
+					 value ? strlen(value) : 0);
+	}
+
+	free(batch.ids);
+	free(batch.weights);
+
+	return status;
+}
+
+/**
+ * The state shared by the stages of the pipeline. The batches go around
+ * through the three rings: the empty ones from the writer to the reader, the
+ * read ones to the calling thread, and the applied ones to the writer. A
+ * NULL batch ends the requests. With shards, the calling thread only routes
+ * the requests, and gives every one of them to the thread of its server.
+ */
+typedef struct pipeline_t {
+	load_balancer_t *main_server;
+	request_source_t *source;
+	result_writer_t *results;
+	spsc_ring_t *empty;
+	spsc_ring_t *read;
+	spsc_ring_t *applied;
+	unsigned int shards;	/* 0 if the calling thread applies the requests */
+	struct shard_worker_t *workers;
+	int status;	/* of the last source_next of the reader */
+} pipeline_t;
+
+/**
+ * A thread that applies the requests of the servers whose ids give its
+ * place, modulo the number of shards. Only the calling thread reads done,
+ * which is on its own cache line, and only to know when the thread is idle.
+ */
+typedef struct shard_worker_t {
+	unsigned long long done;	/* the requests applied so far */
+	char padding[LB_CACHE_LINE - sizeof(unsigned long long)];
+	pipeline_t *pipeline;
+	spsc_ring_t *ring;	/* the results to fill, from the calling thread */
+	pthread_t thread;
+} shard_worker_t;
+
+/**
+ * Makes room for count more bytes in an array of a batch; only its offsets
+ * are kept, so it can move.
+ */
+static void batch_reserve(char **bytes, size_t size, size_t *capacity,
+						  size_t count)
+{
+	if (size + count <= *capacity)
+		return;
+
+	while (size + count > *capacity)
+		*capacity *= 2;
+	*bytes = realloc(*bytes, *capacity);
+	DIE(!*bytes, "realloc failed");
+}
+
+static char *copy_string(request_batch_t *batch, const char *string,
+						 unsigned int len)
+{
+	char *copy = batch->strings + batch->strings_size;
+
+	memcpy(copy, string, len + 1);
+	batch->strings_size += len + 1;
+
+	return copy;
+}
+
+/**
+ * Copies the strings of a request from the buffer of the text reader, which
+ * is reused by the next request, in the batch. Returns 0 if the batch is
+ * full; the strings of the requests already in it can't move, so only an
+ * empty batch grows for a long request.
+ */
+static int keep_strings(request_batch_t *batch, request_t *request)
+{
+	size_t count = 0;
+
+	if (request->key)
+		count += request->key_len + 1;
+	if (request->value)
+		count += request->value_len + 1;
+
+	if (batch->strings_size + count > batch->strings_capacity) {
+		if (batch->count)
+			return 0;
+		batch_reserve(&batch->strings, 0, &batch->strings_capacity, count);
+	}
+
+	if (request->key)
+		request->key = copy_string(batch, request->key, request->key_len);
+	if (request->value)
+		request->value = copy_string(batch, request->value,
+									 request->value_len);
+
+	return 1;
+}
+
+/**
+ * Copies a retrieved value in the batch, with the other values of the
+ * thread that applied the request, because the next requests can replace it
+ * before it is written.
+ */
+static void keep_value(request_batch_t *batch, request_result_t *result,
+					   const char *value)
+{
+	request_values_t *values = &batch->values[result->owner];
+
+	result->value = values->size;
+	result->value_len = strlen(value);
+	batch_reserve(&values->bytes, values->size, &values->capacity,
+				  result->value_len);
+	memcpy(values->bytes + values->size, value, result->value_len);
+	values->size += result->value_len;
+}
+
+/**
+ * The first stage: fills the empty batches with requests, and hashes their
+ * keys, so the calling thread only has to apply them. The strings of a
+ * command log stay in place, the log is mapped until the end. A bad request
+ * ends the requests like the end of the input, so the ones before it are
+ * still applied and written.
+ */
+static void *read_stage(void *arg)
+{
+	pipeline_t *pipeline = arg;
+	load_balancer_t *main_server = pipeline->main_server;
+	request_batch_t *batch = spsc_ring_pop(pipeline->empty);
+	request_t request;
+
+	batch->count = 0;
+	batch->strings_size = 0;
+	while ((pipeline->status = source_next(pipeline->source, &request)) > 0) {
+		if (request.key && !request.hashed) {
+			request.hash = main_server->key_hash(request.key,
+												 main_server->hash_seed);
+			request.hashed = 1;
+		}
+
+		if (batch->count == PIPELINE_BATCH ||
+			(pipeline->source->reader && !keep_strings(batch, &request))) {
+			spsc_ring_push(pipeline->read, batch);
+			batch = spsc_ring_pop(pipeline->empty);
+			batch->count = 0;
+			batch->strings_size = 0;
+			if (pipeline->source->reader)
+				keep_strings(batch, &request);
+		}
+
+		batch->requests[batch->count++] = request;
+	}
+
+	/* an empty batch is left aside, only the writer pushes in empty */
+	if (batch->count)
+		spsc_ring_push(pipeline->read, batch);
+	spsc_ring_push(pipeline->read, NULL);
+
+	return NULL;
+}
+
+/**
+ * The last stage: writes the results of the applied batches, in order, and
+ * gives the batches back to the reader. With shards, a batch comes here as
+ * soon as it was routed, and is written once its last request was applied.
+ */
+static void *write_stage(void *arg)
+{
+	pipeline_t *pipeline = arg;
+	request_batch_t *batch;
+
+	while ((batch = spsc_ring_pop(pipeline->applied))) {
+		unsigned int spins = 0;
+
+		while (__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE))
+			spsc_ring_wait(&spins);
+
+		for (unsigned int i = 0; i < batch->count; i++) {
+			request_result_t *result = &batch->results[i];
+
+			write_result(pipeline->results, &batch->requests[i], result->kind,
+						 result->server_id,
+						 batch->values[result->owner].bytes + result->value,
+						 result->value_len);
+		}
+
+		spsc_ring_push(pipeline->empty, batch);
+	}
+
+	return NULL;
+}
+
+/**
+ * The middle stage, on the calling thread. The values are not copied if
+ * they are not written.
+ */
+static void apply_stage(pipeline_t *pipeline)
+{
+	server_batch_t servers = {NULL, NULL, 0, 0, 0};
+	int echo_values = pipeline->results->echo_values;
+	request_batch_t *batch;
+
+	while ((batch = spsc_ring_pop(pipeline->read))) {
+		batch->values[0].size = 0;
+		for (unsigned int i = 0; i < batch->count; i++) {
+			request_result_t *result = &batch->results[i];
+			char *value = NULL;
+
+			result->kind = execute_request(pipeline->main_server, &servers,
+										   &batch->requests[i],
+										   &result->server_id, &value);
+			result->owner = 0;
+			result->value = 0;
+			result->value_len = 0;
+			if (value && echo_values)
+				keep_value(batch, result, value);
+		}
+
+		spsc_ring_push(pipeline->applied, batch);
+	}
+	spsc_ring_push(pipeline->applied, NULL);
+
+	free(servers.ids);
+	free(servers.weights);
+}
+
+/**
+ * A shard applies the requests given to it, in their order, on the servers
+ * that only it uses, so it needs no locks. The writer waits for the last
+ * request of a batch, and done tells the calling thread how far it got.
+ */
+static void *shard_stage(void *arg)
+{
+	shard_worker_t *worker = arg;
+	int echo_values = worker->pipeline->results->echo_values;
+	request_result_t *result;
+
+	while ((result = spsc_ring_pop(worker->ring))) {
+		request_batch_t *batch = result->batch;
+		request_t *request = &batch->requests[result - batch->results];
+
+		if (request->type == REQUEST_STORE) {
+			server_store_hashed(result->memory, request->key, request->hash,
+								request->value);
+			result->kind = RESULT_STORED;
+		} else {
+			char *value = server_retrieve_hashed(result->memory, request->key,
+												 request->hash);
+
+			result->kind = value ? RESULT_RETRIEVED : RESULT_MISSING;
+			if (value && echo_values)
+				keep_value(batch, result, value);
+		}
+
+		__atomic_store_n(&worker->done, worker->done + 1, __ATOMIC_RELEASE);
+		__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/**
+ * Waits until every shard applied all the requests that it was given, so
+ * the servers can be changed.
+ */
+static void wait_shards(pipeline_t *pipeline, const unsigned long long *sent)
+{
+	for (unsigned int i = 0; i < pipeline->shards; i++) {
+		unsigned int spins = 0;
+
+		while (__atomic_load_n(&pipeline->workers[i].done, __ATOMIC_ACQUIRE) !=
+			   sent[i])
+			spsc_ring_wait(&spins);
+	}
+}
+
+/**
+ * The middle stage with shards, on the calling thread: routes every key to
+ * its server, and gives the request to the shard of the server. The changes
+ * of the servers are barriers: the first one of a run waits for all the
+ * requests given before it, and the next keys are routed after the run. The requests of a key always
+ * go to the same shard between two changes, so they are applied in order.
+ */
+static void route_stage(pipeline_t *pipeline)
+{
+	load_balancer_t *main_server = pipeline->main_server;
+	server_batch_t servers = {NULL, NULL, 0, 0, 0};
+	unsigned long long sent[SHARDS_MAX] = {0};
+	request_batch_t *batch;
+
+	while ((batch = spsc_ring_pop(pipeline->read))) {
+		unsigned int keys = 0;
+
+		for (unsigned int i = 0; i < pipeline->shards; i++)
+			batch->values[i].size = 0;
+		for (unsigned int i = 0; i < batch->count; i++)
+			keys += batch->requests[i].key != NULL;
+		batch->pending = keys;
+
+		for (unsigned int i = 0; i < batch->count; i++) {
+			request_t *request = &batch->requests[i];
+			request_result_t *result = &batch->results[i];
+
+			result->kind = 0;
+			result->owner = 0;
+			result->value = 0;
+			result->value_len = 0;
+			result->batch = batch;
+			/* the shards are idle from the first change to the next key */
+			if (!request->key) {
+				if (!servers.size)
+					wait_shards(pipeline, sent);
+				batch_push(main_server, &servers,
+						   request->type == REQUEST_REMOVE_SERVER,
+						   request->server_id, request->weight);
+				continue;
+			}
+
+			if (servers.size)
+				flush_batch(main_server, &servers);
+
+			/* without servers, there is nothing to give to the shards */
+			if (!main_server->num_servers) {
+				result->kind = request->type == REQUEST_STORE ?
+					RESULT_STORED : RESULT_MISSING;
+				result->server_id = -1;
+				__atomic_sub_fetch(&batch->pending, 1, __ATOMIC_RELEASE);
+				continue;
+			}
+
+			unsigned int server_id = get_server(main_server, request->hash);
+
+			result->server_id = server_id;
+			result->memory = main_server->servers[get_index(main_server,
+															server_id)].memory;
+			result->owner = server_id % pipeline->shards;
+			sent[result->owner]++;
+			spsc_ring_push(pipeline->workers[result->owner].ring, result);
+		}
+
+		spsc_ring_push(pipeline->applied, batch);
+	}
+
+	for (unsigned int i = 0; i < pipeline->shards; i++)
+		spsc_ring_push(pipeline->workers[i].ring, NULL);
+	spsc_ring_push(pipeline->applied, NULL);
+
+	free(servers.ids);
+	free(servers.weights);
+}
+
+static int run_pipeline(load_balancer_t *main_server,
+						request_source_t *source, result_writer_t *results,
+						unsigned int shards)
+{
+	unsigned int owners = shards ? shards : 1;
+	request_batch_t *batches = calloc(PIPELINE_DEPTH,
+									  sizeof(request_batch_t));
+	DIE(!batches, "Failed run_pipeline\n");
+	pipeline_t pipeline = {main_server, source, results,
+						   spsc_ring_create(PIPELINE_DEPTH),
+						   spsc_ring_create(PIPELINE_DEPTH),
+						   spsc_ring_create(PIPELINE_DEPTH), shards, NULL, 0};
+	pthread_t reader, writer;
+
+	for (unsigned int i = 0; i < PIPELINE_DEPTH; i++) {
+		batches[i].strings_capacity = PIPELINE_STRINGS;
+		batches[i].strings = malloc(PIPELINE_STRINGS);
+		batches[i].values = calloc(owners, sizeof(request_values_t));
+		DIE(!batches[i].strings || !batches[i].values,
+			"Failed run_pipeline\n");
+		for (unsigned int j = 0; j < owners; j++) {
+			batches[i].values[j].capacity = PIPELINE_STRINGS;
+			batches[i].values[j].bytes = malloc(PIPELINE_STRINGS);
+			DIE(!batches[i].values[j].bytes, "Failed run_pipeline\n");
+		}
+		spsc_ring_push(pipeline.empty, &batches[i]);
+	}
+
+	/* a shard can have a whole batch in its ring */
+	if (shards) {
+		DIE(posix_memalign((void **)&pipeline.workers, LB_CACHE_LINE,
+						   shards * sizeof(shard_worker_t)),
+			"Failed run_pipeline\n");
+		for (unsigned int i = 0; i < shards; i++) {
+			pipeline.workers[i].done = 0;
+			pipeline.workers[i].pipeline = &pipeline;
+			pipeline.workers[i].ring = spsc_ring_create(PIPELINE_BATCH);
+			DIE(pthread_create(&pipeline.workers[i].thread, NULL, shard_stage,
+							   &pipeline.workers[i]),
+				"Failed run_pipeline\n");
+		}
+	}
+
+	DIE(pthread_create(&reader, NULL, read_stage, &pipeline),
+		"Failed run_pipeline\n");
+	DIE(pthread_create(&writer, NULL, write_stage, &pipeline),
+		"Failed run_pipeline\n");
+	if (shards)
+		route_stage(&pipeline);
+	else
+		apply_stage(&pipeline);
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+
+	for (unsigned int i = 0; i < shards; i++) {
+		pthread_join(pipeline.workers[i].thread, NULL);
+		spsc_ring_free(pipeline.workers[i].ring);
+	}
+	free(pipeline.workers);
+
+	for (unsigned int i = 0; i < PIPELINE_DEPTH; i++) {
+		for (unsigned int j = 0; j < owners; j++)
+			free(batches[i].values[j].bytes);
+		free(batches[i].strings);
+		free(batches[i].values);
+	}
+	free(batches);
+	spsc_ring_free(pipeline.empty);
+	spsc_ring_free(pipeline.read);
+	spsc_ring_free(pipeline.applied);
+
+	return pipeline.status;
+}
+
+int execute_pipelined(load_balancer_t *main_server, request_source_t *source,
+					  result_writer_t *results)
+{
+	return run_pipeline(main_server, source, results, 0);
+}
+
+int execute_sharded(load_balancer_t *main_server, request_source_t *source,
+					result_writer_t *results, unsigned int shards)
+{
+	DIE(!shards || shards > SHARDS_MAX, "Failed execute_sharded\n");
+	return run_pipeline(main_server, source, results, shards);
+}
@@ -0,0 +1,73 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef REQUEST_EXECUTOR_H_
+#define REQUEST_EXECUTOR_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions that apply the requests of an input to a Load Balancer, and
+ * write their results. The consecutive changes of the servers are gathered
+ * and applied together, before the next key. execute_requests does
+ * everything on the calling thread; execute_pipelined splits the work in
+ * three stages, connected by rings of batches: a thread reads the requests
+ * (and hashes their keys), the calling thread applies them, and another
+ * thread writes the results. execute_sharded also splits the servers
+ * between threads: the calling thread only routes the keys, and the thread
+ * of a server applies its requests. The results come out in the same order
+ * every way.
+*/
+
+/**
+ * @brief Reads the next request of a text file or of a command log.
+ *
+ * @return 1 if there was a request, 0 at the end of the input, and -1 for a
+ * bad request, whose reason is left in source->error.
+ */
+int source_next(request_source_t *source, request_t *request);
+
+/**
+ * @brief Applies a request. The changes of the servers are only added to
+ * the batch, and are applied by the next store or retrieve.
+ *
+ * @param main_server The Load Balancer.
+ * @param batch The changes of the servers not applied yet.
+ * @param request The request.
+ * @param server_id Where the server of the key is written.
+ * @param value Where the retrieved value is written.
+ * @return RESULT_STORED, RESULT_RETRIEVED, RESULT_MISSING, or 0 for a change
+ * of the servers, which has no result.
+ */
+int execute_request(load_balancer_t *main_server, server_batch_t *batch,
+					request_t *request, int *server_id, char **value);
+
+/**
+ * @brief Applies all the requests of the source, one after another, and
+ * writes their results. All the execute functions stop at a bad request,
+ * once the results of the requests before it were given to the writer.
+ *
+ * @return 0 at the end of the input, -1 at a bad request.
+ */
+int execute_requests(load_balancer_t *main_server, request_source_t *source,
+					 result_writer_t *results);
+
+/**
+ * @brief Applies all the requests of the source, with the reading, the
+ * applying and the writing on three threads.
+ */
+int execute_pipelined(load_balancer_t *main_server, request_source_t *source,
+					  result_writer_t *results);
+
+/**
+ * @brief Applies all the requests of the source like execute_pipelined, but
+ * the stores and the retrieves are applied by the threads of their servers.
+ * The changes of the servers wait for all of these threads, and are applied
+ * by the calling thread.
+ *
+ * @param shards The number of threads that the servers are split between
+ * (by their ids), from 1 to SHARDS_MAX.
+ */
+int execute_sharded(load_balancer_t *main_server, request_source_t *source,
+					result_writer_t *results, unsigned int shards);
+
+#endif  // REQUEST_EXECUTOR_H_
@@ -0,0 +1,197 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "request_reader.h"
+#include "data_structs.h"
+#include "utils.h"
+
+request_reader_t *request_reader_create(int fd)
+{
+	request_reader_t *reader = malloc(sizeof(request_reader_t));
+	DIE(!reader, "Failed request_reader_create\n");
+
+	/* one more byte ends the last line, if the file doesn't */
+	reader->buffer = malloc(REQUEST_BLOCK + 1);
+	DIE(!reader->buffer, "Failed request_reader_create\n");
+
+	reader->fd = fd;
+	reader->capacity = REQUEST_BLOCK;
+	reader->start = 0;
+	reader->end = 0;
+	reader->eof = 0;
+	reader->error = NULL;
+
+	return reader;
+}
+
+/**
+ * Keeps the part of the buffer that wasn't parsed, moved to the front, and
+ * reads after it. A line that fills the whole buffer makes it twice bigger.
+ */
+static void reader_fill(request_reader_t *reader)
+{
+	size_t left = reader->end - reader->start;
+
+	if (reader->start) {
+		memmove(reader->buffer, reader->buffer + reader->start, left);
+		reader->start = 0;
+		reader->end = left;
+	} else if (left == reader->capacity) {
+		reader->capacity *= 2;
+		reader->buffer = realloc(reader->buffer, reader->capacity + 1);
+		DIE(!reader->buffer, "Failed while reading a long request\n");
+	}
+
+	ssize_t count;
+	do {
+		count = read(reader->fd, reader->buffer + reader->end,
+					 reader->capacity - reader->end);
+	} while (count < 0 && errno == EINTR);
+	DIE(count < 0, "Failed while reading the requests\n");
+
+	if (count == 0)
+		reader->eof = 1;
+	reader->end += count;
+}
+
+/**
+ * Finds the next line and ends it by 0, in place of its new line. Returns
+ * its length, and -1 at the end of the input.
+ */
+static long reader_line(request_reader_t *reader, char **line)
+{
+	size_t searched = 0;
+
+	while (1) {
+		char *start = reader->buffer + reader->start;
+		size_t size = reader->end - reader->start;
+		char *newline = memchr(start + searched, '\n', size - searched);
+
+		if (newline) {
+			*newline = '\0';
+			*line = start;
+			reader->start += newline - start + 1;
+			return newline - start;
+		}
+
+		if (reader->eof) {
+			if (size == 0)
+				return -1;
+
+			/* the last line has no new line */
+			start[size] = '\0';
+			*line = start;
+			reader->start = reader->end;
+			return size;
+		}
+
+		/* the bytes already searched are not searched again */
+		searched = size;
+		reader_fill(reader);
+	}
+}
+
+/* the text between the quote and the next one (or the end of the line) */
+static char *quoted(char *quote, char *end, unsigned int *length)
+{
+	char *text = quote + 1;
+	char *close = memchr(text, '"', end - text);
+
+	if (!close)
+		close = end;
+
+	*close = '\0';
+	*length = close - text;
+
+	return text;
+}
+
+/**
+ * store "key" "value": the key is between the first two quotes, and the
+ * value goes from the third quote to the last character of the line.
+ */
+static int parse_store(request_t *request, char *line, char *end)
+{
+	char *first = memchr(line, '"', end - line);
+	char *second = first ? memchr(first + 1, '"', end - first - 1) : NULL;
+	char *third = second ? memchr(second + 1, '"', end - second - 1) : NULL;
+	if (!third || third + 1 == end)
+		return 0;
+
+	request->key = quoted(first, second, &request->key_len);
+	request->value = third + 1;
+	request->value_len = end - 1 - request->value;
+	request->value[request->value_len] = '\0';
+
+	return 1;
+}
+
+#define IS_REQUEST(line, name) (!strncmp(line, name, sizeof(name) - 1))
+
+/* the first character after the name of the request and its space */
+static char *after_name(char *line, long length, size_t name_size)
+{
+	return line + ((size_t)length < name_size ? (size_t)length : name_size);
+}
+
+int request_next(request_reader_t *reader, request_t *request)
+{
+	char *line;
+	long length = reader_line(reader, &line);
+
+	if (length < 0)
+		return 0;
+
+	char *end = line + length;
+
+	request->key = NULL;
+	request->value = NULL;
+	request->key_len = 0;
+	request->value_len = 0;
+	request->hashed = 0;
+
+	if (IS_REQUEST(line, "store")) {
+		request->type = REQUEST_STORE;
+		if (!parse_store(request, line, end)) {
+			reader->error = "malformed store request";
+			return -1;
+		}
+	} else if (IS_REQUEST(line, "retrieve")) {
+		char *quote = memchr(line, '"', length);
+		if (!quote) {
+			reader->error = "malformed retrieve request";
+			return -1;
+		}
+
+		request->type = REQUEST_RETRIEVE;
+		request->key = quoted(quote, end, &request->key_len);
+	} else if (IS_REQUEST(line, "add_server")) {
+		char *weight;
+
+		/* an optional weight can follow the id */
+		request->type = REQUEST_ADD_SERVER;
+		request->server_id = strtol(after_name(line, length,
+											   sizeof("add_server")),
+									&weight, 10);
+		request->weight = strtoul(weight, NULL, 10);
+	} else if (IS_REQUEST(line, "remove_server")) {
+		request->type = REQUEST_REMOVE_SERVER;
+		request->server_id = strtol(after_name(line, length,
+											   sizeof("remove_server")),
+									NULL, 10);
+		request->weight = 0;
+	} else {
+		reader->error = "unknown function call";
+		return -1;
+	}
+
+	return 1;
+}
+
+void request_reader_free(request_reader_t *reader)
+{
+	free(reader->buffer);
+	free(reader);
+}
@@ -0,0 +1,41 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef REQUEST_READER_H_
+#define REQUEST_READER_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions that read the requests of an input file (store, retrieve,
+ * add_server and remove_server, one on every line). The file is read in big
+ * blocks, and every line is parsed in place, in a single pass: the key and
+ * the value of a request are not copied, they are ended by 0 inside the
+ * buffer of the reader. A line can have any length.
+*/
+
+/**
+ * @brief Starts reading the requests of a file.
+ *
+ * @param fd The file descriptor of the input, read from its current offset.
+ * @return The reader.
+ */
+request_reader_t *request_reader_create(int fd);
+
+/**
+ * @brief Parses the next request. Its key and value stay valid until the
+ * next call.
+ *
+ * @param reader The reader of the input.
+ * @param request Where the request is written.
+ * @return 1 if there was a request, 0 at the end of the input, and -1 for a
+ * malformed or unknown request, whose reason is left in reader->error; the
+ * caller stops there, after it wrote the results it already has.
+ */
+int request_next(request_reader_t *reader, request_t *request);
+
+/**
+ * @brief Frees the reader; the file is not closed.
+ */
+void request_reader_free(request_reader_t *reader);
+
+#endif  // REQUEST_READER_H_
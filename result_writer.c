@@ -0,0 +1,168 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "result_writer.h"
+#include "data_structs.h"
+#include "utils.h"
+
+result_writer_t *result_writer_create(int fd, result_format_t format,
+									  int echo_values)
+{
+	result_writer_t *writer = malloc(sizeof(result_writer_t));
+	DIE(!writer, "Failed result_writer_create\n");
+
+	writer->buffer = malloc(RESULT_BUFFER);
+	DIE(!writer->buffer, "Failed result_writer_create\n");
+
+	writer->fd = fd;
+	writer->size = 0;
+	writer->format = format;
+	writer->echo_values = echo_values;
+
+	return writer;
+}
+
+static void write_all(int fd, const char *bytes, size_t count)
+{
+	while (count) {
+		ssize_t done = write(fd, bytes, count);
+
+		if (done < 0 && errno == EINTR)
+			continue;
+		DIE(done <= 0, "Failed while writing the results");
+
+		bytes += done;
+		count -= done;
+	}
+}
+
+void result_flush(result_writer_t *writer)
+{
+	write_all(writer->fd, writer->buffer, writer->size);
+	writer->size = 0;
+}
+
+/**
+ * Makes room for count more bytes. Returns 0 if they can't fit even in an
+ * empty buffer, and then they have to be written on their own.
+ */
+static int reserve(result_writer_t *writer, size_t count)
+{
+	if (writer->size + count > RESULT_BUFFER)
+		result_flush(writer);
+
+	return count <= RESULT_BUFFER;
+}
+
+static void put_bytes(result_writer_t *writer, const void *bytes,
+					  size_t count)
+{
+	if (reserve(writer, count)) {
+		memcpy(writer->buffer + writer->size, bytes, count);
+		writer->size += count;
+	} else {
+		write_all(writer->fd, bytes, count);
+	}
+}
+
+/* the string literals, without their 0 */
+#define PUT_TEXT(writer, text) put_bytes(writer, text, sizeof(text) - 1)
+
+/**
+ * The digits are found from the last one, in a small array, and copied
+ * after that; there are at most 11 characters, with the sign.
+ */
+static void put_int(result_writer_t *writer, int number)
+{
+	char digits[12];
+	unsigned int pos = sizeof(digits);
+	unsigned int value = number < 0 ? 0u - (unsigned int)number :
+						 (unsigned int)number;
+
+	do {
+		digits[--pos] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	if (number < 0)
+		digits[--pos] = '-';
+
+	put_bytes(writer, digits + pos, sizeof(digits) - pos);
+}
+
+static void put_binary(result_writer_t *writer, char kind, int server_id,
+					   const char *text, unsigned int text_len)
+{
+	char header[1 + 2 * sizeof(uint32_t)];
+	uint32_t id = (uint32_t)server_id;
+
+	header[0] = kind;
+	memcpy(header + 1, &id, sizeof(uint32_t));
+	memcpy(header + 1 + sizeof(uint32_t), &text_len, sizeof(uint32_t));
+
+	put_bytes(writer, header, sizeof(header));
+	put_bytes(writer, text, text_len);
+}
+
+void result_stored(result_writer_t *writer, const char *value,
+				   unsigned int value_len, int server_id)
+{
+	if (writer->format == RESULT_BINARY) {
+		put_binary(writer, RESULT_STORED, server_id, value,
+				   writer->echo_values ? value_len : 0);
+		return;
+	}
+
+	if (writer->echo_values) {
+		PUT_TEXT(writer, "Stored ");
+		put_bytes(writer, value, value_len);
+		PUT_TEXT(writer, " on server ");
+	} else {
+		PUT_TEXT(writer, "Stored on server ");
+	}
+	put_int(writer, server_id);
+	PUT_TEXT(writer, ".\n");
+}
+
+void result_retrieved(result_writer_t *writer, const char *value,
+					  unsigned int value_len, int server_id)
+{
+	if (writer->format == RESULT_BINARY) {
+		put_binary(writer, RESULT_RETRIEVED, server_id, value,
+				   writer->echo_values ? value_len : 0);
+		return;
+	}
+
+	if (writer->echo_values) {
+		PUT_TEXT(writer, "Retrieved ");
+		put_bytes(writer, value, value_len);
+		PUT_TEXT(writer, " from server ");
+	} else {
+		PUT_TEXT(writer, "Retrieved from server ");
+	}
+	put_int(writer, server_id);
+	PUT_TEXT(writer, ".\n");
+}
+
+void result_missing(result_writer_t *writer, const char *key,
+					unsigned int key_len)
+{
+	if (writer->format == RESULT_BINARY) {
+		put_binary(writer, RESULT_MISSING, -1, key, key_len);
+		return;
+	}
+
+	PUT_TEXT(writer, "Key ");
+	put_bytes(writer, key, key_len);
+	PUT_TEXT(writer, " not present.\n");
+}
+
+void result_writer_free(result_writer_t *writer)
+{
+	result_flush(writer);
+	free(writer->buffer);
+	free(writer);
+}
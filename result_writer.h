@@ -0,0 +1,60 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef RESULT_WRITER_H_
+#define RESULT_WRITER_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions that write the results of the requests. The results are
+ * gathered in a big buffer, which is written with one call when it is full
+ * (and when the writer is freed), and the numbers are formatted by hand,
+ * without stdio. RESULT_TEXT writes the lines of the homework, and
+ * RESULT_BINARY writes for every result a byte with its kind (RESULT_STORED,
+ * RESULT_RETRIEVED or RESULT_MISSING), the id of the server and the length
+ * of the text as 32 bit numbers (in the byte order of the machine), and then
+ * the text: the value, or the key that is missing. Without echo_values, the
+ * values are left out of both formats (their binary length is 0), so the
+ * output doesn't grow with the values.
+*/
+
+/**
+ * @brief Creates a writer of results.
+ *
+ * @param fd Where the results are written.
+ * @param format RESULT_TEXT or RESULT_BINARY.
+ * @param echo_values 0 to leave the values out.
+ * @return The writer.
+ */
+result_writer_t *result_writer_create(int fd, result_format_t format,
+									  int echo_values);
+
+/**
+ * @brief Writes the result of a store.
+ */
+void result_stored(result_writer_t *writer, const char *value,
+				   unsigned int value_len, int server_id);
+
+/**
+ * @brief Writes the result of a retrieve that found its key.
+ */
+void result_retrieved(result_writer_t *writer, const char *value,
+					  unsigned int value_len, int server_id);
+
+/**
+ * @brief Writes the result of a retrieve whose key is not stored.
+ */
+void result_missing(result_writer_t *writer, const char *key,
+					unsigned int key_len);
+
+/**
+ * @brief Writes everything that is still in the buffer.
+ */
+void result_flush(result_writer_t *writer);
+
+/**
+ * @brief Flushes and frees the writer; the file is not closed.
+ */
+void result_writer_free(result_writer_t *writer);
+
+#endif  // RESULT_WRITER_H_
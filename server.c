@@ -4,41 +4,698 @@
 
 #include "server.h"
 #include "datastruct_funcs.h"
+#include "flat_table.h"
+#include "key_hash.h"
+#include "key_index.h"
+#include "slab.h"
 #include "data_structs.h"
 #include "utils.h"
 
-extern unsigned int hash_function_key(void *a);
-
 server_memory_t *init_server_memory()
+{
+	return init_server_memory_engine(SERVER_ENGINE_CHAINED);
+}
+
+server_memory_t *init_server_memory_engine(server_engine_t engine)
 {
 	server_memory_t *new_server = malloc(sizeof(server_memory_t));
 	DIE(!new_server, "Failed while creating a new server.\n");
-	new_server->storage = ht_create(HMAX, hash_function_key, key_val_free_function,
-									compare_function_strings);
 
-	DIE(!new_server->storage, "Failed while creating a new server.\n");
+	new_server->engine = engine;
+	new_server->storage = NULL;
+	new_server->flat = NULL;
+	new_server->index = NULL;
+	new_server->held = 0;
+
+	/**
+	 * Every object of the server comes from its own slab, so the memory of
+	 * a server is given back all at once when the server is freed.
+	 */
+	new_server->slab = slab_create();
+
+	if (engine == SERVER_ENGINE_FLAT) {
+		new_server->flat = ft_create(FT_MIN_CAPACITY, NULL);
+		DIE(!new_server->flat, "Failed while creating a new server.\n");
+		ft_set_slab(new_server->flat, new_server->slab);
+	} else {
+		new_server->storage = ht_create(HMAX, NULL,
+										key_val_free_function,
+										compare_function_strings);
+		DIE(!new_server->storage, "Failed while creating a new server.\n");
+		ht_set_slab(new_server->storage, new_server->slab);
+	}
+
+	server_set_hash(new_server, key_hash_djb2, 0);
+	DIE(pthread_rwlock_init(&new_server->lock, NULL),
+		"Failed while creating a new server.\n");
 
 	return new_server;
 }
 
-void server_store(server_memory_t *server, char *key, char *value) {
-	ht_put(server->storage, key, (strlen(key) + 1) * sizeof(char), value,
-			(strlen(value) + 1) * sizeof(char));
+void server_set_hash(server_memory_t *server, key_hash_fn key_hash,
+					 unsigned int seed)
+{
+	server->key_hash = key_hash;
+	server->hash_seed = seed;
+
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_set_hash(server->flat, key_hash, seed);
+	else
+		ht_set_hash(server->storage, key_hash, seed);
+}
+
+static int index_key(void *key, void *value, unsigned int hash, void *arg)
+{
+	(void)value;
+	ki_insert(arg, hash, key);
+
+	return 1;
+}
+
+void server_set_index(server_memory_t *server, int enabled)
+{
+	if (!enabled && server->index) {
+		ki_free(server->index);
+		server->index = NULL;
+	}
+
+	if (!enabled || server->index)
+		return;
+
+	/**
+	 * The keys that are already stored are indexed by a walk that keeps all
+	 * of them.
+	 */
+	server->index = ki_create(server->slab);
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_filter(server->flat, index_key, server->index);
+	else
+		ht_filter(server->storage, index_key, server->index);
+}
+
+int server_store(server_memory_t *server, char *key, char *value) {
+	return server_store_hashed(server, key,
+							   server->key_hash(key, server->hash_seed), value);
+}
+
+/**
+ * Stores the object, replacing the value of an existing key only if replace
+ * is set. A new key also goes in the index, which points to the copy of the
+ * key kept by the storage.
+ */
+static int server_upsert(server_memory_t *server, char *key,
+						 unsigned int key_hash, char *value, int replace)
+{
+	unsigned int key_size = (strlen(key) + 1) * sizeof(char);
+	unsigned int value_size = (strlen(value) + 1) * sizeof(char);
+	void *stored_key;
+	int inserted;
+
+	if (server->engine == SERVER_ENGINE_FLAT)
+		inserted = ft_upsert_hashed(server->flat, key, key_hash, key_size,
+									value, value_size, replace, &stored_key);
+	else
+		inserted = ht_upsert_hashed(server->storage, key, key_hash, key_size,
+									value, value_size, replace, &stored_key);
+
+	if (inserted && server->index)
+		ki_insert(server->index, key_hash, stored_key);
+
+	return inserted;
+}
+
+int server_store_hashed(server_memory_t *server, char *key,
+						unsigned int key_hash, char *value)
+{
+	return server_upsert(server, key, key_hash, value, 1);
+}
+
+int server_insert_hashed(server_memory_t *server, char *key,
+						 unsigned int key_hash, char *value)
+{
+	return server_upsert(server, key, key_hash, value, 0);
 }
 
 char *server_retrieve(server_memory_t *server, char *key) {
-	char *value = ht_get(server->storage, key);
-	if (value == NULL)
-		return NULL;
+	return server_retrieve_hashed(server, key,
+								  server->key_hash(key, server->hash_seed));
+}
 
-	return value;
+char *server_retrieve_hashed(server_memory_t *server, char *key,
+							 unsigned int key_hash)
+{
+	if (server->engine == SERVER_ENGINE_FLAT)
+		return ft_get_hashed(server->flat, key, key_hash);
+
+	return ht_get_hashed(server->storage, key, key_hash);
+}
+
+void server_prefetch(server_memory_t *server, unsigned int key_hash,
+					 int depth)
+{
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_prefetch_hashed(server->flat, key_hash, depth);
+	else
+		ht_prefetch_hashed(server->storage, key_hash, depth);
 }
 
 void server_remove(server_memory_t *server, char *key) {
-	ht_remove_entry(server->storage, key);
+	server_remove_hashed(server, key, server->key_hash(key, server->hash_seed));
+}
+
+static void server_remove_stored(server_memory_t *server, char *key,
+								 unsigned int key_hash)
+{
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_remove_entry_hashed(server->flat, key, key_hash);
+	else
+		ht_remove_entry_hashed(server->storage, key, key_hash);
+}
+
+void server_remove_hashed(server_memory_t *server, char *key,
+						  unsigned int key_hash)
+{
+	/**
+	 * The index points to the key of the storage, so it lets go first.
+	 */
+	if (server->index)
+		ki_remove(server->index, key_hash, key);
+
+	server_remove_stored(server, key, key_hash);
+}
+
+struct migrate_ctx {
+	server_memory_t *source;
+	server_route_fn route;
+	void *arg;
+	unsigned int moved;	/* the objects that left the source */
+};
+
+static int keep_or_move(void *key, void *value, unsigned int hash, void *arg)
+{
+	struct migrate_ctx *ctx = arg;
+	server_memory_t *dest = ctx->route(key, hash, ctx->arg);
+
+	if (!dest || dest == ctx->source)
+		return 1;
+
+	/**
+	 * The stored hash goes along with the object, and a key that already
+	 * exists on the destination is newer, so it keeps its value.
+	 */
+	server_insert_hashed(dest, key, hash, value);
+	ctx->moved++;
+
+	if (ctx->source->index)
+		ki_remove(ctx->source->index, hash, key);
+
+	return 0;
+}
+
+unsigned int server_migrate(server_memory_t *server, server_route_fn route,
+							void *arg)
+{
+	struct migrate_ctx ctx = {server, route, arg, 0};
+
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_filter(server->flat, keep_or_move, &ctx);
+	else
+		ht_filter(server->storage, keep_or_move, &ctx);
+
+	return ctx.moved;
+}
+
+/**
+ * Like keep_or_move, for the keys of the index: the index lets go of a moved
+ * key by itself, and the value is looked up only for the keys that move.
+ */
+static int keep_or_move_indexed(void *key, void *value, unsigned int hash,
+								void *arg)
+{
+	struct migrate_ctx *ctx = arg;
+	server_memory_t *dest = ctx->route(key, hash, ctx->arg);
+
+	(void)value;
+	if (!dest || dest == ctx->source)
+		return 1;
+
+	server_insert_hashed(dest, key, hash,
+						 server_retrieve_hashed(ctx->source, key, hash));
+	server_remove_stored(ctx->source, key, hash);
+	ctx->moved++;
+
+	return 0;
+}
+
+unsigned int server_migrate_range(server_memory_t *server, unsigned int from,
+								  unsigned int to, server_route_fn route,
+								  void *arg)
+{
+	struct migrate_ctx ctx = {server, route, arg, 0};
+
+	if (!server->index)
+		return server_migrate(server, route, arg);
+
+	/**
+	 * An arc that goes over the end of the hashring is split in two: the
+	 * hashes after from, and the ones from 0 up to to.
+	 */
+	if (from < to) {
+		ki_filter_range(server->index, from + 1, to, keep_or_move_indexed,
+						&ctx);
+	} else if (from > to) {
+		if (from != -1U)
+			ki_filter_range(server->index, from + 1, -1U,
+							keep_or_move_indexed, &ctx);
+		ki_filter_range(server->index, 0, to, keep_or_move_indexed, &ctx);
+	}
+
+	return ctx.moved;
+}
+
+/**
+ * Drops an object that has nowhere to go. The source is being emptied, so
+ * its blocks go back to its own slab.
+ */
+static void drop_node(server_memory_t *source, node_t *node)
+{
+	pair_t *pair = (pair_t *)node->data;
+
+	slab_free(source->slab, pair->key, pair->key_size);
+	slab_free(source->slab, pair->value, pair->value_size);
+	slab_free(source->slab, pair, sizeof(pair_t));
+	slab_free(source->slab, node, sizeof(node_t));
+}
+
+static void drop_strings(server_memory_t *source, void *key, void *value)
+{
+	slab_free(source->slab, key, strlen(key) + 1);
+	slab_free(source->slab, value, strlen(value) + 1);
+}
+
+/* links a node of the source in its new server */
+static void send_node(server_memory_t *source, server_memory_t *dest,
+					  node_t *node, unsigned int hash)
+{
+	pair_t *pair = (pair_t *)node->data;
+	void *stored_key;
+
+	/* a server with the other engine gets a copy */
+	if (dest->engine != SERVER_ENGINE_CHAINED) {
+		server_insert_hashed(dest, pair->key, hash, pair->value);
+		drop_node(source, node);
+		return;
+	}
+
+	if (ht_adopt_node(dest->storage, node, source->slab, &stored_key) &&
+		dest->index)
+		ki_insert(dest->index, hash, stored_key);
+}
+
+/* the same, for the key and the value of a flat table */
+static void send_strings(server_memory_t *source, server_memory_t *dest,
+						 void *key, void *value, unsigned int hash)
+{
+	if (dest->engine != SERVER_ENGINE_FLAT) {
+		server_insert_hashed(dest, key, hash, value);
+		drop_strings(source, key, value);
+		return;
+	}
+
+	if (ft_adopt(dest->flat, key, hash, value, source->slab) && dest->index)
+		ki_insert(dest->index, hash, key);
+}
+
+static void take_node(node_t *node, unsigned int hash, void *arg)
+{
+	struct migrate_ctx *ctx = arg;
+	pair_t *pair = (pair_t *)node->data;
+	server_memory_t *dest = ctx->route(pair->key, hash, ctx->arg);
+
+	if (!dest || dest == ctx->source) {
+		drop_node(ctx->source, node);
+		return;
+	}
+
+	ctx->moved++;
+	send_node(ctx->source, dest, node, hash);
+}
+
+static void take_strings(void *key, void *value, unsigned int hash, void *arg)
+{
+	struct migrate_ctx *ctx = arg;
+	server_memory_t *dest = ctx->route(key, hash, ctx->arg);
+
+	if (!dest || dest == ctx->source) {
+		drop_strings(ctx->source, key, value);
+		return;
+	}
+
+	ctx->moved++;
+	send_strings(ctx->source, dest, key, value, hash);
+}
+
+unsigned int server_drain(server_memory_t *server, server_route_fn route,
+						  void *arg)
+{
+	struct migrate_ctx ctx = {server, route, arg, 0};
+
+	/* every object leaves, so there is no need to keep the index */
+	server_set_index(server, 0);
+
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_drain(server->flat, take_strings, &ctx);
+	else
+		ht_drain(server->storage, take_node, &ctx);
+
+	return ctx.moved;
+}
+
+/**
+ * A parallel drain works in two rounds. In the first one, every worker
+ * empties its slice of the buckets (or slots) of the source, finds the
+ * destination of every object and groups the objects by destination. In the
+ * second one, every destination is filled by one worker only, with the
+ * objects of the first worker, then the ones of the second worker, and so on,
+ * which is the order of server_drain. The slab of the source is shared by all
+ * the workers, so the few moves that free or unlink its blocks are done one
+ * at a time.
+ */
+struct drain_item {
+	void *entry;	/* the node, or the key of a flat table */
+	void *value;	/* the value of a flat table */
+	unsigned int hash;
+	unsigned int dest;	/* num_dests for an object with nowhere to go */
+};
+
+struct drain_job;
+
+struct drain_worker {
+	struct drain_job *job;
+	unsigned int part;	/* the slice of the source */
+	struct drain_item *items;	/* grouped by destination, in the end */
+	unsigned int size;
+	unsigned int capacity;
+	unsigned int *starts;	/* where the items of every destination start,
+	num_dests + 2 of them */
+	unsigned long long load;	/* the objects it sends in the second round */
+	pthread_t thread;
+};
+
+struct drain_job {
+	server_memory_t *source;
+	server_memory_t **dests;
+	unsigned int num_dests;
+	server_pick_fn pick;
+	void *arg;
+	struct drain_worker *workers;
+	unsigned int threads;
+	unsigned int *owners;	/* the worker that fills every destination */
+	pthread_mutex_t donor;	/* taken for the blocks of the source slab */
+};
+
+static void collect(struct drain_worker *worker, void *entry, void *value,
+					unsigned int hash, char *key)
+{
+	struct drain_job *job = worker->job;
+	int dest = job->pick(key, hash, job->arg);
+
+	if (worker->size == worker->capacity) {
+		worker->capacity = worker->capacity ? 2 * worker->capacity : 1024;
+		worker->items = realloc(worker->items, worker->capacity *
+								sizeof(struct drain_item));
+		DIE(!worker->items, "Failed while draining a server.\n");
+	}
+
+	struct drain_item *item = &worker->items[worker->size++];
+	item->entry = entry;
+	item->value = value;
+	item->hash = hash;
+	item->dest = dest < 0 ? job->num_dests : (unsigned int)dest;
+	worker->starts[item->dest + 1]++;
+}
+
+static void collect_node(node_t *node, unsigned int hash, void *arg)
+{
+	collect(arg, node, NULL, hash, ((pair_t *)node->data)->key);
+}
+
+static void collect_strings(void *key, void *value, unsigned int hash,
+							void *arg)
+{
+	collect(arg, key, value, hash, key);
+}
+
+static void *drain_slice(void *arg)
+{
+	struct drain_worker *worker = arg;
+	struct drain_job *job = worker->job;
+	unsigned int groups = job->num_dests + 1;
+
+	if (job->source->engine == SERVER_ENGINE_FLAT)
+		ft_drain_part(job->source->flat, worker->part, job->threads,
+					  collect_strings, worker);
+	else
+		ht_drain_part(job->source->storage, worker->part, job->threads,
+					  collect_node, worker);
+
+	/**
+	 * The items are sorted by destination with a counting sort, which keeps
+	 * the order of the items of a destination.
+	 */
+	unsigned int *next = malloc(groups * sizeof(unsigned int));
+	struct drain_item *sorted = malloc((worker->size + 1) *
+									   sizeof(struct drain_item));
+	DIE(!next || !sorted, "Failed while draining a server.\n");
+
+	for (unsigned int d = 0; d < groups; d++) {
+		worker->starts[d + 1] += worker->starts[d];
+		next[d] = worker->starts[d];
+	}
+
+	for (unsigned int i = 0; i < worker->size; i++)
+		sorted[next[worker->items[i].dest]++] = worker->items[i];
+
+	free(next);
+	free(worker->items);
+	worker->items = sorted;
+
+	return NULL;
+}
+
+/* tells if moving the item frees or unlinks a block of the source slab */
+static int needs_donor(struct drain_job *job, server_memory_t *dest,
+					   struct drain_item *item)
+{
+	if (dest->engine != job->source->engine)
+		return 1;
+
+	if (job->source->engine == SERVER_ENGINE_FLAT)
+		return strlen(item->entry) + 1 > SLAB_MAX_SIZE ||
+			   strlen(item->value) + 1 > SLAB_MAX_SIZE;
+
+	pair_t *pair = (pair_t *)((node_t *)item->entry)->data;
+	return pair->key_size > SLAB_MAX_SIZE || pair->value_size > SLAB_MAX_SIZE;
+}
+
+static void *fill_dests(void *arg)
+{
+	struct drain_worker *worker = arg;
+	struct drain_job *job = worker->job;
+
+	for (unsigned int d = 0; d < job->num_dests; d++) {
+		if (job->owners[d] != worker->part)
+			continue;
+
+		server_memory_t *dest = job->dests[d];
+
+		for (unsigned int w = 0; w < job->threads; w++) {
+			struct drain_worker *from = &job->workers[w];
+
+			for (unsigned int i = from->starts[d]; i < from->starts[d + 1];
+				 i++) {
+				struct drain_item *item = &from->items[i];
+				int shared = needs_donor(job, dest, item);
+
+				if (shared)
+					pthread_mutex_lock(&job->donor);
+				if (job->source->engine == SERVER_ENGINE_FLAT)
+					send_strings(job->source, dest, item->entry, item->value,
+								 item->hash);
+				else
+					send_node(job->source, dest, item->entry, item->hash);
+				if (shared)
+					pthread_mutex_unlock(&job->donor);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* the calling thread is the first worker, the others get a thread each */
+static void run_workers(struct drain_job *job, void *(*work)(void *))
+{
+	for (unsigned int w = 1; w < job->threads; w++)
+		DIE(pthread_create(&job->workers[w].thread, NULL, work,
+						   &job->workers[w]),
+			"Failed while starting a drain worker.\n");
+
+	work(&job->workers[0]);
+
+	for (unsigned int w = 1; w < job->threads; w++)
+		pthread_join(job->workers[w].thread, NULL);
+}
+
+struct drain_group {
+	unsigned long long size;
+	unsigned int dest;
+};
+
+static int compare_groups(const void *a, const void *b)
+{
+	const struct drain_group *x = a, *y = b;
+
+	if (x->size != y->size)
+		return x->size < y->size ? 1 : -1;
+
+	return x->dest < y->dest ? -1 : x->dest > y->dest;
+}
+
+/**
+ * The biggest destinations are given first, every one of them to the worker
+ * that has the fewest objects to send so far. Returns the number of objects
+ * that have a destination.
+ */
+static unsigned int share_dests(struct drain_job *job, server_claim_fn claim)
+{
+	struct drain_group *groups = malloc((job->num_dests + 1) *
+										sizeof(struct drain_group));
+	DIE(!groups, "Failed while draining a server.\n");
+	unsigned int count = 0, moved = 0;
+
+	for (unsigned int d = 0; d < job->num_dests; d++) {
+		unsigned long long size = 0;
+
+		for (unsigned int w = 0; w < job->threads; w++)
+			size += job->workers[w].starts[d + 1] - job->workers[w].starts[d];
+
+		job->owners[d] = job->threads;
+		if (!size)
+			continue;
+
+		if (claim)
+			claim(job->dests[d], job->arg);
+		groups[count].size = size;
+		groups[count].dest = d;
+		count++;
+		moved += size;
+	}
+
+	qsort(groups, count, sizeof(struct drain_group), compare_groups);
+
+	for (unsigned int i = 0; i < count; i++) {
+		unsigned int best = 0;
+
+		for (unsigned int w = 1; w < job->threads; w++)
+			if (job->workers[w].load < job->workers[best].load)
+				best = w;
+
+		job->owners[groups[i].dest] = best;
+		job->workers[best].load += groups[i].size;
+	}
+
+	free(groups);
+
+	return moved;
+}
+
+unsigned int server_drain_parallel(server_memory_t *server,
+								   server_memory_t **dests,
+								   unsigned int num_dests,
+								   server_pick_fn pick, server_claim_fn claim,
+								   void *arg, unsigned int threads)
+{
+	struct drain_job job = {server, dests, num_dests, pick, arg, NULL,
+							threads ? threads : 1, NULL,
+							PTHREAD_MUTEX_INITIALIZER};
+
+	job.workers = calloc(job.threads, sizeof(struct drain_worker));
+	job.owners = malloc((num_dests + 1) * sizeof(unsigned int));
+	DIE(!job.workers || !job.owners, "Failed while draining a server.\n");
+
+	for (unsigned int w = 0; w < job.threads; w++) {
+		job.workers[w].job = &job;
+		job.workers[w].part = w;
+		job.workers[w].starts = calloc(num_dests + 2, sizeof(unsigned int));
+		DIE(!job.workers[w].starts, "Failed while draining a server.\n");
+	}
+
+	/* every object leaves, so there is no need to keep the index */
+	server_set_index(server, 0);
+
+	run_workers(&job, drain_slice);
+	unsigned int moved = share_dests(&job, claim);
+	run_workers(&job, fill_dests);
+
+	/* the objects with nowhere to go are freed last, by this thread */
+	for (unsigned int w = 0; w < job.threads; w++) {
+		struct drain_worker *worker = &job.workers[w];
+
+		for (unsigned int i = worker->starts[num_dests];
+			 i < worker->starts[num_dests + 1]; i++) {
+			if (server->engine == SERVER_ENGINE_FLAT)
+				drop_strings(server, worker->items[i].entry,
+							 worker->items[i].value);
+			else
+				drop_node(server, worker->items[i].entry);
+		}
+
+		free(worker->items);
+		free(worker->starts);
+	}
+
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_drain_done(server->flat);
+	else
+		ht_drain_done(server->storage);
+
+	pthread_mutex_destroy(&job.donor);
+	free(job.owners);
+	free(job.workers);
+
+	return moved;
+}
+
+unsigned int server_get_size(server_memory_t *server)
+{
+	if (server->engine == SERVER_ENGINE_FLAT)
+		return ft_get_size(server->flat);
+
+	return ht_get_size(server->storage);
 }
 
 void free_server_memory(server_memory_t *server) {
-	ht_free(server->storage);
+	if (server->index)
+		ki_free(server->index);
+	if (server->engine == SERVER_ENGINE_FLAT)
+		ft_free(server->flat);
+	else
+		ht_free(server->storage);
+	slab_destroy(server->slab);
+	pthread_rwlock_destroy(&server->lock);
 	free(server);
 }
+
+void server_lock(server_memory_t *server, int writing)
+{
+	if (writing)
+		pthread_rwlock_wrlock(&server->lock);
+	else
+		pthread_rwlock_rdlock(&server->lock);
+}
+
+void server_unlock(server_memory_t *server)
+{
+	pthread_rwlock_unlock(&server->lock);
+}
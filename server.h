@@ -2,16 +2,36 @@
 #ifndef SERVER_H_
 #define SERVER_H_
 
-struct server_memory_t;
-typedef struct server_memory_t server_memory_t;
+#include "data_structs.h"
 
 /** 
- * @brief Initialize the memory for a new server struct.
+ * @brief Initialize the memory for a new server struct, that uses the lab
+ * hashtable as its storage.
  *
  * @return Pointer to the allocated server_memory struct.
  */
 server_memory_t *init_server_memory();
 
+/** 
+ * @brief Initialize the memory for a new server struct, with the given
+ * storage engine.
+ *
+ * @param engine The engine that stores the objects of the server.
+ * @return Pointer to the allocated server_memory struct.
+ */
+server_memory_t *init_server_memory_engine(server_engine_t engine);
+
+/**
+ * @brief Sets the hash function of the keys of the server, djb2 by default.
+ * It has to be called while the server is empty.
+ *
+ * @param server Server which performs the task.
+ * @param key_hash The hash function of the keys.
+ * @param seed The seed given to it.
+ */
+void server_set_hash(server_memory_t *server, key_hash_fn key_hash,
+					 unsigned int seed);
+
 /** 
  * @brief Free the memory used by the server.
  *
@@ -20,13 +40,32 @@ server_memory_t *init_server_memory();
 void free_server_memory(server_memory_t *server);
 
 /**
- * @brief Stores a key-value pair to the server.
+ * @brief Locks the server, for the threads of a concurrent Load Balancer.
+ * Many readers can hold the lock at once, a writer holds it alone. The
+ * functions of the server don't lock it on their own.
+ *
+ * @param server Server to lock.
+ * @param writing 1 to store or remove keys, 0 to only retrieve them.
+ */
+void server_lock(server_memory_t *server, int writing);
+
+/**
+ * @brief Unlocks a server locked by server_lock.
+ *
+ * @param server Server to unlock.
+ */
+void server_unlock(server_memory_t *server);
+
+/**
+ * @brief Stores a key-value pair to the server. If the key already exists,
+ * its value is replaced.
  *
  * @param server Server which performs the task.
  * @param key Key represented as a string.
  * @param value Value represented as a string.
+ * @return 1 if the key was inserted, 0 if its value was updated.
  */
-void server_store(server_memory_t *server, char *key, char *value);
+int server_store(server_memory_t *server, char *key, char *value);
 
 /**
  * @brief Removes a key-pair value from the server.
@@ -46,4 +85,174 @@ void server_remove(server_memory_t *server, char *key);
  */
 char *server_retrieve(server_memory_t *server, char *key);
 
+/**
+ * @brief Stores a key-value pair to the server, for a key that was already
+ * hashed with the hash function of the server. If the key already exists,
+ * its value is replaced.
+ *
+ * @param server Server which performs the task.
+ * @param key Key represented as a string.
+ * @param key_hash The hash of the key.
+ * @param value Value represented as a string.
+ * @return 1 if the key was inserted, 0 if its value was updated.
+ */
+int server_store_hashed(server_memory_t *server, char *key,
+						unsigned int key_hash, char *value);
+
+/**
+ * @brief Stores a key-value pair to the server, only if the key doesn't
+ * exist there already.
+ *
+ * @param server Server which performs the task.
+ * @param key Key represented as a string.
+ * @param key_hash The hash of the key.
+ * @param value Value represented as a string.
+ * @return 1 if the key was inserted, 0 if it already existed.
+ */
+int server_insert_hashed(server_memory_t *server, char *key,
+						 unsigned int key_hash, char *value);
+
+/**
+ * @brief Removes a key-pair value from the server, for a key that was already
+ * hashed with the hash function of the server.
+ *
+ * @param server Server which performs the task.
+ * @param key Key represented as a string.
+ * @param key_hash The hash of the key.
+ */
+void server_remove_hashed(server_memory_t *server, char *key,
+						  unsigned int key_hash);
+
+/**
+ * @brief Gets the value associated with the key, for a key that was already
+ * hashed with the hash function of the server.
+ * @param server Server which performs the task.
+ * @param key Key represented as a string.
+ * @param key_hash The hash of the key.
+ *
+ * @return String value associated with the key or
+ * NULL (in case the key does not exist).
+ */
+char *server_retrieve_hashed(server_memory_t *server, char *key,
+							 unsigned int key_hash);
+
+/**
+ * @brief Starts loading the memory that a lookup of the key will read, so a
+ * batch of keys can overlap their cache misses. The depth 0 loads the place
+ * of the key in the table, and the depth 1 goes one step further, so it has
+ * to come some time after the depth 0 for the same key.
+ *
+ * @param server Server which performs the task.
+ * @param key_hash The hash of the key.
+ * @param depth 0 or 1.
+ */
+void server_prefetch(server_memory_t *server, unsigned int key_hash,
+					 int depth);
+
+/**
+ * Callback that chooses the server where a key (with its stored hash) has
+ * to go, used by server_migrate.
+ */
+typedef server_memory_t *(*server_route_fn)(char *key, unsigned int key_hash,
+											void *arg);
+
+/**
+ * @brief Moves objects from the server to other servers. The route callback
+ * is asked for every object, with the hash stored next to the key, and it
+ * returns the server where the object has to go, or NULL (or the server
+ * itself) if it stays. A moved object doesn't replace one with the same key
+ * on the destination. No key is hashed again.
+ *
+ * @param server Server which gives away the objects.
+ * @param route Callback that chooses the destination of a key.
+ * @param arg Argument passed to the callback.
+ * @return The number of objects that left the server.
+ */
+unsigned int server_migrate(server_memory_t *server, server_route_fn route,
+							void *arg);
+
+/**
+ * @brief Like server_migrate, but only the objects whose key hashes are on
+ * the arc (from, to] of the hashring are asked for. If from is bigger than
+ * to, the arc goes over the end of the hashring. Without a key index, every
+ * object is asked for.
+ *
+ * @param server Server which gives away the objects.
+ * @param from The hash before the arc.
+ * @param to The last hash of the arc.
+ * @param route Callback that chooses the destination of a key.
+ * @param arg Argument passed to the callback.
+ * @return The number of objects that left the server.
+ */
+unsigned int server_migrate_range(server_memory_t *server, unsigned int from,
+								  unsigned int to, server_route_fn route,
+								  void *arg);
+
+/**
+ * @brief Moves every object of the server to the server chosen by route,
+ * like server_migrate, but the objects are relinked in the destination
+ * instead of copied: no key or value is copied, and their memory is handed
+ * over to the slab of the destination. A moved object doesn't replace one
+ * with the same key on the destination, and the objects with nowhere to go
+ * (route returns NULL, or the server itself) are freed. The server is left
+ * empty, and its memory is kept until the destinations are freed too.
+ *
+ * @param server Server which gives away the objects.
+ * @param route Callback that chooses the destination of a key.
+ * @param arg Argument passed to the callback.
+ * @return The number of objects sent to other servers.
+ */
+unsigned int server_drain(server_memory_t *server, server_route_fn route,
+						  void *arg);
+
+/**
+ * Callbacks used by server_drain_parallel: pick gives the index of the
+ * destination of a key (with its stored hash) in the array of destinations,
+ * or -1 if it has nowhere to go, and is called from many threads at once;
+ * claim is called by the calling thread, with every destination that is
+ * about to get objects.
+ */
+typedef int (*server_pick_fn)(char *key, unsigned int key_hash, void *arg);
+typedef void (*server_claim_fn)(server_memory_t *dest, void *arg);
+
+/**
+ * @brief Like server_drain, with the work split between threads. The buckets
+ * of the server are divided between the threads, which find the destinations
+ * of their objects, and then every destination is filled by one thread, with
+ * its objects in the order of server_drain, so the servers end up exactly as
+ * after server_drain. The destinations are filled at the same time, so the
+ * more destinations, the more threads can work.
+ *
+ * @param server Server which gives away the objects, not a destination.
+ * @param dests The servers that can get objects.
+ * @param num_dests The number of destinations.
+ * @param pick Callback that chooses the destination of a key.
+ * @param claim Callback called before a destination is filled, or NULL.
+ * @param arg Argument passed to the callbacks.
+ * @param threads The number of threads, the calling one included.
+ * @return The number of objects sent to other servers.
+ */
+unsigned int server_drain_parallel(server_memory_t *server,
+								   server_memory_t **dests,
+								   unsigned int num_dests,
+								   server_pick_fn pick, server_claim_fn claim,
+								   void *arg, unsigned int threads);
+
+/**
+ * @brief Starts (or stops) keeping the keys of the server ordered by hash,
+ * in a key index. The keys already stored are indexed too.
+ *
+ * @param server Server which performs the task.
+ * @param enabled 1 to keep the index, 0 to drop it.
+ */
+void server_set_index(server_memory_t *server, int enabled);
+
+/**
+ * @brief Gets the number of objects stored on the server.
+ *
+ * @param server Server which performs the task.
+ * @return The number of objects.
+ */
+unsigned int server_get_size(server_memory_t *server);
+
 #endif  // SERVER_H_
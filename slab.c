@@ -0,0 +1,216 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <stdlib.h>
+
+#include "slab.h"
+
+/**
+ * The size classes go in steps of 16 bytes up to 256, of 64 bytes up to
+ * 1024, and of 256 bytes up to SLAB_MAX_SIZE. Every chunk and every big
+ * block is linked in the slab, so slab_destroy releases everything without
+ * knowing which blocks are still in use.
+ */
+static unsigned int slab_class(unsigned int size)
+{
+	if (size == 0)
+		return 0;
+	if (size <= 256)
+		return (size + 15) / 16 - 1;
+	if (size <= 1024)
+		return 15 + (size - 256 + 63) / 64;
+
+	return 27 + (size - 1024 + 255) / 256;
+}
+
+static unsigned int slab_class_size(unsigned int class)
+{
+	if (class < 16)
+		return (class + 1) * 16;
+	if (class < 28)
+		return 256 + (class - 15) * 64;
+
+	return 1024 + (class - 27) * 256;
+}
+
+slab_t *slab_create(void)
+{
+	slab_t *slab = calloc(1, sizeof(slab_t));
+	DIE(!slab, "Failed slab_create\n");
+
+	slab->next_chunk_size = SLAB_MIN_CHUNK;
+	slab->refs = 1;
+
+	return slab;
+}
+
+/**
+ * Cuts a block from the current chunk, starting a new chunk when it is full.
+ * The chunks grow up to SLAB_MAX_CHUNK, so small servers stay small.
+ */
+static void *slab_carve(slab_t *slab, unsigned int size)
+{
+	if (slab->cursor + size > slab->end) {
+		slab_chunk_t *chunk = malloc(sizeof(slab_chunk_t) +
+									 slab->next_chunk_size);
+		DIE(!chunk, "Failed while growing a slab\n");
+
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		slab->cursor = (char *)(chunk + 1);
+		slab->end = slab->cursor + slab->next_chunk_size;
+
+		if (slab->next_chunk_size < SLAB_MAX_CHUNK)
+			slab->next_chunk_size *= 2;
+	}
+
+	void *block = slab->cursor;
+	slab->cursor += size;
+
+	return block;
+}
+
+void *slab_alloc(slab_t *slab, unsigned int size)
+{
+	if (!slab) {
+		void *block = malloc(size);
+		DIE(!block, "Failed slab_alloc\n");
+		return block;
+	}
+
+	if (size > SLAB_MAX_SIZE) {
+		slab_large_t *large = malloc(sizeof(slab_large_t) + size);
+		DIE(!large, "Failed slab_alloc\n");
+
+		large->prev = NULL;
+		large->next = slab->large;
+		if (slab->large)
+			slab->large->prev = large;
+		slab->large = large;
+
+		return large + 1;
+	}
+
+	unsigned int class = slab_class(size);
+	void **block = slab->free_lists[class];
+
+	if (block) {
+		slab->free_lists[class] = *block;
+		return block;
+	}
+
+	return slab_carve(slab, slab_class_size(class));
+}
+
+void slab_free(slab_t *slab, void *ptr, unsigned int size)
+{
+	if (!slab || !ptr) {
+		free(ptr);
+		return;
+	}
+
+	if (size > SLAB_MAX_SIZE) {
+		slab_large_t *large = (slab_large_t *)ptr - 1;
+
+		if (large->prev)
+			large->prev->next = large->next;
+		else
+			slab->large = large->next;
+		if (large->next)
+			large->next->prev = large->prev;
+
+		free(large);
+		return;
+	}
+
+	/* the freed block keeps the link of its free list */
+	unsigned int class = slab_class(size);
+	*(void **)ptr = slab->free_lists[class];
+	slab->free_lists[class] = ptr;
+}
+
+int slab_fits(slab_t *slab, unsigned int old_size, unsigned int new_size)
+{
+	if (!slab || old_size > SLAB_MAX_SIZE)
+		return new_size <= old_size && (!slab || new_size > SLAB_MAX_SIZE);
+
+	/* the block has to go back to the same free list later */
+	return new_size <= SLAB_MAX_SIZE &&
+		   slab_class(new_size) == slab_class(old_size);
+}
+
+/**
+ * The slab keeps a reference to every donor, so the small blocks taken from
+ * it outlive its owner. The donor given blocks last is checked first: a
+ * drain hands over all its blocks in a row.
+ */
+static void slab_adopt(slab_t *slab, slab_t *donor)
+{
+	for (slab_donor_t *curr = slab->donors; curr; curr = curr->next)
+		if (curr->slab == donor)
+			return;
+
+	slab_donor_t *link = malloc(sizeof(slab_donor_t));
+	DIE(!link, "Failed while taking the blocks of a slab\n");
+
+	link->slab = donor;
+	link->next = slab->donors;
+	slab->donors = link;
+
+	/* other slabs may be taking blocks of the same donor right now */
+	__atomic_add_fetch(&donor->refs, 1, __ATOMIC_RELAXED);
+}
+
+void slab_take(slab_t *slab, slab_t *donor, void *ptr, unsigned int size)
+{
+	if (!slab || !donor || slab == donor)
+		return;
+
+	if (size <= SLAB_MAX_SIZE) {
+		if (!slab->donors || slab->donors->slab != donor)
+			slab_adopt(slab, donor);
+		return;
+	}
+
+	/* a big block has its own allocation, it just changes lists */
+	slab_large_t *large = (slab_large_t *)ptr - 1;
+
+	if (large->prev)
+		large->prev->next = large->next;
+	else
+		donor->large = large->next;
+	if (large->next)
+		large->next->prev = large->prev;
+
+	large->prev = NULL;
+	large->next = slab->large;
+	if (slab->large)
+		slab->large->prev = large;
+	slab->large = large;
+}
+
+void slab_destroy(slab_t *slab)
+{
+	/* the chunks may still hold blocks taken by other slabs */
+	if (__atomic_sub_fetch(&slab->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	while (slab->chunks) {
+		slab_chunk_t *next = slab->chunks->next;
+		free(slab->chunks);
+		slab->chunks = next;
+	}
+
+	while (slab->large) {
+		slab_large_t *next = slab->large->next;
+		free(slab->large);
+		slab->large = next;
+	}
+
+	while (slab->donors) {
+		slab_donor_t *next = slab->donors->next;
+		slab_destroy(slab->donors->slab);
+		free(slab->donors);
+		slab->donors = next;
+	}
+
+	free(slab);
+}
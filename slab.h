@@ -0,0 +1,35 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef SLAB_H_
+#define SLAB_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions for the slab allocator of a server. Small blocks are cut from
+ * big chunks and recycled through one free list per size class, the blocks
+ * bigger than SLAB_MAX_SIZE go to malloc. The size given to slab_free must be
+ * the one given to slab_alloc. A NULL slab means plain malloc and free.
+*/
+slab_t *slab_create(void);
+void *slab_alloc(slab_t *slab, unsigned int size);
+void slab_free(slab_t *slab, void *ptr, unsigned int size);
+void slab_destroy(slab_t *slab);
+
+/**
+ * Tells if a block allocated for old_size bytes can be reused in place for
+ * new_size bytes, and later be given back to slab_free with new_size.
+*/
+int slab_fits(slab_t *slab, unsigned int old_size, unsigned int new_size);
+
+/**
+ * Hands a block allocated from donor (with the given size) over to slab,
+ * without moving it: from then on it is freed to slab. The chunks of the donor
+ * stay alive until both slab_destroy(donor) and slab_destroy(slab) are
+ * called. Both slabs have to be real ones, or both NULL. Different slabs can
+ * take blocks of one donor from different threads at once, except the blocks
+ * bigger than SLAB_MAX_SIZE, which are unlinked from the donor.
+*/
+void slab_take(slab_t *slab, slab_t *donor, void *ptr, unsigned int size);
+
+#endif  // SLAB_H_
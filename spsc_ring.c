@@ -0,0 +1,73 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spsc_ring.h"
+#include "data_structs.h"
+#include "utils.h"
+
+spsc_ring_t *spsc_ring_create(unsigned int capacity)
+{
+	spsc_ring_t *ring;
+
+	DIE(!capacity || (capacity & (capacity - 1)),
+		"Failed spsc_ring_create\n");
+	DIE(posix_memalign((void **)&ring, LB_CACHE_LINE, sizeof(spsc_ring_t)),
+		"Failed spsc_ring_create\n");
+	memset(ring, 0, sizeof(spsc_ring_t));
+
+	ring->items = malloc(capacity * sizeof(void *));
+	DIE(!ring->items, "Failed spsc_ring_create\n");
+	ring->mask = capacity - 1;
+
+	return ring;
+}
+
+/* the thread that is waited for gets the processor, if there are not enough
+of them */
+void spsc_ring_wait(unsigned int *spins)
+{
+	if (++*spins < SPSC_SPINS)
+		return;
+
+	*spins = 0;
+	sched_yield();
+}
+
+void spsc_ring_push(spsc_ring_t *ring, void *item)
+{
+	unsigned int spins = 0;
+
+	/* the consumer is asked for its position only when the ring looks full */
+	while (ring->tail - ring->head_seen > ring->mask) {
+		ring->head_seen = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail - ring->head_seen > ring->mask)
+			spsc_ring_wait(&spins);
+	}
+
+	ring->items[ring->tail & ring->mask] = item;
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void *spsc_ring_pop(spsc_ring_t *ring)
+{
+	unsigned int spins = 0;
+
+	while (ring->head == ring->tail_seen) {
+		ring->tail_seen = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head == ring->tail_seen)
+			spsc_ring_wait(&spins);
+	}
+
+	void *item = ring->items[ring->head & ring->mask];
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+
+	return item;
+}
+
+void spsc_ring_free(spsc_ring_t *ring)
+{
+	free(ring->items);
+	free(ring);
+}
@@ -0,0 +1,50 @@
+/* Copyright 2023 <Tudor Cristian-Andrei> */
+#ifndef SPSC_RING_H_
+#define SPSC_RING_H_
+
+#include "data_structs.h"
+#include "utils.h"
+
+/**
+ * Functions for the rings that pass pointers from one thread to another: a
+ * single thread pushes, and a single thread pops, without locks. The two
+ * positions are on different cache lines, and each thread remembers the
+ * last position of the other one, so it reads it again only when the ring
+ * looks full (or empty). A thread that has to wait spins for a while, and
+ * then yields the processor.
+*/
+
+/**
+ * @brief Creates an empty ring.
+ *
+ * @param capacity The number of pointers it can hold, a power of 2.
+ * @return The ring.
+ */
+spsc_ring_t *spsc_ring_create(unsigned int capacity);
+
+/**
+ * @brief Adds a pointer (NULL too) at the end of the ring, waiting while the
+ * ring is full. Only the producer thread calls it.
+ */
+void spsc_ring_push(spsc_ring_t *ring, void *item);
+
+/**
+ * @brief Takes the first pointer of the ring, waiting while the ring is
+ * empty. Only the consumer thread calls it.
+ */
+void *spsc_ring_pop(spsc_ring_t *ring);
+
+/**
+ * @brief Waits a turn, in a loop that waits for another thread: spins for a
+ * while, and then yields the processor.
+ *
+ * @param spins The turns waited so far, 0 at first.
+ */
+void spsc_ring_wait(unsigned int *spins);
+
+/**
+ * @brief Frees the ring; the pointers left in it are not freed.
+ */
+void spsc_ring_free(spsc_ring_t *ring);
+
+#endif  // SPSC_RING_H_
@@ -16,13 +16,131 @@
         }                                                                      \
     } while (0)
 
-/* macro for the maximum number of buckets within a hash */
+/* macro for the initial (and minimum) number of buckets within a hash */
 #define HMAX 100
 
+/* macros for the load factor bounds of a hash; outside them, it resizes */
+#define HT_MAX_LOAD 1
+#define HT_MIN_LOAD_DIV 8
+
+/* macro for the number of buckets moved by every update during a resize */
+#define HT_REHASH_STEP 4
+
+/* macro for the number of buckets allocated (and released) together */
+#define HT_SEGMENT 16384
+
+/* macros for the flat tables: minimum capacity, load factor bounds (the
+maximum one in percents), and slots moved by every update during a resize */
+#define FT_MIN_CAPACITY 128
+#define FT_MAX_LOAD 80
+#define FT_MIN_LOAD_DIV 8
+#define FT_MIGRATE_STEP 8
+
+/* macros for the slab allocator: the size classes cover the blocks up to
+SLAB_MAX_SIZE bytes, and the chunks grow from SLAB_MIN_CHUNK to
+SLAB_MAX_CHUNK bytes */
+#define SLAB_CLASSES 40
+#define SLAB_MAX_SIZE 4096
+#define SLAB_MIN_CHUNK 4096
+#define SLAB_MAX_CHUNK (1 << 20)
+
+/* macros for the key index of a server: the minimum number of hash bits of
+the buckets, the keys per bucket before the buckets are split (and divided by
+KI_MIN_LOAD_DIV, before they are merged), the buckets split by every update,
+and the entries first allocated for a bucket */
+#define KI_MIN_BITS 4
+#define KI_MAX_LOAD 16
+#define KI_MIN_LOAD_DIV 16
+#define KI_SPLIT_STEP 4
+#define KI_MIN_ENTRIES 8
+
+/* macros for the results of loader_store */
+#define STORE_NO_SERVER -1
+#define STORE_UPDATED 0
+#define STORE_INSERTED 1
+
+/* macros for the hashring: the default number of rings of a server with
+weight 1, and the labels of the rings; the ids below RING_LABEL_BASE keep the
+labels replica * RING_LABEL_BASE + id, for the first RING_LEGACY_REPLICAS
+replicas (the ones that fit in 32 bits) */
+#define LB_DEFAULT_REPLICAS 3
+#define RING_LABEL_BASE 100000
+#define RING_LEGACY_REPLICAS 42949
+
+/* macro for the default number of slots of the Maglev lookup table; it has
+to be a prime, and much bigger than the number of servers, so that every
+server gets about the same number of slots */
+#define MAGLEV_TABLE_SIZE 65537
+
+/* macro for a hint to the processor to start loading an address that will
+be read soon; it does nothing where the compiler doesn't have it */
+#if defined(__GNUC__)
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr) ((void)(addr))
+#endif
+
+/* macros for the batched requests: the keys are routed in chunks of
+LB_BATCH_CHUNK, and the table of a key is prefetched LB_PREFETCH_DISTANCE keys
+before it is looked up (its chain, half of that before) */
+#define LB_BATCH_CHUNK 256
+#define LB_PREFETCH_DISTANCE 8
+
+/* macros for the concurrent Load Balancers: the threads that can use them at
+once, and the size of a cache line, which the epochs of two threads never
+share */
+#define LB_MAX_READERS 64
+#define LB_CACHE_LINE 64
+
+/* macro for the number of servers scored at once by the rendezvous router;
+the array of seeds is padded to a multiple of it, so the scoring loop has a
+fixed length and the compiler can turn it into vector instructions */
+#define HRW_BLOCK 8
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+	defined(__linux__)
+#define HRW_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define HRW_TARGETS
+#endif
+
+/* macros for the marks of the servers in a batch of topology changes */
+#define BATCH_REMOVED 0
+#define BATCH_ADDED 1
+#define BATCH_NEIGHBOUR 2
+
+/* macro for the size of the blocks read from an input file; a longer line
+makes the buffer of the reader grow */
+#define REQUEST_BLOCK (1 << 20)
+
+/* macros for the results of the requests: the size of the buffer of the
+results, and the kinds of the binary records */
+#define RESULT_BUFFER (1 << 20)
+#define RESULT_STORED 'S'
+#define RESULT_RETRIEVED 'R'
+#define RESULT_MISSING 'M'
+
+/* macros for the command logs: the bytes they start with, the size of their
+header (those bytes and two 32 bit numbers), and the size of the buffer of
+their writer */
+#define CMDLOG_MAGIC "LBCMDLOG"
+#define CMDLOG_MAGIC_SIZE 8
+#define CMDLOG_HEADER_SIZE 16
+#define CMDLOG_BUFFER (1 << 20)
+
+/* macros for the pipeline of the requests: the requests passed together
+between the threads (a power of 2, it is also the size of the ring of a
+shard), the batches that are used by the threads at once, the
+bytes first allocated for the strings of a batch, and the turns a thread
+spins before it yields, while it waits for another one */
+#define PIPELINE_BATCH 256
+#define PIPELINE_DEPTH 8
+#define PIPELINE_STRINGS (64 << 10)
+#define SPSC_SPINS 256
+
+/* macro for the most threads that the servers can be split between */
+#define SHARDS_MAX 64
+
 /* macro for increaseing the size of the arrays */
 #define SERVER_INC 10
 
-/*macro for a big value that has no effect to the program */
-#define IRELLEVANT 1000000
-
 #endif /* UTILS_H_ */